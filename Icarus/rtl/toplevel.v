@@ -167,7 +167,12 @@ module main(// Clock and reset
    assign        enet_aen   = 1;  // Disable Ethernet
 
 `ifdef SIMULATE_MAIN
+`ifdef VERILATOR
+   // The C++ harness, yarisim/vcosim.cpp, toggles clkin
+   wire          clk = clkin;
+`else
    reg           clk = 0;
+`endif
 `else
    wire          clk;
    wire          pll_locked;
@@ -291,7 +296,9 @@ module main(// Clock and reset
                .rs232out_d(rs232out_d));
 
 `ifdef SIMULATE_MAIN
+`ifndef VERILATOR
    always #50 clk = ~clk;
    initial #50 clk = 0;
 `endif
+`endif
 endmodule
@@ -1,4 +1,13 @@
 `timescale 1ns/10ps
+
+// The simulations read the serial input from a file, not the UART
+`ifdef __ICARUS__
+ `define RS232_FILE_INPUT 1
+`endif
+`ifdef VERILATOR
+ `define RS232_FILE_INPUT 1
+`endif
+
 module rs232(input  wire        clk,
              input  wire        rst,
 
@@ -15,7 +24,7 @@ module rs232(input  wire        clk,
 
    parameter debug = 1;
 
-`ifdef __ICARUS__
+`ifdef RS232_FILE_INPUT
    parameter inputtext  = "input.txt";
    integer   file, ch = 32, rs232in_pending = 0;
 `endif
@@ -41,17 +50,19 @@ module rs232(input  wire        clk,
 
         rd_data <= 0;
         tsc <= tsc + 1;
-`ifndef __ICARUS__
+`ifndef RS232_FILE_INPUT
         if (rs232in_attention)
           rs232in_cnt <= rs232in_cnt + 1'h1;
 `endif
 
         if (rs232_req`R) begin
-`ifdef __ICARUS__
+`ifdef RS232_FILE_INPUT
            case (addr[3:2])
            0: rd_data <= 0;
            1: begin
+`ifdef __ICARUS__
                 $display("*** serial input '%c' ***", ch);
+`endif
                 rd_data <= {24'h0,ch}; //  4
                 rs232in_pending = 0;
               end
@@ -88,10 +99,12 @@ module rs232(input  wire        clk,
    assign rs232out_d    = rs232_writedata[7:0];
    assign rs232out_w    = rs232_req`W & addr[3:0] == 0;
 
-`ifdef __ICARUS__
+`ifdef RS232_FILE_INPUT
    initial begin
       file = $fopen(inputtext, "r");
+`ifdef __ICARUS__
       $display("Opening of %s resulted in %d", inputtext, file);
+`endif
    end
 `endif
 endmodule
@@ -337,6 +337,20 @@ module stage_D(input  wire        clock
 
 
 `ifdef SIMULATE_MAIN
+`ifdef COMMIT_TRACE
+   // Binary version of the COMMIT lines below for the cosimulation,
+   // see commit_record_t in yarisim/runmips.h
+   integer     commit_trace;
+   reg  [31:0] commit_cycle;
+   initial commit_trace = $fopen("commit.trace", "wb");
+`endif
+`ifdef COMMIT_DPI
+   // In-process version for the verilated core linked into yarisim,
+   // see yarisim/vcosim.cpp
+   import "DPI-C" function void yari_commit(input int pc, input int wbr,
+                                            input int wbv);
+`endif
+
    always @(posedge clock) begin
       if (0)
          $display("%05d  d_op1_val (r%1d) %8x  d_op2_is_imm %1d ? d_simm %1d : d_rt_val (r%1d) %8x    (non fwd %8x %8x)    (d_forward_x_to_t %1d %1d %1d %1d)", $time,
@@ -365,11 +379,23 @@ module stage_D(input  wire        clock
       end
 
       // !!CAREFUL!! This line is being matched by the cosimulation,
-      // so if anything is changed, then run_simple.c:get_rtl_commit()
-      // must be adjusted accordingly.
-      if (m_valid & m_wbr[5])
+      // so if anything is changed, then cosim.c:read_rtl_event()
+      // must be adjusted accordingly.  Likewise the COMMIT_TRACE
+      // record below must stay in sync with commit_record_t in
+      // runmips.h.
+      if (m_valid & m_wbr[5]) begin
+`ifdef COMMIT_DPI
+         yari_commit(m_pc, {27'd0, m_wbr[4:0]}, m_res);
+`else
          $display("%05d  COMMIT                                             %8x:r%02d <- %8x",
                   $time, m_pc, m_wbr[4:0], m_res);
+`endif
+`ifdef COMMIT_TRACE
+         commit_cycle = $time / 100;
+         $fwrite(commit_trace, "%u%u%u%u",
+                 32'hC0CC0000 | m_wbr[4:0], m_pc, m_res, commit_cycle);
+`endif
+      end
 
       if (debug) begin
          $display("%5db DE: instr %8x valid %d (m_wbr:%2x) (i_npc %8x i_offset*4 %8x target %8x)",
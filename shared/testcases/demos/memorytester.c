@@ -22,6 +22,7 @@ int main(int argc, char **argv)
 {
     unsigned i, j, cur, *p;
     unsigned k;
+    int failures = 0;
 
     printf("Memory Testing\n");
 
@@ -63,7 +64,11 @@ int main(int argc, char **argv)
 
         if (p == ring[0])
             printf("Succeeded\n");
-        else
+        else {
             printf("Failure\n");
+            ++failures;
+        }
     }
+
+    return failures != 0;
 }
@@ -120,4 +120,5 @@ main()
     printf("%d: %d\n", i, nodes[i]);
   }
   printf("total: %d\nx wins by %d\n", s, c);
+  return 0;
 }
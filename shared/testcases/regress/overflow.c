@@ -0,0 +1,78 @@
+#include <stdio.h>
+
+/*
+ * Test the overflow exception of ADD and SUB
+ *
+ * Only operands of the same sign (different signs for SUB) can
+ * overflow.  The exception handler below is linked at the vector (see
+ * the Makefile); it counts the exceptions in $27 and resumes after the
+ * trapping instruction, which leaves its destination alone.
+ */
+
+asm(".pushsection .vectors, \"ax\";"
+    ".set push;"
+    ".set noreorder;"
+    ".set noat;"
+    "mfc0  $26, $14;"
+    "addiu $26, $26, 4;"
+    "mtc0  $26, $14;"
+    "mtc0  $26, $30;"             // ERET goes to ErrorEPC out of reset
+    "addiu $27, $27, 1;"
+    "eret;"
+    "nop;"
+    ".set pop;"
+    ".popsection");
+
+static int overflows(void)
+{
+    int n;
+
+    asm volatile("move %0, $27" : "=r" (n));
+    return n;
+}
+
+static void test(const char *name, int s, int t)
+{
+    int n = overflows();
+    int r = 0x5a5a5a5a;
+
+    if (name[0] == 'a')
+        asm volatile(".set push;"
+                     ".set noreorder;"
+                     "add %0, %1, %2;"
+                     "nop;"
+                     ".set pop" : "+r" (r) : "r" (s), "r" (t));
+    else
+        asm volatile(".set push;"
+                     ".set noreorder;"
+                     "sub %0, %1, %2;"
+                     "nop;"
+                     ".set pop" : "+r" (r) : "r" (s), "r" (t));
+
+    if (overflows() != n)
+        printf("%s %08x %08x overflows (%08x)\n", name, s, t, r);
+    else
+        printf("%s %08x %08x = %08x\n", name, s, t, r);
+}
+
+int main()
+{
+    test("add", -1, 1);
+    test("add", 1, -1);
+    test("add", 0x7fffffff, 0x80000000);
+    test("add", 0x40000000, 0x3fffffff);
+    test("add", -5, -7);
+    test("add", 0x7fffffff, 1);
+    test("add", 0x80000000, -1);
+    test("add", 0x80000000, 0x80000000);
+
+    test("sub", 5, 7);
+    test("sub", -5, 7);
+    test("sub", -1, 0x80000000);
+    test("sub", 0x80000000, 0x80000000);
+    test("sub", 0, 0x80000000);
+    test("sub", 0x7fffffff, -1);
+    test("sub", 0x80000000, 1);
+
+    return 0;
+}
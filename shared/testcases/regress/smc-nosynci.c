@@ -0,0 +1,46 @@
+#include <stdio.h>
+
+/*
+ * Test self-modifying code without SYNCI
+ *
+ * Nothing tells the I$ about the patch, so as long as the line holding
+ * patchme() stays resident the old instruction keeps running.  Which
+ * calls see which value is up to the cache model, but the simulator's
+ * engines must all agree on it (make regress-engines).
+ */
+
+asm(".text;"
+    ".globl patchme;"
+    ".ent patchme;"
+    "patchme:"
+    ".set push;"
+    ".set noreorder;"
+    "jr $31;"
+    "li $2, 1729;"
+    ".set pop;"
+    ".end patchme");
+
+int patchme(void);
+
+int main()
+{
+    unsigned *p = (unsigned *) patchme;
+    int i, stale = 0;
+
+    for (i = 0; i < 100; ++i) {
+        if (patchme() == 1729)
+            ++stale;
+        p[1] = 0x24020000 | i; // li $2, i
+    }
+
+    printf("%d of 100 calls ran the stale instruction\n", stale);
+
+    asm(".set push;"
+        ".set mips32r2;"
+        "synci %0;"
+        ".set pop" :: "m" (p[1]));
+
+    printf("After SYNCI: %d\n", patchme());
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+#include <stdio.h>
+
+/*
+ * A store for make regress-watch to stop at: with a watchpoint on
+ * magic the program must stop right after it, having found 0x1729
+ * there and left 0xcafe.  Elsewhere it just runs to the end.
+ */
+
+volatile unsigned magic = 0x1729;
+
+int main()
+{
+    magic = 0xcafe;
+
+    printf("Ran past the store to magic\n");
+
+    return 0;
+}
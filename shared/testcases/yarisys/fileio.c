@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Test the file host calls: open, write, lseek, read, fstat and close
+ * on a host file, with transfers larger than the 64 KiB yarisim moves
+ * per call so that the short reads and writes get exercised too.
+ */
+
+#define NAME "fileio.tmp"
+#define SIZE 100000
+
+static unsigned char out[SIZE], in[SIZE];
+static int failures;
+
+static void check(const char *what, int ok)
+{
+    if (!ok) {
+        printf("%s failed\n", what);
+        ++failures;
+    }
+}
+
+int main()
+{
+    struct stat st;
+    int fd, i, n, got;
+
+    for (i = 0; i < SIZE; ++i)
+        out[i] = i * 7 + (i >> 8);
+
+    fd = open(NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    check("open", fd > 2);
+    check("write", write(fd, out, SIZE) == SIZE);
+    check("lseek to the end", lseek(fd, 0, SEEK_CUR) == SIZE);
+
+    check("fstat", fstat(fd, &st) == 0);
+    check("fstat size", st.st_size == SIZE);
+
+    check("lseek to the start", lseek(fd, 0, SEEK_SET) == 0);
+    for (got = 0; got < SIZE; got += n) {
+        n = read(fd, in + got, SIZE - got);
+        if (n <= 0)
+            break;
+    }
+    check("read", got == SIZE);
+    check("read data", memcmp(in, out, SIZE) == 0);
+    check("read at the end", read(fd, in, 1) == 0);
+
+    memset(in, 0, 16);
+    check("lseek into the middle", lseek(fd, 70001, SEEK_SET) == 70001);
+    check("short read", read(fd, in, 16) == 16);
+    check("short read data", memcmp(in, out + 70001, 16) == 0);
+
+    check("overwrite", lseek(fd, -16, SEEK_CUR) == 70001 && write(fd, "yari", 4) == 4);
+    check("lseek back", lseek(fd, -4, SEEK_CUR) == 70001);
+    check("reread", read(fd, in, 5) == 5 && memcmp(in, "yari", 4) == 0 && in[4] == out[70005]);
+    check("lseek past the end", lseek(fd, 0, SEEK_END) == SIZE);
+
+    check("close", close(fd) == 0);
+    check("closed", read(fd, in, 1) == -1);
+    check("open missing", open("fileio.missing/x", O_RDONLY) == -1);
+
+    if (failures)
+        printf("TEST FAILED WITH %d failures\n", failures);
+    else
+        printf("TEST SUCCESS!\n");
+
+    return failures != 0;
+}
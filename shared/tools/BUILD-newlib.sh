@@ -49,6 +49,8 @@ int main(int c, char**v)
 }
 EOF
 $target-gcc -O -Tyari.ld hw.c -o hw
+# Same, doing its I/O through yarisim's host calls
+$target-gcc -O -Tyarisys.ld hw.c -o hw-yarisys
 
 
 
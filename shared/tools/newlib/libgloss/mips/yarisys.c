@@ -0,0 +1,144 @@
+/* yarisys.c -- I/O code for programs running on yarisim
+ *
+ * Everything goes to the host through SYSCALL, a buffer at a time,
+ * see shared/yarisim/hostcall.c for the interface.  Only yarisim
+ * implements it, programs for the FPGA link with -Tyari.ld instead
+ * of -Tyarisys.ld.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "syscall.h"
+
+/* What SYS_fstat fills in */
+struct yarisys_stat {
+  unsigned int mode;
+  unsigned int size;
+  unsigned int blksize;
+  unsigned int mtime;
+};
+
+static int yarisys(int n, int a0, int a1, int a2)
+{
+  register int v0 asm("$2") = n;
+  register int v1 asm("$3");
+  register int r4 asm("$4") = a0;
+  register int r5 asm("$5") = a1;
+  register int r6 asm("$6") = a2;
+
+  asm volatile ("syscall"
+                : "+r" (v0), "=r" (v1)
+                : "r" (r4), "r" (r5), "r" (r6)
+                : "memory");
+
+  if (v0 == -1)
+    errno = v1;
+
+  return v0;
+}
+
+int open(const char *path, int flags, int mode)
+{
+  return yarisys(SYS_open, (int) path, flags, mode);
+}
+
+int close(int fd)
+{
+  return yarisys(SYS_close, fd, 0, 0);
+}
+
+int read(int fd, char *buf, int nbytes)
+{
+  return yarisys(SYS_read, fd, (int) buf, nbytes);
+}
+
+/* The host may take less than all of it */
+int write(int fd, const char *buf, int nbytes)
+{
+  int n, done = 0;
+
+  while (done < nbytes) {
+    n = yarisys(SYS_write, fd, (int) buf + done, nbytes - done);
+    if (n <= 0)
+      return done ? done : n;
+    done += n;
+  }
+
+  return done;
+}
+
+int lseek(int fd, int offset, int whence)
+{
+  return yarisys(SYS_lseek, fd, offset, whence);
+}
+
+int fstat(int fd, struct stat *st)
+{
+  struct yarisys_stat ys;
+
+  if (yarisys(SYS_fstat, fd, (int) &ys, 0) < 0)
+    return -1;
+
+  memset(st, 0, sizeof *st);
+  st->st_mode    = ys.mode;
+  st->st_size    = ys.size;
+  st->st_blksize = ys.blksize;
+  st->st_mtime   = ys.mtime;
+
+  return 0;
+}
+
+int gettimeofday(struct timeval *tv, void *tz)
+{
+  return yarisys(SYS_gettimeofday, (int) tv, 0, 0);
+}
+
+/* For print.c and putnum.c */
+int outbyte(unsigned char c)
+{
+  return write(1, (char *) &c, 1);
+}
+
+unsigned char inbyte(void)
+{
+  char c = 0;
+
+  read(0, &c, 1);
+  return c;
+}
+
+
+
+/* define the size of the memory - if not yet available */
+#ifndef YARI_MEM_SIZE
+#define YARI_MEM_SIZE 0x100000
+#endif
+
+/* See yarimon.c, only the size is used (by sbrk) */
+struct s_mem
+{
+  unsigned int size;
+  unsigned int icsize;
+  unsigned int dcsize;
+};
+
+void
+get_mem_info (mem)
+     struct s_mem *mem;
+{
+  mem->size = YARI_MEM_SIZE;
+  mem->icsize = 0;
+  mem->dcsize = 0;
+}
+
+void __pre_main(void)
+{
+}
+
+/* crt0_yari.S's _exit passes the exit status along */
+void __post_main(int status)
+{
+  yarisys(SYS_exit, status, 0, 0);
+}
@@ -0,0 +1,292 @@
+/*
+ * Set associative cache model, used for both the I$ and the D$.
+ *
+ * The geometry and replacement policy are picked at run time.  The
+ * tags of a set are kept next to each other, so a lookup touches a
+ * single host cache line for sane associativities.  Only the I$
+ * keeps the line contents, as it has to be able to hand out stale
+ * instructions, just like the hardware does.
+ *
+ * Terminology: a set is what the RTL calls a line index, the RTL's
+ * sets are our ways.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include "mips32.h"
+#include "runmips.h"
+
+#define CACHE_INVALID (~0U)
+
+static const char *const policy_name[] = {
+        [CACHE_LRU]         = "LRU",
+        [CACHE_ROUND_ROBIN] = "round-robin",
+        [CACHE_RANDOM]      = "random",
+};
+
+int cache_policy(const char *name)
+{
+        int p;
+
+        for (p = 0; p < sizeof policy_name / sizeof policy_name[0]; ++p)
+                if (strcasecmp(name, policy_name[p]) == 0)
+                        return p;
+
+        if (strcasecmp(name, "rr") == 0)
+                return CACHE_ROUND_ROBIN;
+
+        fatal("Unknown cache replacement policy %s (try lru, rr or random)\n", name);
+}
+
+void cache_init(cache_t *c, const char *name,
+                unsigned ways, unsigned sets_log2, unsigned line_log2,
+                int policy, int keep_data)
+{
+        unsigned n;
+
+        if (ways == 0 || ways > 64 || line_log2 < 2 || sets_log2 + line_log2 > 31)
+                fatal("Unsupported %s geometry: %u ways of %u lines of %u bytes\n",
+                      name, ways, 1 << sets_log2, 1 << line_log2);
+
+        memset(c, 0, sizeof *c);
+        c->name      = name;
+        c->ways      = ways;
+        c->sets_log2 = sets_log2;
+        c->line_log2 = line_log2;
+        c->policy    = policy;
+
+        n = ways << sets_log2;
+        c->tag = malloc(n * sizeof c->tag[0]);
+        if (policy == CACHE_LRU)
+                c->stamp = calloc(n, sizeof c->stamp[0]);
+        if (keep_data)
+                c->data = calloc(n << (line_log2 - 2), sizeof c->data[0]);
+
+        if (!c->tag || (policy == CACHE_LRU && !c->stamp) || (keep_data && !c->data))
+                fatal("Out of memory for the %s model\n", name);
+
+        memset(c->tag, 0xFF, n * sizeof c->tag[0]);
+}
+
+void cache_free(cache_t *c)
+{
+        free(c->tag);
+        free(c->stamp);
+        free(c->data);
+        memset(c, 0, sizeof *c);
+}
+
+void cache_print(cache_t *c)
+{
+        uint64_t n = c->hits + c->misses;
+
+        printf("%s %llu hits / %llu misses = %4.2f%% miss rate"
+               " (%u KiB %u-way, %u B lines, %s)\n",
+               c->name,
+               (long long unsigned) c->hits, (long long unsigned) c->misses,
+               n ? 100.0 * c->misses / n : 0.0,
+               (c->ways << (c->sets_log2 + c->line_log2)) / 1024,
+               c->ways, 1 << c->line_log2, policy_name[c->policy]);
+}
+
+/* The way holding address or -1, without counting as a use */
+int cache_lookup(cache_t *c, uint32_t address)
+{
+        uint32_t tag = address >> (c->sets_log2 + c->line_log2);
+        unsigned base = cache_set(c, address) * c->ways;
+        unsigned way;
+
+        for (way = 0; way < c->ways; ++way)
+                if (c->tag[base + way] == tag)
+                        return way;
+
+        return -1;
+}
+
+int cache_probe(cache_t *c, uint32_t address)
+{
+        int way = cache_lookup(c, address);
+
+        if (way >= 0 && c->stamp)
+                c->stamp[cache_set(c, address) * c->ways + way] = ++c->clock;
+
+        return way;
+}
+
+int cache_fill(cache_t *c, uint32_t address)
+{
+        unsigned base = cache_set(c, address) * c->ways;
+        unsigned way, k;
+
+        /*
+         * Invalid ways go first, except for round-robin which just
+         * follows the pointer, like the original I$ model did.
+         */
+        if (c->policy != CACHE_ROUND_ROBIN)
+                for (way = 0; way < c->ways; ++way)
+                        if (c->tag[base + way] == CACHE_INVALID)
+                                goto found;
+
+        switch (c->policy) {
+        case CACHE_LRU:
+                for (way = 0, k = 1; k < c->ways; ++k)
+                        if (c->stamp[base + k] < c->stamp[base + way])
+                                way = k;
+                break;
+
+        case CACHE_RANDOM:
+                /* Same LFSR as the RTL */
+                c->lfsr = (c->lfsr << 1) | ((~(c->lfsr >> 32) ^ (c->lfsr >> 19)) & 1);
+                c->lfsr &= (1ULL << 33) - 1;
+                way = c->lfsr % c->ways;
+                break;
+
+        default:
+                /* One pointer for the whole cache, as the original model had */
+                way = c->next_way++ % c->ways;
+                break;
+        }
+
+found:
+        c->tag[base + way] = address >> (c->sets_log2 + c->line_log2);
+        if (c->stamp)
+                c->stamp[base + way] = ++c->clock;
+
+        return way;
+}
+
+int cache_access(cache_t *c, uint32_t address, int allocate)
+{
+        if (cache_probe(c, address) >= 0) {
+                ++c->hits;
+                return 1;
+        }
+
+        ++c->misses;
+        if (allocate)
+                cache_fill(c, address);
+        return 0;
+}
+
+void cache_invalidate(cache_t *c, uint32_t address)
+{
+        uint32_t tag = address >> (c->sets_log2 + c->line_log2);
+        unsigned base = cache_set(c, address) * c->ways;
+        unsigned way;
+
+        for (way = 0; way < c->ways; ++way)
+                if (c->tag[base + way] == tag)
+                        c->tag[base + way] = CACHE_INVALID;
+}
+
+/*
+ * Cache sweep, using Mattson's stack distance analysis.
+ *
+ * For a given number of sets and line size, an access that hits at
+ * depth d of its set's LRU stack hits in every LRU cache with more
+ * than d ways.  Keeping an 8 deep stack for each power-of-two set
+ * count thus gives the miss rate of all the 1 to 8 way
+ * configurations at once.  The stacks hold line addresses.
+ */
+
+void cache_sweep_init(cache_sweep_t *s, const char *name, unsigned line_log2)
+{
+        const unsigned depth = 1 << SWEEP_WAYS_LOG2;
+        int lo = SWEEP_MIN_SIZE_LOG2 - SWEEP_WAYS_LOG2 - (int) line_log2;
+        int hi = SWEEP_MAX_SIZE_LOG2 - (int) line_log2;
+        unsigned k;
+
+        if (hi < 0)
+                fatal("%s lines too large for a cache sweep\n", name);
+
+        memset(s, 0, sizeof *s);
+        s->name = name;
+        s->line_log2 = line_log2;
+        s->min_sets_log2 = lo < 0 ? 0 : lo;
+        s->max_sets_log2 = hi;
+
+        for (k = s->min_sets_log2; k <= s->max_sets_log2; ++k) {
+                s->stack[k] = malloc((depth << k) * sizeof s->stack[k][0]);
+                if (!s->stack[k])
+                        fatal("Out of memory for the %s sweep\n", name);
+                memset(s->stack[k], 0xFF, (depth << k) * sizeof s->stack[k][0]);
+        }
+}
+
+void cache_sweep_free(cache_sweep_t *s)
+{
+        unsigned k;
+
+        for (k = 0; k <= SWEEP_MAX_SETS_LOG2; ++k)
+                free(s->stack[k]);
+        memset(s, 0, sizeof *s);
+}
+
+void cache_sweep_access(cache_sweep_t *s, uint32_t address)
+{
+        const unsigned depth = 1 << SWEEP_WAYS_LOG2;
+        uint32_t line = address >> s->line_log2;
+        unsigned k, d;
+
+        ++s->accesses;
+        for (k = s->min_sets_log2; k <= s->max_sets_log2; ++k) {
+                uint32_t *st = s->stack[k] + (line & ((1 << k) - 1)) * depth;
+
+                if (st[0] == line) {
+                        ++s->dist[k][0];
+                        continue;
+                }
+
+                for (d = 1; d < depth && st[d] != line; ++d)
+                        ;
+                ++s->dist[k][d];
+
+                /* Move to the top, pushing out the bottom on a miss */
+                if (d == depth)
+                        --d;
+                memmove(st + 1, st, d * sizeof st[0]);
+                st[0] = line;
+        }
+}
+
+void cache_sweep_print(cache_sweep_t *s)
+{
+        unsigned size_log2, ways_log2, d;
+
+        printf("%s LRU miss rates with %u B lines (%llu accesses)\n",
+               s->name, 1 << s->line_log2, (long long unsigned) s->accesses);
+        printf("  size ");
+        for (ways_log2 = 0; ways_log2 <= SWEEP_WAYS_LOG2; ++ways_log2)
+                printf(" %6u-way", 1 << ways_log2);
+        putchar('\n');
+
+        for (size_log2 = SWEEP_MIN_SIZE_LOG2; size_log2 <= SWEEP_MAX_SIZE_LOG2; ++size_log2) {
+                printf("%3u KiB", 1 << (size_log2 - 10));
+                for (ways_log2 = 0; ways_log2 <= SWEEP_WAYS_LOG2; ++ways_log2) {
+                        int k = size_log2 - ways_log2 - s->line_log2;
+                        uint64_t misses = 0;
+
+                        if (k < (int) s->min_sets_log2 || k > (int) s->max_sets_log2) {
+                                printf(" %10s", "-");
+                                continue;
+                        }
+
+                        for (d = 1 << ways_log2; d <= 1 << SWEEP_WAYS_LOG2; ++d)
+                                misses += s->dist[k][d];
+
+                        printf(" %9.2f%%",
+                               s->accesses ? 100.0 * misses / s->accesses : 0.0);
+                }
+                putchar('\n');
+        }
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,395 @@
+/*
+ * Checkpoints: the complete state of a machine in a file, so that a
+ * long workload can be run to the interesting point once and then
+ * restored any number of times.
+ *
+ * The file is a private snapshot for the host that wrote it (native
+ * byte order and struct layout) and is laid out as
+ *
+ *      header
+ *      the CKPT_FIELDS of the machine
+ *      the I$ and D$ models
+ *      the mapped memory ranges
+ *      the page table
+ *      the page data, CKPT_PAGE_SIZE aligned
+ *
+ * Memory is saved a page at a time.  Pages repeating a single word
+ * (never touched, thus still zero or the fill pattern of
+ * initialize_memory()) are kept in the page table only.  The other
+ * pages are stored as is, page aligned, so that restoring with
+ * --flat-memory just maps them copy-on-write.
+ *
+ * Not saved: the translation cache (rebuilt on demand), the timing
+ * model's pipeline state, the cache sweeps and the serial input file
+ * position or what has been buffered from it.  The hazard statistics
+ * can be off by one across the checkpoint, as a hazard straddling it
+ * isn't seen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "mips32.h"
+#include "runmips.h"
+
+#define CKPT_MAGIC      "YARICKPT"
+#define CKPT_VERSION    4
+#define CKPT_PAGE_BITS  12
+#define CKPT_PAGE_SIZE  (1 << CKPT_PAGE_BITS)
+
+/* Bump CKPT_VERSION when changing this or any of the ckpt_*_t below */
+#define CKPT_FIELDS(F)                                                  \
+        F(state) F(endian_is_big) F(program_entry)                      \
+        F(text_start) F(text_size) F(nsections)                         \
+        F(section_start) F(section_size) F(text_segments)               \
+        F(serial_wait) F(rs232in_data) F(rs232in_cnt) F(rs232in_pending) \
+        F(rs232out_ready) F(rs232in_ready)                              \
+        F(keys) F(vsynccnt) F(framebuffer_start) F(framebuffer_size)    \
+        F(TSC) F(coverage) F(icache_dirty_map)                          \
+        F(n_cycle) F(n_stall) F(n_issue) F(n_call)                      \
+        F(n_tc_blocks) F(n_tc_flushes) F(n_dbt_blocks) F(n_idle)        \
+        F(stat_gen_load_hazard) F(stat_load_use_hazard_rs)              \
+        F(stat_load_use_hazard_rt) F(stat_load32_use_hazard)            \
+        F(stat_shift_use_hazard) F(stat_nop)                            \
+        F(stat_nop_delay_slots) F(stat_nop_useless)
+
+typedef struct ckpt_header {
+        char            magic[8];
+        uint32_t        version;
+        uint32_t        machine_size;   // Guards against a changed yarisim_t
+        uint32_t        nranges;
+        uint32_t        npages;
+} ckpt_header_t;
+
+typedef struct ckpt_cache {
+        uint32_t        ways, sets_log2, line_log2, policy;
+        uint32_t        has_stamp, has_data;
+        uint64_t        clock, lfsr, hits, misses;
+        uint32_t        next_way, pad;
+} ckpt_cache_t;
+
+typedef struct ckpt_range {
+        uint64_t        start, len;
+} ckpt_range_t;
+
+typedef struct ckpt_page {
+        uint32_t        address;
+        uint32_t        len;
+        uint32_t        fill;           // The repeated word, if not stored
+        uint32_t        stored;
+        uint64_t        offset;         // From the start of the page data
+} ckpt_page_t;
+
+static void put(FILE *f, const void *p, size_t n)
+{
+        if (n && fwrite(p, n, 1, f) != 1)
+                fatal("Writing the checkpoint: %s\n", strerror(errno));
+}
+
+static void get(FILE *f, void *p, size_t n)
+{
+        if (n && fread(p, n, 1, f) != 1)
+                fatal("Reading the checkpoint: %s\n",
+                      feof(f) ? "truncated" : strerror(errno));
+}
+
+static void put_cache(FILE *f, cache_t *c)
+{
+        ckpt_cache_t h = {
+                .ways      = c->tag ? c->ways : 0,
+                .sets_log2 = c->sets_log2,
+                .line_log2 = c->line_log2,
+                .policy    = c->policy,
+                .has_stamp = c->stamp != NULL,
+                .has_data  = c->data != NULL,
+                .clock     = c->clock,
+                .lfsr      = c->lfsr,
+                .hits      = c->hits,
+                .misses    = c->misses,
+                .next_way  = c->next_way,
+        };
+        size_t n = (size_t) h.ways << h.sets_log2;
+
+        put(f, &h, sizeof h);
+        put(f, c->tag, n * sizeof c->tag[0]);
+        if (h.has_stamp)
+                put(f, c->stamp, n * sizeof c->stamp[0]);
+        if (h.has_data)
+                put(f, c->data, (n << (h.line_log2 - 2)) * sizeof c->data[0]);
+}
+
+/*
+ * The contents only carry over into a model of the same geometry,
+ * otherwise it starts out cold.
+ */
+static void get_cache(FILE *f, cache_t *c)
+{
+        ckpt_cache_t h;
+        size_t n, size;
+        int match;
+
+        get(f, &h, sizeof h);
+        n = (size_t) h.ways << h.sets_log2;
+        size = n * sizeof c->tag[0] +
+                (h.has_stamp ? n * sizeof c->stamp[0] : 0) +
+                (h.has_data ? (n << (h.line_log2 - 2)) * sizeof c->data[0] : 0);
+
+        match = h.ways && c->tag &&
+                h.ways == c->ways && h.sets_log2 == c->sets_log2 &&
+                h.line_log2 == c->line_log2 && h.policy == c->policy &&
+                h.has_stamp == (c->stamp != NULL) &&
+                h.has_data == (c->data != NULL);
+
+        if (!match) {
+                if (h.ways && c->tag)
+                        fprintf(stderr, "The checkpoint's %s has a different geometry, "
+                                "starting out cold\n", c->name);
+                if (fseek(f, size, SEEK_CUR))
+                        fatal("Reading the checkpoint: %s\n", strerror(errno));
+                return;
+        }
+
+        get(f, c->tag, n * sizeof c->tag[0]);
+        if (h.has_stamp)
+                get(f, c->stamp, n * sizeof c->stamp[0]);
+        if (h.has_data)
+                get(f, c->data, (n << (h.line_log2 - 2)) * sizeof c->data[0]);
+
+        c->clock    = h.clock;
+        c->lfsr     = h.lfsr;
+        c->hits     = h.hits;
+        c->misses   = h.misses;
+        c->next_way = h.next_way;
+}
+
+/* The mapped memory as ranges, which must have room for enough */
+static unsigned mapped_ranges(ckpt_range_t *r)
+{
+        unsigned n = 0;
+        uint64_t p;
+        int s;
+
+        if (!yari->flat_memory) {
+                for (s = 0; s < NSEGMENT; ++s)
+                        if (yari->memory_segment_size[s]) {
+                                r[n].start = seg2virt(s);
+                                r[n].len   = yari->memory_segment_size[s];
+                                ++n;
+                        }
+                return n;
+        }
+
+        for (p = 0; p < 1ULL << 32; p += 1 << FLAT_PAGE_BITS) {
+                if (!flat_mapped(p))
+                        continue;
+                if (n && r[n - 1].start + r[n - 1].len == p) {
+                        r[n - 1].len += 1 << FLAT_PAGE_BITS;
+                } else {
+                        r[n].start = p;
+                        r[n].len   = 1 << FLAT_PAGE_BITS;
+                        ++n;
+                }
+        }
+
+        return n;
+}
+
+/* A page that is a single word repeated (p[i] == p[i + 4] for all i) */
+static int uniform(const uint8_t *p, size_t len)
+{
+        return len >= 4 && memcmp(p, p + 4, len - 4) == 0;
+}
+
+void checkpoint_save(const char *filename)
+{
+        /* Worst case, every other flat page is mapped */
+        unsigned max_ranges = yari->flat_memory ? 1 << (31 - FLAT_PAGE_BITS) : NSEGMENT;
+        ckpt_range_t *ranges = malloc(max_ranges * sizeof ranges[0]);
+        ckpt_page_t *pages = NULL;
+        ckpt_header_t h = { CKPT_MAGIC, CKPT_VERSION, sizeof *yari };
+        static const char zero[CKPT_PAGE_SIZE];
+        uint64_t data_offset, data_size = 0;
+        char tmp[1024];
+        unsigned k;
+        FILE *f;
+
+        if (!ranges)
+                fatal("Out of memory for the checkpoint\n");
+
+        tc_fold_stats();
+
+        h.nranges = mapped_ranges(ranges);
+        for (k = 0; k < h.nranges; ++k)
+                h.npages += (ranges[k].len + CKPT_PAGE_SIZE - 1) >> CKPT_PAGE_BITS;
+
+        pages = malloc(h.npages * sizeof pages[0] + 1);
+        if (!pages)
+                fatal("Out of memory for the checkpoint\n");
+
+        h.npages = 0;
+        for (k = 0; k < h.nranges; ++k) {
+                uint64_t a, end = ranges[k].start + ranges[k].len;
+
+                for (a = ranges[k].start; a < end; a += CKPT_PAGE_SIZE) {
+                        ckpt_page_t *pg = &pages[h.npages++];
+                        uint8_t *p = addr2phys(a);
+
+                        pg->address = a;
+                        pg->len     = end - a < CKPT_PAGE_SIZE ? end - a : CKPT_PAGE_SIZE;
+                        pg->stored  = !uniform(p, pg->len);
+                        pg->fill    = 0;
+                        pg->offset  = 0;
+                        if (pg->stored) {
+                                pg->offset = data_size;
+                                data_size += CKPT_PAGE_SIZE;
+                        } else
+                                memcpy(&pg->fill, p, 4);
+                }
+        }
+
+        /*
+         * Write it on the side, as this machine may have the old file
+         * mapped
+         */
+        snprintf(tmp, sizeof tmp, "%s.tmp", filename);
+        f = fopen(tmp, "w");
+        if (!f)
+                fatal("Can't create %s: %s\n", tmp, strerror(errno));
+
+        put(f, &h, sizeof h);
+#define PUT(field) put(f, &yari->field, sizeof yari->field);
+        CKPT_FIELDS(PUT)
+#undef PUT
+        put_cache(f, &yari->icache);
+        put_cache(f, &yari->dcache);
+        put(f, ranges, h.nranges * sizeof ranges[0]);
+
+        data_offset = ftell(f) + sizeof data_offset + h.npages * sizeof pages[0];
+        data_offset = (data_offset + CKPT_PAGE_SIZE - 1) & ~(uint64_t) (CKPT_PAGE_SIZE - 1);
+        put(f, &data_offset, sizeof data_offset);
+        put(f, pages, h.npages * sizeof pages[0]);
+        put(f, zero, data_offset - ftell(f));
+
+        for (k = 0; k < h.npages; ++k)
+                if (pages[k].stored) {
+                        put(f, addr2phys(pages[k].address), pages[k].len);
+                        put(f, zero, CKPT_PAGE_SIZE - pages[k].len);
+                }
+
+        if (fclose(f) || rename(tmp, filename))
+                fatal("Writing %s: %s\n", filename, strerror(errno));
+
+        printf("Checkpoint %s at pc %08x after %llu instructions, "
+               "%u of %u pages stored\n",
+               filename, yari->state.pc, yari->n_issue,
+               (unsigned) (data_size >> CKPT_PAGE_BITS), h.npages);
+
+        free(pages);
+        free(ranges);
+}
+
+/*
+ * Map a run of stored pages copy-on-write, if the host allows it,
+ * otherwise read them.
+ */
+static void restore_pages(int fd, uint64_t data_offset, ckpt_page_t *pg, unsigned n)
+{
+        uint64_t len = (uint64_t) n << CKPT_PAGE_BITS;
+        void *p = addr2phys(pg->address);
+        unsigned k;
+
+        if (yari->flat_memory && pg[n - 1].len == CKPT_PAGE_SIZE &&
+            mmap(p, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 fd, data_offset + pg->offset) != MAP_FAILED)
+                return;
+
+        for (k = 0; k < n; ++k)
+                if (pread(fd, addr2phys(pg[k].address), pg[k].len,
+                          data_offset + pg[k].offset) != pg[k].len)
+                        fatal("Reading the checkpoint: truncated\n");
+}
+
+/* Restore a checkpoint into a machine that hasn't loaded anything */
+void checkpoint_restore(const char *filename)
+{
+        ckpt_header_t h;
+        ckpt_range_t *ranges;
+        ckpt_page_t *pages;
+        uint64_t data_offset;
+        unsigned k, n;
+        FILE *f;
+
+        if (yari->memory_is_initialized)
+                fatal("A checkpoint can only be restored into an empty machine\n");
+
+        f = fopen(filename, "r");
+        if (!f)
+                fatal("Can't open %s: %s\n", filename, strerror(errno));
+
+        get(f, &h, sizeof h);
+        if (memcmp(h.magic, CKPT_MAGIC, sizeof h.magic))
+                fatal("%s is not a checkpoint\n", filename);
+        if (h.version != CKPT_VERSION || h.machine_size != sizeof *yari)
+                fatal("%s was written by a different yarisim\n", filename);
+
+        /* Before the fields, as it clears the I$ dirty pages */
+        initialize_memory();
+        yari->memory_is_initialized = 1;
+
+#define GET(field) get(f, &yari->field, sizeof yari->field);
+        CKPT_FIELDS(GET)
+#undef GET
+        get_cache(f, &yari->icache);
+        get_cache(f, &yari->dcache);
+
+        ranges = malloc(h.nranges * sizeof ranges[0] + 1);
+        pages  = malloc(h.npages * sizeof pages[0] + 1);
+        if (!ranges || !pages)
+                fatal("Out of memory for the checkpoint\n");
+
+        get(f, ranges, h.nranges * sizeof ranges[0]);
+        get(f, &data_offset, sizeof data_offset);
+        get(f, pages, h.npages * sizeof pages[0]);
+
+        for (k = 0; k < h.nranges; ++k)
+                ensure_mapped_memory_range(ranges[k].start, ranges[k].len);
+
+        for (k = 0; k < h.npages; k += n) {
+                ckpt_page_t *pg = &pages[k];
+
+                if (!pg->stored) {
+                        uint8_t *p = addr2phys(pg->address);
+                        unsigned i;
+
+                        memcpy(p, &pg->fill, pg->len < 4 ? pg->len : 4);
+                        for (i = 4; i < pg->len; i *= 2)
+                                memcpy(p + i, p, pg->len - i < i ? pg->len - i : i);
+                        n = 1;
+                        continue;
+                }
+
+                /* Runs of stored pages are contiguous in both places */
+                for (n = 1; k + n < h.npages && pg[n].stored &&
+                             pg[n].address == pg->address + (n << CKPT_PAGE_BITS); ++n)
+                        if (pg[n - 1].len != CKPT_PAGE_SIZE)
+                                break;
+
+                restore_pages(fileno(f), data_offset, pg, n);
+        }
+
+        memset(yari->framebuffer_dirty, 0xff, sizeof yari->framebuffer_dirty);
+
+        free(pages);
+        free(ranges);
+        fclose(f);
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,477 @@
+/*
+ * Cosimulation against the RTL.
+ *
+ * The RTL commit events come either as text, the COMMIT lines of the
+ * Icarus simulation on stdin or from a command we spawn
+ * (--rtl-command), or as binary records (--commit-trace, see
+ * commit_record_t), from a file or a FIFO the testbench writes to.
+ * Yarisim built with VCOSIM (see the Makefile) can instead run the
+ * verilated core in process (--rtl-model, vcosim.cpp), which is
+ * clocked to the next commit whenever the ISA model wants one.
+ *
+ * A reader thread decodes them into a single-producer/single-consumer
+ * queue, so the RTL side parsing and the ISA model each get a core;
+ * the ISA model only waits when it has caught up with the RTL.  The
+ * producer never overwrites the last KEEP_LINES events the consumer
+ * has seen, so the queue doubles as the history for divergence
+ * reports.
+ *
+ * That history only covers the last few hundred commits, so with
+ * --replay-interval=N the ISA model also forks a copy of itself every
+ * N instructions, which just waits, and logs the RTL commits from there
+ * on.  A fork costs in proportion to the memory mapped, so that is off
+ * by default; rerun with it once a divergence has turned up.
+ * On a divergence the log goes to the copy, which replays the window
+ * against it with full tracing (--verbose --regwrites, so every
+ * register write and store), up to the diverging commit.  Only the
+ * window is traced, not the billions of commits before it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include "mips32.h"
+#include "runmips.h"
+#ifdef VCOSIM
+#include "vcosim.h"
+#endif
+
+#define KEEP_LINES   400
+#define RTL_MAX_LINE 200
+#define QUEUE_SIZE   (1 << 14)  // Power of two, > KEEP_LINES
+
+typedef struct rtl_event {
+        int             is_commit;
+        commit_record_t rec;
+        uint64_t        cycle;
+        char            line[RTL_MAX_LINE];     // Text only
+} rtl_event_t;
+
+static rtl_event_t queue[QUEUE_SIZE];
+static uint64_t queue_head;     // Written by the reader only
+static uint64_t queue_tail;     // Written by the ISA model only
+static int queue_eof;
+
+static const char *rtl_command;
+static FILE *rtl_text;
+static const char *rtl_model;  // Directory of its memory images
+
+typedef struct rtl_commit {
+        commit_record_t rec;
+        uint64_t        cycle;
+} rtl_commit_t;
+
+uint64_t cosim_interval;       // 0 for no replay
+uint64_t cosim_next_checkpoint;
+
+/* The commits since the last checkpoint, and the copy waiting there */
+static rtl_commit_t *replay_log;
+static size_t replay_n, replay_size, replay_pos;
+static pid_t replay_pid = -1;
+static int replay_fd = -1, replaying;
+static uint64_t replay_issue, replay_cycle;
+
+static int trace_fd = -1, trace_mapped;
+static const commit_record_t *trace_p, *trace_end;
+static commit_record_t trace_buf[4096];
+static uint64_t trace_cycle;
+
+void cosim_open_trace(const char *filename)
+{
+        struct stat st;
+        void *map;
+
+        trace_fd = open(filename, O_RDONLY);
+        if (trace_fd < 0)
+                perror(filename), exit(1);
+
+        if (fstat(trace_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size) {
+                map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, trace_fd, 0);
+                if (map == MAP_FAILED)
+                        perror(filename), exit(1);
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                trace_p = map;
+                trace_end = trace_p + st.st_size / sizeof *trace_p;
+                trace_mapped = 1;
+        } else
+                trace_p = trace_end = trace_buf;
+
+        enable_cosimulation = 1;
+}
+
+void cosim_spawn_rtl(const char *command)
+{
+        rtl_command = command;
+        enable_cosimulation = 1;
+}
+
+void cosim_open_model(const char *dir)
+{
+#ifdef VCOSIM
+        rtl_model = dir;
+        enable_cosimulation = 1;
+#else
+        fatal("This yarisim doesn't have the verilated core, see VCOSIM in the Makefile\n");
+#endif
+}
+
+static const commit_record_t *next_rtl_record(void)
+{
+        if (trace_p == trace_end) {
+                ssize_t n = 0, r;
+
+                if (trace_mapped)
+                        return NULL;
+
+                /* Don't let a short read split a record */
+                do {
+                        r = read(trace_fd, (char *) trace_buf + n, sizeof trace_buf - n);
+                        if (r > 0)
+                                n += r;
+                } while (r > 0 && n % sizeof trace_buf[0]);
+
+                if (n < sizeof trace_buf[0])
+                        return NULL;
+
+                trace_p = trace_buf;
+                trace_end = trace_buf + n / sizeof trace_buf[0];
+        }
+
+        return trace_p++;
+}
+
+/* Decode the next RTL event into e, returning 0 at the end */
+static int read_rtl_event(rtl_event_t *e)
+{
+        long long unsigned time = 0;
+        unsigned wbr = 0;
+
+#ifdef VCOSIM
+        if (rtl_model) {
+                if (!vcosim_commit(&e->cycle, &e->rec.pc, &wbr, &e->rec.wbv))
+                        return 0;
+
+                e->is_commit = 1;
+                e->rec.tag = COMMIT_TAG | wbr;
+                return 1;
+        }
+#endif
+
+        if (trace_fd >= 0) {
+                const commit_record_t *rec = next_rtl_record();
+
+                if (!rec)
+                        return 0;
+
+                if ((rec->tag & ~31) != COMMIT_TAG) {
+                        fprintf(stderr, "Corrupt commit trace record (tag %08x)\n", rec->tag);
+                        return 0;
+                }
+
+                /* The cycle count is truncated to 32 bits, extend it */
+                if (rec->cycle < (uint32_t) trace_cycle)
+                        trace_cycle += 1ULL << 32;
+                trace_cycle = (trace_cycle & ~0xFFFFFFFFULL) | rec->cycle;
+
+                e->is_commit = 1;
+                e->rec = *rec;
+                e->cycle = trace_cycle;
+                return 1;
+        }
+
+        if (!fgets(e->line, sizeof e->line, rtl_text))
+                return 0;
+
+        e->is_commit = sscanf(e->line,
+                              "%llu  COMMIT  %x:r%d <- %x\n",
+                              &time, &e->rec.pc, &wbr, &e->rec.wbv) == 4;
+        e->rec.tag = COMMIT_TAG | (wbr & 31);
+        e->cycle = time / 100;
+
+        return 1;
+}
+
+static int rtl_reader(void *unused)
+{
+        uint64_t head = 0;
+
+        for (;;) {
+                /* Leave the consumer its history */
+                while (head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE) >=
+                       QUEUE_SIZE - KEEP_LINES)
+                        sched_yield();
+
+                if (!read_rtl_event(&queue[head % QUEUE_SIZE]))
+                        break;
+
+                __atomic_store_n(&queue_head, ++head, __ATOMIC_RELEASE);
+        }
+
+        __atomic_store_n(&queue_eof, 1, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+void cosim_start(void)
+{
+        /* The model runs on demand in get_rtl_commit() */
+        if (rtl_model) {
+#ifdef VCOSIM
+                vcosim_open(rtl_model, enable_disass);
+#endif
+                return;
+        }
+
+        if (trace_fd < 0) {
+                rtl_text = stdin;
+                if (rtl_command) {
+                        rtl_text = popen(rtl_command, "r");
+                        if (!rtl_text)
+                                perror(rtl_command), exit(1);
+                }
+        }
+
+        if (!SDL_CreateThread(rtl_reader, NULL))
+                fatal("Couldn't start the RTL reader thread\n");
+}
+
+static void log_commit(const rtl_event_t *e)
+{
+        if (replay_n == replay_size) {
+                replay_size = replay_size ? 2 * replay_size : 1 << 16;
+                replay_log = realloc(replay_log, replay_size * sizeof *replay_log);
+                if (!replay_log)
+                        fatal("Out of memory for the cosimulation log\n");
+        }
+
+        replay_log[replay_n].rec   = e->rec;
+        replay_log[replay_n].cycle = e->cycle;
+        ++replay_n;
+}
+
+int get_rtl_commit(uint64_t *cycle, unsigned *pc, unsigned *wbr, unsigned *wbv)
+{
+        unsigned watchdog = 1000;
+        rtl_event_t *e;
+
+        if (replaying) {
+                const rtl_commit_t *c = &replay_log[replay_pos++];
+
+                if (replay_pos > replay_n) {
+                        printf("End of the replay, no divergence\n");
+                        fflush(stdout);
+                        _exit(0);
+                }
+
+                *cycle = c->cycle;
+                *pc    = c->rec.pc;
+                *wbr   = c->rec.tag & 31;
+                *wbv   = c->rec.wbv;
+                return 1;
+        }
+
+        for (;;) {
+                if (rtl_model && queue_tail == queue_head) {
+                        if (read_rtl_event(&queue[queue_head % QUEUE_SIZE]))
+                                ++queue_head;
+                        else
+                                queue_eof = 1;
+                }
+
+                while (queue_tail == __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE)) {
+                        if (__atomic_load_n(&queue_eof, __ATOMIC_ACQUIRE) &&
+                            queue_tail == __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE))
+                                return 0;
+                        sched_yield();
+                }
+
+                e = &queue[queue_tail % QUEUE_SIZE];
+                __atomic_store_n(&queue_tail, queue_tail + 1, __ATOMIC_RELEASE);
+
+                if (e->is_commit)
+                        break;
+
+                if (--watchdog == 0) {
+                        fprintf(stderr, "No commits found in quite a long run, bailing\n");
+                        return 0;
+                }
+        }
+
+        if (replay_fd >= 0)
+                log_commit(e);
+
+        *cycle = e->cycle;
+        *pc    = e->rec.pc;
+        *wbr   = e->rec.tag & 31;
+        *wbv   = e->rec.wbv;
+
+        return 1;
+}
+
+void cosim_print_history(void)
+{
+        uint64_t k = queue_tail > KEEP_LINES ? queue_tail - KEEP_LINES : 0;
+
+        for (; k < queue_tail; ++k) {
+                rtl_event_t *e = &queue[k % QUEUE_SIZE];
+
+                if (trace_fd < 0 && !rtl_model)
+                        printf("%s", e->line);
+                else
+                        printf("%05llu  COMMIT  %08x:r%02d <- %08x\n",
+                               (long long unsigned) e->cycle, e->rec.pc,
+                               e->rec.tag & 31, e->rec.wbv);
+        }
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+        const char *p = buf;
+        ssize_t n;
+
+        for (; len; p += n, len -= n) {
+                n = write(fd, p, len);
+                if (n <= 0) {
+                        perror("Handing over the cosimulation log");
+                        return;
+                }
+        }
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+        char *p = buf;
+        ssize_t n;
+
+        for (; len; p += n, len -= n) {
+                n = read(fd, p, len);
+                if (n <= 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+static void drop_checkpoint(void)
+{
+        if (replay_fd < 0)
+                return;
+
+        /* The copy leaves when it sees the end of the pipe */
+        close(replay_fd);
+        waitpid(replay_pid, NULL, 0);
+        replay_fd = -1;
+}
+
+/* The copy, waiting for a divergence or the end of the run */
+static void await_replay(int fd)
+{
+        int k;
+
+        if (read_all(fd, &replay_n, sizeof replay_n))
+                _exit(0);
+
+        replay_log = malloc(replay_n * sizeof *replay_log + 1);
+        if (!replay_log || read_all(fd, replay_log, replay_n * sizeof *replay_log))
+                _exit(1);
+        close(fd);
+
+        replaying = 1;
+        replay_pos = 0;
+        cosim_next_checkpoint = ~0ULL;
+        yari->stop_issue = ~0ULL;
+
+        /* Trace to stdout only, leaving the outputs of the run alone */
+        enable_disass = enable_regwrites = 1;
+        enable_disass_user = 0;
+        yari->rs232out_fd = -1;
+        yari->trace = NULL;
+        yari->profile = NULL;
+
+        printf("Replaying %zu commits from instruction %llu (RTL cycle %llu)\n",
+               replay_n, (long long unsigned) replay_issue,
+               (long long unsigned) replay_cycle);
+        printf("pc %08x\n", yari->state.pc);
+        for (k = 0; k < 32; ++k)
+                printf("r%-2d %08x%c", k, yari->state.r[k], k % 8 == 7 ? '\n' : ' ');
+}
+
+void cosim_checkpoint(void)
+{
+        int fds[2];
+        pid_t pid;
+
+        drop_checkpoint();
+        cosim_next_checkpoint = cosim_interval ? yari->n_issue + cosim_interval : ~0ULL;
+        if (!cosim_interval)
+                return;
+
+        /* The copy shares nothing buffered with us */
+        fflush(stdout);
+        fflush(stderr);
+
+        replay_n = 0;
+        replay_issue = yari->n_issue;
+        replay_cycle = yari->n_cycle;
+
+        if (pipe(fds)) {
+                perror("Cosimulation checkpoint");
+                return;
+        }
+
+        pid = fork();
+        if (pid < 0) {
+                perror("Cosimulation checkpoint");
+                close(fds[0]);
+                close(fds[1]);
+                return;
+        }
+
+        if (pid == 0) {
+                close(fds[1]);
+                await_replay(fds[0]);
+                return;
+        }
+
+        close(fds[0]);
+        replay_pid = pid;
+        replay_fd = fds[1];
+}
+
+void cosim_replay(void)
+{
+        if (replaying) {
+                printf("Replay reached the divergence\n\n");
+                fflush(stdout);
+                _exit(0);
+        }
+
+        if (replay_fd < 0)
+                return;
+
+        printf("Divergence after %llu instructions, tracing from the last checkpoint\n",
+               yari->n_issue);
+        fflush(stdout);
+
+        /* Should the copy have died, don't die with it */
+        signal(SIGPIPE, SIG_IGN);
+
+        write_all(replay_fd, &replay_n, sizeof replay_n);
+        write_all(replay_fd, replay_log, replay_n * sizeof *replay_log);
+        drop_checkpoint();
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
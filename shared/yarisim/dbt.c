@@ -0,0 +1,885 @@
+/*
+ * The x86-64 back end of the translation cache.
+ *
+ * Blocks the tcache has run DBT_HOT times get host code, written into
+ * an executable arena of DBT_ARENA_SIZE.  The guest registers stay in
+ * MIPS_state_t and the code keeps state in %rbx, yari in %r12 and
+ * yari->tc in %r13.  The common ALU operations, the branches and the
+ * loads and stores that the RAM fast path of runmips.h would take are
+ * open coded.  Everything else calls the block's handler, as does any
+ * load or store leaving the fast path.  A handler that doesn't return
+ * TC_NEXT has the code return to run_tcache(), which finishes off the
+ * block just as for the handler loop, so exceptions, SYNCI and
+ * flushes work the same.
+ *
+ * At its end a block does its own book keeping: the I$ (hits open
+ * coded for the non-LRU policies), TSC, n_issue and its count.  It
+ * then jumps straight on to the successor run_tcache() chained, through
+ * a stub that does the stop test and counts the hazards between the
+ * two blocks, or else returns.  When the tcache drops a block, the
+ * chains into it are pointed back at run_tcache(), see dbt_unchain().
+ *
+ * The arena is thrown away with the rest of the tcache, and running
+ * out of it makes run_tcache() flush.  On other hosts, or without an
+ * executable mapping, the tcache carries on without.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "mips32.h"
+#include "runmips.h"
+#include "tcache.h"
+
+#if defined(__x86_64__)
+
+#define DBT_ARENA_SIZE  (64 << 20)
+#define DBT_OP_MAX      256     // Bytes of host code, at most, for one op
+#define DBT_BLOCK_MAX   ((TC_MAX_OPS + 1) * DBT_OP_MAX + 4096)
+#define DBT_STUB_MAX    256
+#define DBT_ICACHE_MAX  16      // Lines to check inline, at most
+
+/* A chain from one block to the next, kept on the list of the latter */
+struct dbt_link {
+        struct dbt_code *from;
+        int              slot;
+        struct dbt_link *next;
+};
+
+/* The host code of a block, at the start of it in the arena */
+struct dbt_code {
+        unsigned char  *entry;
+        unsigned char  *exit;           // Back to run_tcache(), all done
+        unsigned char  *left;           // Likewise, left after op %ecx
+        int32_t        *jump[2];        // To the successors, patched by dbt_chain()
+        uint32_t       *target;         // Compared with the computed pc, if any
+        uint32_t        pc[2];          // Of the successors
+        int             chained[2];
+        struct dbt_link link[2];        // Our chains, on the successors' lists
+        struct dbt_link *in;            // Chains to us
+};
+
+struct dbt {
+        unsigned char  *base, *free, *end;
+        unsigned char  *code;           // Where the blocks start
+        int           (*enter)(MIPS_state_t *state, yarisim_t *y,
+                               struct tcache *tc, void *code);
+        unsigned char  *leave;
+};
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15, NONE = -1 };
+
+/* Condition codes */
+enum { CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+       CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G };
+
+#define STATE           RBX
+#define YARI            R12
+#define TC              R13
+
+#define GPR(n)          ((int32_t) (offsetof(MIPS_state_t, r) + 4 * (n)))
+#define ST(f)           ((int32_t) offsetof(MIPS_state_t, f))
+#define Y(f)            ((int32_t) offsetof(yarisim_t, f))
+#define T(f)            ((int32_t) offsetof(struct tcache, f))
+
+/* The emitter */
+
+static void byte(struct dbt *d, unsigned b)
+{
+        *d->free++ = b;
+}
+
+static void imm32(struct dbt *d, uint32_t v)
+{
+        memcpy(d->free, &v, 4);
+        d->free += 4;
+}
+
+static void imm64(struct dbt *d, uint64_t v)
+{
+        memcpy(d->free, &v, 8);
+        d->free += 8;
+}
+
+static void opcode(struct dbt *d, int prefix, int w, unsigned op,
+                   int reg, int index, int base)
+{
+        unsigned rex = 0x40 | w << 3 | (reg & 8) >> 1 | (index & 8) >> 2 | (base & 8) >> 3;
+
+        if (prefix)
+                byte(d, prefix);
+        if (rex != 0x40)
+                byte(d, rex);
+        if (op > 0xFF)
+                byte(d, op >> 8);
+        byte(d, op);
+}
+
+/* op reg, [base + index * scale + disp] */
+static void mem(struct dbt *d, int prefix, int w, unsigned op, int reg,
+                int base, int index, int scale, int32_t disp)
+{
+        int mod = disp == 0 && (base & 7) != RBP ? 0 : disp == (int8_t) disp ? 1 : 2;
+
+        opcode(d, prefix, w, op, reg, index == NONE ? 0 : index, base);
+        if (index == NONE && (base & 7) != RSP)
+                byte(d, mod << 6 | (reg & 7) << 3 | (base & 7));
+        else {
+                byte(d, mod << 6 | (reg & 7) << 3 | 4);
+                byte(d, (scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0) << 6 |
+                     ((index == NONE ? RSP : index) & 7) << 3 | (base & 7));
+        }
+        if (mod == 1)
+                byte(d, disp);
+        else if (mod == 2)
+                imm32(d, disp);
+}
+
+/* op reg, rm */
+static void reg(struct dbt *d, int prefix, int w, unsigned op, int reg, int rm)
+{
+        opcode(d, prefix, w, op, reg, 0, rm);
+        byte(d, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+#define LOAD(d, r, base, disp)          mem(d, 0, 0, 0x8B, r, base, NONE, 0, disp)
+#define STORE(d, r, base, disp)         mem(d, 0, 0, 0x89, r, base, NONE, 0, disp)
+#define LOAD64(d, r, base, disp)        mem(d, 0, 1, 0x8B, r, base, NONE, 0, disp)
+#define STORE64(d, r, base, disp)       mem(d, 0, 1, 0x89, r, base, NONE, 0, disp)
+#define INC64(d, base, disp)            mem(d, 0, 1, 0xFF, 0, base, NONE, 0, disp)
+
+/* The group 1 ALU operations, as /digit and as the op r32, r/m32 opcode */
+enum { X_ADD, X_OR, X_ADC, X_SBB, X_AND, X_SUB, X_XOR, X_CMP };
+
+#define ALU_RM(d, alu, r, base, disp)   mem(d, 0, 0, 8 * (alu) + 3, r, base, NONE, 0, disp)
+
+static void alu_ri(struct dbt *d, int w, int alu, int r, uint32_t v)
+{
+        reg(d, 0, w, 0x81, alu, r);
+        imm32(d, v);
+}
+
+static void alu_mi(struct dbt *d, int w, int alu, int base, int32_t disp, uint32_t v)
+{
+        mem(d, 0, w, 0x81, alu, base, NONE, 0, disp);
+        imm32(d, v);
+}
+
+static void store_imm(struct dbt *d, int base, int32_t disp, uint32_t v)
+{
+        mem(d, 0, 0, 0xC7, 0, base, NONE, 0, disp);
+        imm32(d, v);
+}
+
+static void mov_imm(struct dbt *d, int r, uint32_t v)
+{
+        opcode(d, 0, 0, 0xB8 + (r & 7), 0, 0, r);
+        imm32(d, v);
+}
+
+static void mov_imm64(struct dbt *d, int r, const void *p)
+{
+        opcode(d, 0, 1, 0xB8 + (r & 7), 0, 0, r);
+        imm64(d, (uintptr_t) p);
+}
+
+static void call(struct dbt *d, const void *f)
+{
+        mov_imm64(d, RAX, f);
+        reg(d, 0, 0, 0xFF, 2, RAX);
+}
+
+/* Jumps, forward ones patched with here() once the target is known */
+static int32_t *jcc(struct dbt *d, int cc)
+{
+        byte(d, 0x0F);
+        byte(d, 0x80 + cc);
+        imm32(d, 0);
+        return (int32_t *) d->free - 1;
+}
+
+static int32_t *jmp(struct dbt *d)
+{
+        byte(d, 0xE9);
+        imm32(d, 0);
+        return (int32_t *) d->free - 1;
+}
+
+static void patch(int32_t *j, const unsigned char *to)
+{
+        *j = to - (unsigned char *) (j + 1);
+}
+
+static void here(struct dbt *d, int32_t *j)
+{
+        if (j)
+                patch(j, d->free);
+}
+
+/* A short jump over at most 127 bytes */
+static unsigned char *jcc8(struct dbt *d, int cc)
+{
+        byte(d, 0x70 + cc);
+        byte(d, 0);
+        return d->free - 1;
+}
+
+static void here8(struct dbt *d, unsigned char *j)
+{
+        *j = d->free - (j + 1);
+}
+
+static void align(struct dbt *d)
+{
+        while ((uintptr_t) d->free & 15)
+                byte(d, 0xCC);
+}
+
+/* The entry from C and the way back, shared by all blocks */
+static void dbt_stubs(struct dbt *d)
+{
+        static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+        int k;
+
+        d->enter = (void *) d->free;
+        for (k = 0; k < 6; ++k)
+                opcode(d, 0, 0, 0x50 + (saved[k] & 7), 0, 0, saved[k]);
+        alu_ri(d, 1, X_SUB, RSP, 8);
+        reg(d, 0, 1, 0x89, RDI, STATE);
+        reg(d, 0, 1, 0x89, RSI, YARI);
+        reg(d, 0, 1, 0x89, RDX, TC);
+        reg(d, 0, 0, 0xFF, 4, RCX);     // jmp *%rcx
+
+        align(d);
+        d->leave = d->free;
+        alu_ri(d, 1, X_ADD, RSP, 8);
+        for (k = 5; k >= 0; --k)
+                opcode(d, 0, 0, 0x58 + (saved[k] & 7), 0, 0, saved[k]);
+        byte(d, 0xC3);
+
+        align(d);
+        d->code = d->free;
+}
+
+static struct dbt *dbt_new(void)
+{
+        struct dbt *d = calloc(1, sizeof *d);
+        void *p = mmap(NULL, DBT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (!d || p == MAP_FAILED) {
+                fprintf(stderr, "No executable memory for host code, continuing without\n");
+                free(d);
+                if (p != MAP_FAILED)
+                        munmap(p, DBT_ARENA_SIZE);
+                enable_dbt = 0;
+                return NULL;
+        }
+
+        d->base = d->free = p;
+        d->end = d->base + DBT_ARENA_SIZE;
+        dbt_stubs(d);
+
+        return d;
+}
+
+void dbt_flush(void)
+{
+        if (yari->tc->dbt)
+                yari->tc->dbt->free = yari->tc->dbt->code;
+}
+
+void dbt_free(struct tcache *tc)
+{
+        if (!tc->dbt)
+                return;
+
+        munmap(tc->dbt->base, DBT_ARENA_SIZE);
+        free(tc->dbt);
+        tc->dbt = NULL;
+}
+
+/* Operations */
+
+/* The handler, leaving if it doesn't return TC_NEXT */
+static void helper(struct dbt *d, const tc_op_t *op, struct dbt_code *c)
+{
+        reg(d, 0, 1, 0x89, STATE, RDI);
+        mov_imm64(d, RSI, op);
+        call(d, op->handler);
+        mov_imm(d, RCX, op->idx);
+        reg(d, 0, 0, 0x85, RAX, RAX);
+        patch(jcc(d, CC_NE), c->left);
+}
+
+/* state->pc = op->imm unless the flags say cc */
+static void branch_unless(struct dbt *d, const tc_op_t *op, int cc)
+{
+        unsigned char *j = jcc8(d, cc);
+
+        store_imm(d, STATE, ST(pc), op->imm);
+        here8(d, j);
+}
+
+/* A slt type op, rd = the flags say cc after cmp */
+static void set_if(struct dbt *d, int cc, unsigned rd)
+{
+        byte(d, 0x0F);
+        byte(d, 0x90 + cc);
+        byte(d, 0xC0 | RCX);
+        STORE(d, RCX, STATE, GPR(rd));
+}
+
+/*
+ * Loads and stores, the fast path of ram_ptr() and RAM_LOAD/RAM_STORE
+ * (which see), falling back on the handler.
+ */
+static void load_store(struct dbt *d, const tc_op_t *op, struct dbt_code *c,
+                       unsigned width, int sign, int store)
+{
+        int big = yari->endian_is_big;
+        int32_t *slow[5] = { 0 }, *done;
+        int k = 0;
+
+        LOAD(d, RAX, STATE, GPR(op->rs));
+        if (op->imm)
+                alu_ri(d, 0, X_ADD, RAX, op->imm);
+        alu_ri(d, 0, X_CMP, RAX, FLAT_FAST_LIMIT);
+        slow[k++] = jcc(d, CC_AE);
+        if (width > 1) {
+                byte(d, 0xA8);                          // test $width-1, %al
+                byte(d, width - 1);
+                slow[k++] = jcc(d, CC_NE);
+        }
+
+        if (store) {
+                reg(d, 0, 0, 0x89, RAX, RSI);           // The address for later
+
+                /* tc_is_code() */
+                reg(d, 0, 0, 0x89, RAX, RCX);
+                reg(d, 0, 0, 0xC1, 5, RCX);
+                byte(d, TC_GRANULE_BITS + 5);
+                LOAD64(d, RDX, YARI, Y(tc_code_map));
+                mem(d, 0, 0, 0x8B, RDX, RDX, RCX, 4, 0);
+                reg(d, 0, 0, 0x89, RAX, RCX);
+                reg(d, 0, 0, 0xC1, 5, RCX);
+                byte(d, TC_GRANULE_BITS);
+                reg(d, 0, 0, 0x0FA3, RCX, RDX);         // bt %ecx, %edx
+                slow[k++] = jcc(d, CC_B);
+
+                /* The framebuffer */
+                reg(d, 0, 0, 0x89, RAX, RCX);
+                ALU_RM(d, X_SUB, RCX, YARI, Y(framebuffer_start));
+                ALU_RM(d, X_CMP, RCX, YARI, Y(framebuffer_size));
+                slow[k++] = jcc(d, CC_B);
+        }
+
+        if (yari->flat_memory)
+                LOAD64(d, RDX, YARI, Y(flat_memory));
+        else {
+                reg(d, 0, 0, 0x89, RAX, RDX);
+                reg(d, 0, 0, 0xC1, 5, RDX);
+                byte(d, OFFSETBITS);
+                alu_ri(d, 0, X_AND, RAX, (1U << OFFSETBITS) - 1);
+                mem(d, 0, 0, 0x8D, RCX, RAX, NONE, 0, width - 1);
+                mem(d, 0, 0, 0x3B, RCX, YARI, RDX, 4, Y(memory_segment_size));
+                slow[k++] = jcc(d, CC_AE);
+                mem(d, 0, 1, 0x8B, RDX, YARI, RDX, 8, Y(memory_segment));
+        }
+
+        if (!store) {
+                switch (width) {
+                case 1:
+                        mem(d, 0, 0, sign ? 0x0FBE : 0x0FB6, RAX, RDX, RAX, 1, 0);
+                        break;
+                case 2:
+                        mem(d, 0, 0, sign && !big ? 0x0FBF : 0x0FB7, RAX, RDX, RAX, 1, 0);
+                        if (big) {
+                                reg(d, 0x66, 0, 0xC1, 0, RAX);  // rol $8, %ax
+                                byte(d, 8);
+                                reg(d, 0, 0, sign ? 0x0FBF : 0x0FB7, RAX, RAX);
+                        }
+                        break;
+                default:
+                        mem(d, 0, 0, 0x8B, RAX, RDX, RAX, 1, 0);
+                        if (big)
+                                opcode(d, 0, 0, 0x0FC8 + RAX, 0, 0, 0);
+                        break;
+                }
+                if (op->rt)
+                        STORE(d, RAX, STATE, GPR(op->rt));
+        } else {
+                LOAD(d, RCX, STATE, GPR(op->rt));
+                switch (width) {
+                case 1:
+                        mem(d, 0, 0, 0x88, RCX, RDX, RAX, 1, 0);
+                        break;
+                case 2:
+                        if (big) {
+                                reg(d, 0x66, 0, 0xC1, 0, RCX);
+                                byte(d, 8);
+                        }
+                        mem(d, 0x66, 0, 0x89, RCX, RDX, RAX, 1, 0);
+                        break;
+                default:
+                        if (big)
+                                opcode(d, 0, 0, 0x0FC8 + RCX, 0, 0, 0);
+                        mem(d, 0, 0, 0x89, RCX, RDX, RAX, 1, 0);
+                        break;
+                }
+
+                /* icache_note_store() */
+                reg(d, 0, 0, 0xC1, 5, RSI);
+                byte(d, ICACHE_PAGE_BITS);
+                reg(d, 0, 0, 0x89, RSI, RCX);
+                reg(d, 0, 0, 0xC1, 5, RCX);
+                byte(d, 5);
+                mem(d, 0, 0, 0x8B, RAX, YARI, RCX, 4, Y(icache_dirty_map));
+                reg(d, 0, 0, 0x0FAB, RSI, RAX);         // bts %esi, %eax
+                mem(d, 0, 0, 0x89, RAX, YARI, RCX, 4, Y(icache_dirty_map));
+
+                INC64(d, YARI, Y(n_effects));
+        }
+        done = jmp(d);
+
+        while (k)
+                here(d, slow[--k]);
+        helper(d, op, c);
+        here(d, done);
+}
+
+static void dbt_op(struct dbt *d, const tc_op_t *op, struct dbt_code *c)
+{
+        static const int shift[] = { [SLL] = 4, [SRL] = 5, [SRA] = 7,
+                                     [SLLV] = 4, [SRLV] = 5, [SRAV] = 7 };
+        inst_t i = op->i;
+        int memory = 0;
+
+        switch (i.j.opcode) {
+        case SPECIAL:
+                switch (i.r.funct) {
+                case SLL: case SRL: case SRA:
+                        if (!op->rd)
+                                return;
+                        LOAD(d, RAX, STATE, GPR(op->rt));
+                        if (op->imm) {
+                                reg(d, 0, 0, 0xC1, shift[i.r.funct], RAX);
+                                byte(d, op->imm);
+                        }
+                        STORE(d, RAX, STATE, GPR(op->rd));
+                        return;
+
+                case SLLV: case SRLV: case SRAV:
+                        if (!op->rd)
+                                return;
+                        LOAD(d, RCX, STATE, GPR(op->rs));
+                        LOAD(d, RAX, STATE, GPR(op->rt));
+                        reg(d, 0, 0, 0xD3, shift[i.r.funct], RAX);
+                        STORE(d, RAX, STATE, GPR(op->rd));
+                        return;
+
+                case MFHI: case MFLO:
+                        if (!op->rd)
+                                return;
+                        LOAD(d, RAX, STATE, i.r.funct == MFHI ? ST(hi) : ST(lo));
+                        STORE(d, RAX, STATE, GPR(op->rd));
+                        return;
+
+                case MTHI: case MTLO:
+                        LOAD(d, RAX, STATE, GPR(op->rs));
+                        STORE(d, RAX, STATE, i.r.funct == MTHI ? ST(hi) : ST(lo));
+                        return;
+
+                case ADDU: case SUBU: case AND: case OR: case XOR: case NOR:
+                        if (!op->rd)
+                                return;
+                        LOAD(d, RAX, STATE, GPR(op->rs));
+                        ALU_RM(d, i.r.funct == ADDU ? X_ADD : i.r.funct == SUBU ? X_SUB :
+                               i.r.funct == AND ? X_AND : i.r.funct == XOR ? X_XOR : X_OR,
+                               RAX, STATE, GPR(op->rt));
+                        if (i.r.funct == NOR)
+                                reg(d, 0, 0, 0xF7, 2, RAX);
+                        STORE(d, RAX, STATE, GPR(op->rd));
+                        return;
+
+                case SLT: case SLTU:
+                        if (!op->rd)
+                                return;
+                        reg(d, 0, 0, 0x31, RCX, RCX);
+                        LOAD(d, RAX, STATE, GPR(op->rs));
+                        ALU_RM(d, X_CMP, RAX, STATE, GPR(op->rt));
+                        set_if(d, i.r.funct == SLT ? CC_L : CC_B, op->rd);
+                        return;
+
+                case MULT: case MULTU:
+                        LOAD(d, RAX, STATE, GPR(op->rs));
+                        mem(d, 0, 0, 0xF7, i.r.funct == MULT ? 5 : 4, STATE, NONE, 0, GPR(op->rt));
+                        STORE(d, RAX, STATE, ST(lo));
+                        STORE(d, RDX, STATE, ST(hi));
+                        return;
+
+                case JR:
+                        LOAD(d, RAX, STATE, GPR(op->rs));
+                        STORE(d, RAX, STATE, ST(pc));
+                        return;
+
+                case JALR:
+                        if (yari->profile)
+                                break;
+                        LOAD(d, RAX, STATE, GPR(op->rs));
+                        if (op->rd)
+                                store_imm(d, STATE, GPR(op->rd), op->pc + 8);
+                        STORE(d, RAX, STATE, ST(pc));
+                        return;
+
+                default:
+                        break;
+                }
+                break;
+
+        case REGIMM:
+                switch (i.r.rt) {
+                case BLTZ: case BGEZ: case BLTZAL: case BGEZAL:
+                        LOAD(d, RAX, STATE, GPR(op->rs));
+                        if (i.r.rt == BLTZAL || i.r.rt == BGEZAL)
+                                store_imm(d, STATE, GPR(31), op->pc + 8);
+                        reg(d, 0, 0, 0x85, RAX, RAX);
+                        branch_unless(d, op, i.r.rt == BLTZ || i.r.rt == BLTZAL ? CC_NS : CC_S);
+                        return;
+
+                default:
+                        break;
+                }
+                break;
+
+        case J:
+                store_imm(d, STATE, ST(pc), op->imm);
+                return;
+
+        case JAL:
+                if (yari->profile)
+                        break;
+                INC64(d, YARI, Y(n_call));
+                store_imm(d, STATE, GPR(31), op->pc + 8);
+                store_imm(d, STATE, ST(pc), op->imm);
+                return;
+
+        case BEQ: case BNE:
+                if (i.raw == 0x1000FFFF)
+                        break;
+                LOAD(d, RAX, STATE, GPR(op->rs));
+                ALU_RM(d, X_CMP, RAX, STATE, GPR(op->rt));
+                branch_unless(d, op, i.j.opcode == BEQ ? CC_NE : CC_E);
+                return;
+
+        case BLEZ: case BGTZ:
+                alu_mi(d, 0, X_CMP, STATE, GPR(op->rs), 0);
+                branch_unless(d, op, i.j.opcode == BLEZ ? CC_G : CC_LE);
+                return;
+
+        case ADDI: case ADDIU: case ANDI: case ORI: case XORI:
+                if (!op->rt)
+                        return;
+                LOAD(d, RAX, STATE, GPR(op->rs));
+                if (op->imm || i.j.opcode == ANDI)
+                        alu_ri(d, 0, i.j.opcode == ANDI ? X_AND : i.j.opcode == ORI ? X_OR :
+                               i.j.opcode == XORI ? X_XOR : X_ADD, RAX, op->imm);
+                STORE(d, RAX, STATE, GPR(op->rt));
+                return;
+
+        case SLTI: case SLTIU:
+                if (!op->rt)
+                        return;
+                reg(d, 0, 0, 0x31, RCX, RCX);
+                alu_mi(d, 0, X_CMP, STATE, GPR(op->rs), op->imm);
+                set_if(d, i.j.opcode == SLTI ? CC_L : CC_B, op->rt);
+                return;
+
+        case LUI:
+                if (op->rt)
+                        store_imm(d, STATE, GPR(op->rt), op->imm);
+                return;
+
+        case LB: case LH: case LBU: case LHU: case LW:
+        case SB: case SH: case SW:
+                memory = 1;
+                break;
+
+        default:
+                break;
+        }
+
+        /*
+         * ram_ptr() never gives a pointer while the D$ is modelled, and
+         * the watchpoints want tc_watched()
+         */
+        if (memory && !yari->dcache.tag && !yari->watch_map)
+                switch (i.j.opcode) {
+                case LB:  load_store(d, op, c, 1, 1, 0); return;
+                case LH:  load_store(d, op, c, 2, 1, 0); return;
+                case LBU: load_store(d, op, c, 1, 0, 0); return;
+                case LHU: load_store(d, op, c, 2, 0, 0); return;
+                case LW:  load_store(d, op, c, 4, 0, 0); return;
+                case SB:  load_store(d, op, c, 1, 0, 1); return;
+                case SH:  load_store(d, op, c, 2, 0, 1); return;
+                case SW:  load_store(d, op, c, 4, 0, 1); return;
+                default:  break;
+                }
+
+        helper(d, op, c);
+}
+
+/*
+ * icache_fetch_block(b->pc, b->n), with the all hits case open coded
+ * where a hit changes nothing but the count: no LRU stamps, sweep or
+ * checks against memory, which icache_fetch() only does for pages
+ * that have been written.
+ */
+static void dbt_icache(struct dbt *d, const tc_block_t *b)
+{
+        const cache_t *c = &yari->icache;
+        uint32_t first = b->pc >> c->line_log2;
+        uint32_t last = (b->end_pc - 4) >> c->line_log2;
+        int32_t *slow[DBT_ICACHE_MAX + 2], *done = NULL;
+        uint32_t line, page;
+        unsigned w;
+        int k = 0;
+
+        if (!enable_cache_sweep && !enable_check_icache && !c->stamp &&
+            c->ways <= 8 && last - first < DBT_ICACHE_MAX) {
+                LOAD64(d, RAX, YARI, Y(icache.tag));
+                for (line = first; line <= last; ++line) {
+                        uint32_t set = line & ((1U << c->sets_log2) - 1);
+                        unsigned char *hit[8];
+
+                        for (w = 0; w < c->ways; ++w) {
+                                alu_mi(d, 0, X_CMP, RAX, 4 * (set * c->ways + w),
+                                       line >> c->sets_log2);
+                                hit[w] = jcc8(d, CC_E);
+                        }
+                        slow[k++] = jmp(d);
+                        for (w = 0; w < c->ways; ++w)
+                                here8(d, hit[w]);
+                }
+
+                /* A block spans at most two pages */
+                for (page = b->pc >> ICACHE_PAGE_BITS;
+                     page <= (b->end_pc - 4) >> ICACHE_PAGE_BITS; ++page) {
+                        mem(d, 0, 0, 0xF7, 0, YARI, NONE, 0,
+                            Y(icache_dirty_map) + 4 * (page >> 5));
+                        imm32(d, 1U << (page & 31));
+                        slow[k++] = jcc(d, CC_NE);
+                }
+
+                alu_mi(d, 1, X_ADD, YARI, Y(icache.hits), b->n);
+                done = jmp(d);
+                while (k)
+                        here(d, slow[--k]);
+        }
+
+        mov_imm(d, RDI, b->pc);
+        mov_imm(d, RSI, b->n);
+        call(d, icache_fetch_block);
+        here(d, done);
+}
+
+/* The branch ending b, if it has one, NULL if it isn't known where to */
+static const tc_op_t *dbt_branch(const tc_block_t *b, int *computed)
+{
+        *computed = 0;
+        if (b->n < 2 || !b->op[b->n - 1].bd)
+                return NULL;
+
+        *computed = b->op[b->n - 2].i.j.opcode == SPECIAL;      // JR or JALR
+        return &b->op[b->n - 2];
+}
+
+/* Returns 0 if the arena is full */
+int dbt_translate(tc_block_t *b)
+{
+        struct dbt *d = yari->tc->dbt;
+        struct dbt_code *c;
+        const tc_op_t *branch;
+        int computed;
+        unsigned k;
+
+        if (!d) {
+                d = yari->tc->dbt = dbt_new();
+                if (!d)
+                        return 1;
+        }
+
+        if (d->free + sizeof *c + DBT_BLOCK_MAX > d->end)
+                return 0;
+
+        c = (struct dbt_code *) d->free;
+        d->free += sizeof *c;
+        memset(c, 0, sizeof *c);
+
+        /* The ways back, ahead of the code so everything can jump back to them */
+        align(d);
+        c->exit = d->free;
+        reg(d, 0, 0, 0x31, RAX, RAX);
+        mov_imm(d, RCX, b->n - 1);
+        c->left = d->free;
+        mov_imm64(d, RDX, b);
+        STORE64(d, RDX, TC, T(dbt_block));
+        STORE(d, RCX, TC, T(dbt_idx));
+        patch(jmp(d), d->leave);
+
+        align(d);
+        c->entry = d->free;
+        LOAD64(d, RAX, YARI, Y(TSC));
+        STORE64(d, RAX, TC, T(tsc_base));
+        LOAD64(d, RAX, YARI, Y(n_issue));
+        STORE64(d, RAX, TC, T(issue_base));
+        store_imm(d, STATE, ST(pc), b->end_pc);
+
+        for (k = 0; k < b->n; ++k)
+                dbt_op(d, &b->op[k], c);
+
+        dbt_icache(d, b);
+        LOAD64(d, RAX, TC, T(tsc_base));
+        alu_ri(d, 1, X_ADD, RAX, b->n);
+        STORE64(d, RAX, YARI, Y(TSC));
+        LOAD64(d, RAX, TC, T(issue_base));
+        alu_ri(d, 1, X_ADD, RAX, b->n);
+        STORE64(d, RAX, YARI, Y(n_issue));
+        mov_imm64(d, RAX, &b->count);
+        INC64(d, RAX, 0);
+
+        /* On to the successors */
+        LOAD(d, RAX, STATE, ST(pc));
+        branch = dbt_branch(b, &computed);
+        if (branch && (computed || branch->imm != b->end_pc)) {
+                unsigned char *j;
+
+                alu_ri(d, 0, X_CMP, RAX, computed ? 1 : branch->imm);
+                c->pc[1] = computed ? 1 : branch->imm;
+                if (computed)
+                        c->target = (uint32_t *) d->free - 1;
+                j = jcc8(d, CC_NE);
+                c->jump[1] = jmp(d);
+                patch(c->jump[1], c->exit);
+                here8(d, j);
+        } else
+                c->chained[1] = 1;      // Never
+
+        alu_ri(d, 0, X_CMP, RAX, b->end_pc);
+        c->pc[0] = b->end_pc;
+        patch(jcc(d, CC_NE), c->exit);
+        c->jump[0] = jmp(d);
+        patch(c->jump[0], c->exit);
+
+        b->native = c;
+        ++yari->n_dbt_blocks;
+
+        return 1;
+}
+
+/*
+ * from ran to its end and run_tcache() went on to to, with the
+ * hazards between them.  Have from jump there directly from now on.
+ */
+void dbt_chain(tc_block_t *from, int slot, tc_block_t *to, unsigned hazards)
+{
+        struct dbt *d = yari->tc->dbt;
+        struct dbt_code *c = from->native;
+        unsigned char *stub;
+        int k;
+
+        if (c->chained[slot] || d->free + DBT_STUB_MAX > d->end)
+                return;
+        if (to->pc != c->pc[slot] && !(slot == 1 && c->target))
+                return;
+
+        align(d);
+        stub = d->free;
+        LOAD64(d, RAX, YARI, Y(n_issue));
+        mem(d, 0, 1, 0x3B, RAX, YARI, NONE, 0, Y(stop_issue));
+        patch(jcc(d, CC_AE), c->exit);
+        alu_mi(d, 0, X_CMP, YARI, Y(stop_pc), to->pc);
+        patch(jcc(d, CC_E), c->exit);
+        for (k = 0; k < HZ_N; ++k)
+                if (hazards & (1 << k))
+                        INC64(d, YARI, tc_stat[k]);
+        patch(jmp(d), to->native->entry);
+
+        if (slot == 1 && c->target)
+                *c->target = c->pc[1] = to->pc;
+        patch(c->jump[slot], stub);
+        c->chained[slot] = 1;
+
+        c->link[slot].from = c;
+        c->link[slot].slot = slot;
+        c->link[slot].next = to->native->in;
+        to->native->in = &c->link[slot];
+}
+
+/*
+ * The tcache dropped b.  Send the blocks chained to it back to
+ * run_tcache() instead, free to chain again to what replaces it.
+ */
+void dbt_unchain(tc_block_t *b)
+{
+        struct dbt_link *l;
+
+        if (!b->native)
+                return;
+
+        for (l = b->native->in; l; l = l->next) {
+                patch(l->from->jump[l->slot], l->from->exit);
+                l->from->chained[l->slot] = 0;
+        }
+        b->native->in = NULL;
+}
+
+int dbt_run(MIPS_state_t *state, tc_block_t *b)
+{
+        struct dbt *d = yari->tc->dbt;
+
+        return d->enter(state, yari, yari->tc, b->native->entry);
+}
+
+#else
+
+/* Other hosts just have the tcache */
+
+int dbt_translate(tc_block_t *b)
+{
+        enable_dbt = 0;
+        return 1;
+}
+
+void dbt_chain(tc_block_t *from, int slot, tc_block_t *to, unsigned hazards)
+{
+}
+
+int dbt_run(MIPS_state_t *state, tc_block_t *b)
+{
+        return TC_NEXT;
+}
+
+void dbt_unchain(tc_block_t *b)
+{
+}
+
+void dbt_flush(void)
+{
+}
+
+void dbt_free(struct tcache *tc)
+{
+}
+
+#endif
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
@@ -36,6 +36,15 @@ typedef struct {
         uint32_t        p_align;
 } Elf32_Phdr;
 
+typedef struct {
+        uint32_t        st_name;
+        Elf32_Addr      st_value;
+        uint32_t        st_size;
+        unsigned char   st_info;
+        unsigned char   st_other;
+        uint16_t        st_shndx;
+} Elf32_Sym;
+
 typedef struct {
         uint32_t        sh_name;
         uint32_t        sh_type;
@@ -60,4 +69,14 @@ typedef struct {
 
 #define PT_LOAD 1
 
+#define SHT_SYMTAB 2
+
+#define SHF_EXECINSTR 4
+
+#define ELF32_ST_BIND(i) ((i) >> 4)
+#define ELF32_ST_TYPE(i) ((i) & 15)
+#define STB_GLOBAL 1
+#define STT_NOTYPE 0
+#define STT_FUNC   2
+
 #endif
@@ -0,0 +1,598 @@
+/*
+ * GDB remote serial protocol server (--gdb=<port>), so programs can
+ * be debugged at full simulation speed without a stub in the PROM:
+ *
+ *      yarisim --gdb=1234 prog.mips &
+ *      mips-elf-gdb prog.mips -ex 'target remote :1234'
+ *
+ * Registers and memory are read and written directly in the machine.
+ * Breakpoints (Z0 and Z1 alike) never touch guest memory; they go
+ * into a list with a filter bitmap, yari->break_map, which the
+ * translation cache checks only at block boundaries.  Blocks end in
+ * front of any breakpoint (unless it's in a delay slot), so between
+ * breakpoints the program runs on the translation cache and DBT as
+ * usual.  Single steps (s, vCont;s) go through run_simple(), which
+ * like the hardware executes a branch and its delay slot together.
+ * Watchpoints (Z2 to Z4) are those of watch.c, stopping the program
+ * right after the access.
+ *
+ * Only one connection is served, on the loopback interface.  Ctrl-C
+ * in GDB is noticed between chunks of GDB_CHUNK instructions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "mips32.h"
+#include "runmips.h"
+#include "yarisim.h"
+
+#define GDB_PACKET      4096            // Largest packet, also advertised
+#define GDB_MAX_BREAKS  64
+#define GDB_NREGS       72              // GDB's mips: GPRs, sr lo hi bad cause pc, FPRs, fsr fir
+#define GDB_CHUNK       (1 << 20)       // Instructions between looks for Ctrl-C
+
+struct gdb {
+        int             fd;
+        int             no_ack;
+        int             gone;           // The connection was closed
+        char            in[GDB_PACKET];
+        unsigned        in_rp, in_n;
+        unsigned        nbreaks;
+        uint32_t        breaks[GDB_MAX_BREAKS];
+        uint32_t        map[1 << (BREAK_MAP_BITS - 5)];
+};
+
+static struct gdb *gdb(void)
+{
+        if (!yari->gdb) {
+                yari->gdb = calloc(1, sizeof *yari->gdb);
+                if (!yari->gdb)
+                        fatal("Out of memory for the GDB server\n");
+                yari->gdb->fd = -1;
+        }
+
+        return yari->gdb;
+}
+
+void gdb_free(yarisim_t *y)
+{
+        if (!y->gdb)
+                return;
+
+        if (y->gdb->fd >= 0)
+                close(y->gdb->fd);
+        free(y->gdb);
+        y->gdb = NULL;
+        y->break_map = NULL;
+}
+
+int gdb_break_at(uint32_t pc)
+{
+        struct gdb *g = yari->gdb;
+        unsigned k;
+
+        for (k = 0; k < g->nbreaks; ++k)
+                if (g->breaks[k] == pc)
+                        return 1;
+
+        return 0;
+}
+
+/*
+ * Blocks must end in front of a breakpoint, so the translations
+ * around one are thrown away whenever they change
+ */
+static void update_breaks(uint32_t pc)
+{
+        struct gdb *g = gdb();
+        unsigned k;
+
+        memset(g->map, 0, sizeof g->map);
+        for (k = 0; k < g->nbreaks; ++k)
+                g->map[BREAK_MAP_INDEX(g->breaks[k]) >> 5] |=
+                        1U << (BREAK_MAP_INDEX(g->breaks[k]) & 31);
+        yari->break_map = g->nbreaks ? g->map : NULL;
+
+        tc_invalidate(pc);
+}
+
+static int insert_break(uint32_t pc)
+{
+        struct gdb *g = gdb();
+
+        if (g->nbreaks && gdb_break_at(pc))
+                return 0;
+        if (g->nbreaks == GDB_MAX_BREAKS)
+                return -1;
+
+        g->breaks[g->nbreaks++] = pc;
+        update_breaks(pc);
+
+        return 0;
+}
+
+static void remove_break(uint32_t pc)
+{
+        struct gdb *g = gdb();
+        unsigned k;
+
+        for (k = 0; k < g->nbreaks; ++k)
+                if (g->breaks[k] == pc) {
+                        g->breaks[k] = g->breaks[--g->nbreaks];
+                        update_breaks(pc);
+                        return;
+                }
+}
+
+/* GDB's register numbering, NULL for the ones we don't have */
+static uint32_t *reg(unsigned n)
+{
+        MIPS_state_t *s = &yari->state;
+
+        if (n < 32)
+                return &s->r[n];
+        if (38 <= n && n < 70)
+                return &s->f[n - 38];
+
+        switch (n) {
+        case 32: return &s->cp0_status.raw;
+        case 33: return &s->lo;
+        case 34: return &s->hi;
+        case 35: return &s->cp0r[CP0_BADVADDR];
+        case 36: return &s->cp0_cause.raw;
+        case 37: return &s->pc;
+        case 70: return &s->fcsr;
+        case 71: return &s->fcr0;
+        default: return NULL;
+        }
+}
+
+static const char hexchars[] = "0123456789abcdef";
+
+static int hex(char ch)
+{
+        if ('0' <= ch && ch <= '9')
+                return ch - '0';
+        if ('a' <= ch && ch <= 'f')
+                return ch - 'a' + 10;
+        if ('A' <= ch && ch <= 'F')
+                return ch - 'A' + 10;
+        return -1;
+}
+
+static char *put_hex8(char *p, unsigned v)
+{
+        *p++ = hexchars[(v >> 4) & 15];
+        *p++ = hexchars[v & 15];
+        return p;
+}
+
+static int get_hex8(const char *p)
+{
+        int h = hex(p[0]), l = h < 0 ? -1 : hex(p[1]);
+
+        return l < 0 ? -1 : h << 4 | l;
+}
+
+/* Registers go in target byte order */
+static char *put_reg(char *p, uint32_t v)
+{
+        int k;
+
+        for (k = 0; k < 4; ++k)
+                p = put_hex8(p, v >> (yari->endian_is_big ? 24 - 8 * k : 8 * k));
+
+        return p;
+}
+
+static int get_reg(const char *p, uint32_t *v)
+{
+        int k, b;
+
+        for (*v = 0, k = 0; k < 4; ++k) {
+                b = get_hex8(p + 2 * k);
+                if (b < 0)
+                        return -1;
+                *v |= (uint32_t) b << (yari->endian_is_big ? 24 - 8 * k : 8 * k);
+        }
+
+        return 0;
+}
+
+static void set_reg(unsigned n, uint32_t v)
+{
+        uint32_t *r = reg(n);
+
+        if (r && n)
+                *r = v;
+}
+
+/* The next byte from GDB, -1 when it has gone */
+static int get_char(void)
+{
+        struct gdb *g = yari->gdb;
+        ssize_t n;
+
+        if (g->in_rp == g->in_n) {
+                do
+                        n = read(g->fd, g->in, sizeof g->in);
+                while (n < 0 && errno == EINTR);
+                if (n <= 0) {
+                        g->gone = 1;
+                        return -1;
+                }
+                g->in_rp = 0;
+                g->in_n = n;
+        }
+
+        return (unsigned char) g->in[g->in_rp++];
+}
+
+/* A write() of nothing means the connection is gone, as does an error */
+static void put_data(const void *buf, size_t len)
+{
+        const char *p = buf;
+        ssize_t n;
+
+        for (; len && !yari->gdb->gone; p += n, len -= n) {
+                n = write(yari->gdb->fd, p, len);
+                if (n < 0 && errno == EINTR)
+                        n = 0;
+                else if (n <= 0)
+                        yari->gdb->gone = 1;
+        }
+}
+
+static void put_packet(const char *data)
+{
+        static char buf[2 * GDB_PACKET + 4];
+        unsigned char sum = 0;
+        char *p = buf;
+        int ch;
+
+        for (*p++ = '$'; *data; *p++ = *data++)
+                sum += *data;
+        *p++ = '#';
+        p = put_hex8(p, sum);
+
+        for (;;) {
+                put_data(buf, p - buf);
+                if (yari->gdb->no_ack || yari->gdb->gone)
+                        return;
+                do
+                        ch = get_char();
+                while (ch >= 0 && ch != '+' && ch != '-');
+                if (ch != '-')
+                        return;
+        }
+}
+
+/* The next packet from GDB, without the framing, or NULL when it has gone */
+static char *get_packet(void)
+{
+        static char buf[GDB_PACKET + 1];
+        unsigned char sum;
+        unsigned n;
+        int ch, c1, c2;
+
+        for (;;) {
+                do
+                        ch = get_char();
+                while (ch >= 0 && ch != '$');
+                if (ch < 0)
+                        return NULL;
+
+                for (sum = 0, n = 0; (ch = get_char()) >= 0 && ch != '#'; sum += ch)
+                        if (n < GDB_PACKET)
+                                buf[n++] = ch;
+                c1 = get_char();
+                c2 = get_char();
+                if (c2 < 0)
+                        return NULL;
+                buf[n] = 0;
+
+                if (yari->gdb->no_ack)
+                        return buf;
+                if (hex(c1) >= 0 && hex(c2) >= 0 && (hex(c1) << 4 | hex(c2)) == sum) {
+                        put_data("+", 1);
+                        return buf;
+                }
+                put_data("-", 1);
+        }
+}
+
+/* Ctrl-C from GDB while the program runs, or GDB going away */
+static int interrupted(void)
+{
+        struct gdb *g = yari->gdb;
+        ssize_t n;
+        char ch;
+
+        while ((n = recv(g->fd, &ch, 1, MSG_DONTWAIT)) == 1)
+                if (ch == 3)
+                        return 1;
+
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                g->gone = 1;
+
+        return g->gone;
+}
+
+/*
+ * Run the program a single instruction or on to a breakpoint, Ctrl-C
+ * or the end, and return the stop reply
+ */
+static const char *resume(int step)
+{
+        static char reply[32];
+        MIPS_state_t *state = &yari->state;
+        sigjmp_buf bail;
+        uint32_t address;
+        int r, kind;
+
+        yari->bail = &bail;
+        r = sigsetjmp(bail, 1);
+        if (r) {
+                yari->bail = NULL;
+                flat_segv_report();
+                if (yari->segfault)
+                        return "S0b";
+                if (r == 2) {
+                        printf("%s", yari->error);
+                        return "X06";
+                }
+                snprintf(reply, sizeof reply, "W%02x", yari->exit_status & 255);
+                return reply;
+        }
+
+        /* Get off a breakpoint we are sitting on */
+        if (step || (yari->break_map && gdb_break_at(state->pc))) {
+                yari->stop_issue = yari->n_issue + 1;
+                run_simple(state);
+        }
+
+        /* A watchpoint stops the engines by clearing stop_issue */
+        while (!step && !yari->segfault && yari->stop_issue) {
+                yari->stop_issue = yari->n_issue + GDB_CHUNK;
+                run_tcache(state);
+                if (yari->n_issue < yari->stop_issue || interrupted())
+                        break;
+        }
+
+        yari->stop_issue = ~0ULL;
+        yari->bail = NULL;
+        tc_fold_stats();
+        serial_flush();
+
+        if (yari->segfault)
+                return "S0b";
+        if (watch_stopped(&address, &kind)) {
+                snprintf(reply, sizeof reply, "T05%swatch:%x;",
+                         kind == WATCH_WRITE ? "" : kind == WATCH_READ ? "r" : "a",
+                         address);
+                return reply;
+        }
+        if (!step && !at_break(state->pc))
+                return "S02";
+        return "S05";
+}
+
+static void read_memory(char *reply, const char *args)
+{
+        unsigned addr, len;
+        uint8_t buf[GDB_PACKET / 2];
+        char *p = reply;
+        unsigned k;
+
+        if (sscanf(args, "%x,%x", &addr, &len) != 2) {
+                strcpy(reply, "E01");
+                return;
+        }
+        if (len > sizeof buf - 1)
+                len = sizeof buf - 1;
+        if (yarisim_read_mem(yari, addr, buf, len) != YARISIM_RUNNING) {
+                strcpy(reply, "E0e");
+                return;
+        }
+
+        for (k = 0; k < len; ++k)
+                p = put_hex8(p, buf[k]);
+        *p = 0;
+}
+
+static const char *write_memory(const char *args)
+{
+        unsigned addr, len, k;
+        uint8_t buf[GDB_PACKET / 2];
+        const char *data = strchr(args, ':');
+        int b;
+
+        if (!data || sscanf(args, "%x,%x", &addr, &len) != 2 || len > sizeof buf)
+                return "E01";
+
+        for (++data, k = 0; k < len; ++k) {
+                b = get_hex8(data + 2 * k);
+                if (b < 0)
+                        return "E01";
+                buf[k] = b;
+        }
+
+        return yarisim_write_mem(yari, addr, buf, len) == YARISIM_RUNNING ? "OK" : "E0e";
+}
+
+/* vCont;ACTION[:thread][;ACTION...], we have one thread */
+static const char *vcont(const char *args)
+{
+        if (*args == '?')
+                return "vCont;c;C;s;S";
+        if (*args != ';')
+                return "";
+
+        switch (args[1]) {
+        case 's': case 'S': return resume(1);
+        case 'c': case 'C': return resume(0);
+        default:            return "";
+        }
+}
+
+static int wait_for_gdb(int port)
+{
+        struct sockaddr_in a = { .sin_family = AF_INET };
+        int s, fd, one = 1;
+
+        a.sin_port = htons(port);
+        a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s < 0 ||
+            setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) ||
+            bind(s, (struct sockaddr *) &a, sizeof a) ||
+            listen(s, 1))
+                fatal("GDB server on port %d: %s\n", port, strerror(errno));
+
+        printf("Waiting for GDB on port %d\n", port);
+        fflush(stdout);
+
+        fd = accept(s, NULL, NULL);
+        close(s);
+        if (fd < 0)
+                fatal("GDB server on port %d: %s\n", port, strerror(errno));
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+        return fd;
+}
+
+void gdb_serve(int port)
+{
+        static char reply[2 * GDB_PACKET + 1];
+        const char *r;
+        unsigned type, addr, kind, n, k;
+        uint32_t v;
+        char *cmd, *p;
+
+        gdb()->fd = wait_for_gdb(port);
+
+        while ((cmd = get_packet())) {
+                r = reply;
+                reply[0] = 0;
+
+                switch (cmd[0]) {
+                case '?':
+                        r = "S05";
+                        break;
+
+                case 'g':
+                        for (p = reply, k = 0; k < GDB_NREGS; ++k)
+                                p = put_reg(p, reg(k) ? *reg(k) : 0);
+                        *p = 0;
+                        break;
+
+                case 'G':
+                        for (k = 0; k < GDB_NREGS && !get_reg(cmd + 1 + 8 * k, &v); ++k)
+                                set_reg(k, v);
+                        r = "OK";
+                        break;
+
+                case 'p':
+                        n = strtoul(cmd + 1, NULL, 16);
+                        p = put_reg(reply, reg(n) ? *reg(n) : 0);
+                        *p = 0;
+                        break;
+
+                case 'P':
+                        n = strtoul(cmd + 1, &p, 16);
+                        r = *p == '=' && !get_reg(p + 1, &v) ? (set_reg(n, v), "OK") : "E01";
+                        break;
+
+                case 'm':
+                        read_memory(reply, cmd + 1);
+                        break;
+
+                case 'M':
+                        r = write_memory(cmd + 1);
+                        break;
+
+                case 'c':
+                case 's':
+                        if (cmd[1])
+                                yari->state.pc = strtoul(cmd + 1, NULL, 16);
+                        r = resume(cmd[0] == 's');
+                        break;
+
+                case 'v':
+                        if (strncmp(cmd, "vCont", 5) == 0)
+                                r = vcont(cmd + 5);
+                        break;
+
+                case 'Z':
+                case 'z':
+                        if (sscanf(cmd + 1, "%u,%x,%x", &type, &addr, &kind) != 3)
+                                r = "E01";
+                        else if (type > 4)
+                                r = "";
+                        else if (type > 1 && cmd[0] == 'z')
+                                r = watch_remove(addr, kind, type - 1) ? "E01" : "OK";
+                        else if (type > 1)
+                                r = watch_insert(addr, kind, type - 1, 1) ? "E0c" : "OK";
+                        else if (cmd[0] == 'z')
+                                remove_break(addr), r = "OK";
+                        else
+                                r = insert_break(addr) ? "E0c" : "OK";
+                        break;
+
+                case 'H':
+                        r = "OK";
+                        break;
+
+                case 'q':
+                        if (strncmp(cmd, "qSupported", 10) == 0)
+                                snprintf(reply, sizeof reply,
+                                         "PacketSize=%x;QStartNoAckMode+;vContSupported+",
+                                         GDB_PACKET);
+                        else if (strcmp(cmd, "qAttached") == 0)
+                                r = "0";
+                        else if (strcmp(cmd, "qC") == 0)
+                                r = "QC1";
+                        break;
+
+                case 'Q':
+                        if (strcmp(cmd, "QStartNoAckMode") == 0) {
+                                put_packet("OK");
+                                yari->gdb->no_ack = 1;
+                                continue;
+                        }
+                        break;
+
+                case 'D':
+                        /* Detach, the program carries on without breakpoints */
+                        put_packet("OK");
+                        gdb_free(yari);
+                        run_tcache(&yari->state);
+                        return;
+
+                case 'k':
+                        return;
+                }
+
+                put_packet(r);
+                if (r[0] == 'W' || r[0] == 'X' || yari->gdb->gone)
+                        return;
+        }
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,418 @@
+/*
+ * Host calls: yarisim runs SYSCALL on the host, so that programs can
+ * do their I/O a buffer at a time instead of a character at a time
+ * through the serial port.  The YARI core itself doesn't implement
+ * SYSCALL, this is a simulator only interface, used by the yarisys
+ * BSP of libgloss (tools/newlib/libgloss/mips/yarisys.c).
+ *
+ * The call number goes in $v0 and the arguments in $a0-$a2, numbered
+ * like libgloss/syscall.h:
+ *
+ *    1 exit(status)                      never returns
+ *    2 open(path, flags, mode)           newlib's O_* flags
+ *    3 close(fd)
+ *    4 read(fd, buf, len)
+ *    5 write(fd, buf, len)
+ *    6 lseek(fd, offset, whence)
+ *   10 fstat(fd, struct yarisys_stat *)  mode, size, blksize, mtime
+ *   19 gettimeofday(struct timeval *)
+ *
+ * The result comes back in $v0 and, if that's -1, the newlib errno
+ * in $v1.
+ *
+ * File descriptors 0, 1 and 2 are the serial port: reads come from
+ * the serial input (-i) and end at its end, writes go wherever the
+ * serial output goes.  Other descriptors are host files, private to
+ * the machine and not part of a checkpoint.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "mips32.h"
+#include "runmips.h"
+
+#define HOST_FDS        64
+#define HOST_CHUNK      65536   // Largest transfer per host call
+#define HOST_SERIAL     3       // Descriptors below this are the serial port
+
+/* newlib's values, sys/_default_fcntl.h and sys/errno.h */
+#define G_O_ACCMODE     3
+#define G_O_APPEND      0x0008
+#define G_O_CREAT       0x0200
+#define G_O_TRUNC       0x0400
+#define G_O_EXCL        0x0800
+
+#define G_EBADF         9
+#define G_EFAULT        14
+#define G_EINVAL        22
+#define G_EMFILE        24
+#define G_ENOSYS        88
+#define G_ENAMETOOLONG  91
+
+struct hostio {
+        int fd[HOST_FDS];               // Host descriptor, or -1
+};
+
+static struct hostio *hostio(void)
+{
+        int k;
+
+        if (!yari->hostio) {
+                yari->hostio = malloc(sizeof *yari->hostio);
+                if (!yari->hostio)
+                        fatal("Out of memory for the host calls\n");
+                for (k = 0; k < HOST_FDS; ++k)
+                        yari->hostio->fd[k] = -1;
+        }
+
+        return yari->hostio;
+}
+
+void hostcall_free(yarisim_t *y)
+{
+        int k;
+
+        if (!y->hostio)
+                return;
+
+        for (k = HOST_SERIAL; k < HOST_FDS; ++k)
+                if (y->hostio->fd[k] >= 0)
+                        close(y->hostio->fd[k]);
+        free(y->hostio);
+        y->hostio = NULL;
+}
+
+/* The first 34 are the traditional Unix numbers, same on both sides */
+static int guest_errno(int e)
+{
+        if (e <= 34)
+                return e;
+
+        switch (e) {
+        case ENOSYS:       return G_ENOSYS;
+        case ENAMETOOLONG: return G_ENAMETOOLONG;
+        default:           return EIO;
+        }
+}
+
+/*
+ * How many of the len bytes at a are plain RAM, contiguous on the host
+ * and not watched, so they can be copied with one memcpy().  0 if the
+ * first one isn't, anything else (the boot PROM, watched pages) goes
+ * through load() and store() a byte at a time.
+ */
+static uint32_t ram_run(uint32_t a, uint32_t len)
+{
+        uint32_t n = 0, page = 1 << WATCH_PAGE_BITS;
+
+        if (!yari->flat_memory && addr_mapped(a) &&
+            len > yari->memory_segment_size[segment(a)] - offset(a))
+                len = yari->memory_segment_size[segment(a)] - offset(a);
+
+        while (n < len && a + n < FLAT_FAST_LIMIT &&
+               addr_mapped(a + n) && !watched(a + n))
+                n += page - ((a + n) & (page - 1));
+
+        return n < len ? n : len;
+}
+
+/* What store() does on the side, once for a run of RAM */
+static void note_stores(uint32_t a, uint32_t len)
+{
+        uint32_t end = a + len, fb_end, p;
+
+        for (p = a & ~((1 << ICACHE_PAGE_BITS) - 1); p < end; p += 1 << ICACHE_PAGE_BITS)
+                icache_note_store(p);
+
+        fb_end = yari->framebuffer_start + yari->framebuffer_size;
+        if (yari->framebuffer_size && a < fb_end && yari->framebuffer_start < end) {
+                p = a > yari->framebuffer_start ? a : yari->framebuffer_start;
+                end = end < fb_end ? end : fb_end;
+                for (; p < end; p += FB_WIDTH)
+                        framebuffer_note_store(p);
+                framebuffer_note_store(end - 1);
+        }
+
+        tc_invalidate_range(a, len);
+}
+
+static int copy_in(void *dst, uint32_t src, uint32_t len)
+{
+        unsigned char *p = dst;
+        uint32_t n;
+
+        for (; len; len -= n, src += n, p += n) {
+                n = ram_run(src, len);
+                if (n)
+                        memcpy(p, addr2phys(src), n);
+                else if (addr_mapped(src))
+                        *p = load(src, 1, 1), n = 1;
+                else
+                        return -1;
+        }
+
+        return 0;
+}
+
+static int copy_out(uint32_t dst, const void *src, uint32_t len)
+{
+        const unsigned char *p = src;
+        uint32_t n;
+
+        for (; len; len -= n, dst += n, p += n) {
+                n = ram_run(dst, len);
+                if (n) {
+                        memcpy(addr2phys(dst), p, n);
+                        note_stores(dst, n);
+                } else if (addr_mapped(dst))
+                        store(dst, *p, 1), n = 1;
+                else
+                        return -1;
+        }
+
+        return 0;
+}
+
+static int copy_out32(uint32_t dst, const uint32_t *src, unsigned n)
+{
+        for (; n; --n, ++src, dst += 4) {
+                if ((dst & 3) || !addr_mapped(dst))
+                        return -1;
+                store(dst, *src, 4);
+        }
+
+        return 0;
+}
+
+static int host_fd(uint32_t fd)
+{
+        return fd < HOST_FDS ? hostio()->fd[fd] : -1;
+}
+
+static int host_open(uint32_t path, uint32_t flags, uint32_t mode, int *err)
+{
+        char name[1024];
+        int hflags, fd, k;
+
+        for (k = 0; k < sizeof name; ++k) {
+                if (copy_in(&name[k], path + k, 1)) {
+                        *err = G_EFAULT;
+                        return -1;
+                }
+                if (!name[k])
+                        break;
+        }
+        if (k == sizeof name) {
+                *err = G_ENAMETOOLONG;
+                return -1;
+        }
+
+        for (k = HOST_SERIAL; k < HOST_FDS && hostio()->fd[k] >= 0; ++k)
+                ;
+        if (k == HOST_FDS) {
+                *err = G_EMFILE;
+                return -1;
+        }
+
+        switch (flags & G_O_ACCMODE) {
+        case 0:  hflags = O_RDONLY; break;
+        case 1:  hflags = O_WRONLY; break;
+        case 2:  hflags = O_RDWR; break;
+        default: *err = G_EINVAL; return -1;
+        }
+        if (flags & G_O_APPEND) hflags |= O_APPEND;
+        if (flags & G_O_CREAT)  hflags |= O_CREAT;
+        if (flags & G_O_TRUNC)  hflags |= O_TRUNC;
+        if (flags & G_O_EXCL)   hflags |= O_EXCL;
+
+        fd = open(name, hflags, mode & 0777);
+        if (fd < 0) {
+                *err = guest_errno(errno);
+                return -1;
+        }
+
+        hostio()->fd[k] = fd;
+        return k;
+}
+
+static int host_read(uint32_t fd, uint32_t buf, uint32_t len, int *err)
+{
+        static __thread char data[HOST_CHUNK];
+        int n;
+
+        if (len > HOST_CHUNK)
+                len = HOST_CHUNK;
+
+        if (fd < HOST_SERIAL)
+                n = serial_read(data, len);
+        else if (host_fd(fd) >= 0)
+                n = read(host_fd(fd), data, len);
+        else {
+                *err = G_EBADF;
+                return -1;
+        }
+
+        if (n < 0)
+                *err = guest_errno(errno);
+        else if (copy_out(buf, data, n)) {
+                *err = G_EFAULT;
+                return -1;
+        }
+
+        return n;
+}
+
+static int host_write(uint32_t fd, uint32_t buf, uint32_t len, int *err)
+{
+        static __thread char data[HOST_CHUNK];
+        int n;
+
+        if (len > HOST_CHUNK)
+                len = HOST_CHUNK;
+
+        if (fd >= HOST_SERIAL && host_fd(fd) < 0) {
+                *err = G_EBADF;
+                return -1;
+        }
+
+        if (copy_in(data, buf, len)) {
+                *err = G_EFAULT;
+                return -1;
+        }
+
+        n = fd < HOST_SERIAL ? serial_write(data, len) : write(host_fd(fd), data, len);
+        if (n < 0)
+                *err = guest_errno(errno);
+
+        return n;
+}
+
+static int host_fstat(uint32_t fd, uint32_t buf, int *err)
+{
+        struct stat st;
+        uint32_t w[4];
+
+        if (fd < HOST_SERIAL) {
+                memset(&st, 0, sizeof st);
+                st.st_mode = S_IFCHR | 0620;
+        } else if (host_fd(fd) < 0) {
+                *err = G_EBADF;
+                return -1;
+        } else if (fstat(host_fd(fd), &st)) {
+                *err = guest_errno(errno);
+                return -1;
+        }
+
+        /* The S_IF* bits are the same in newlib */
+        w[0] = st.st_mode;
+        w[1] = st.st_size;
+        w[2] = st.st_blksize;
+        w[3] = st.st_mtime;
+        if (copy_out32(buf, w, 4)) {
+                *err = G_EFAULT;
+                return -1;
+        }
+
+        return 0;
+}
+
+static int host_gettimeofday(uint32_t buf, int *err)
+{
+        struct timeval tv;
+        uint32_t w[2];
+
+        gettimeofday(&tv, NULL);
+        w[0] = tv.tv_sec;
+        w[1] = tv.tv_usec;
+        if (copy_out32(buf, w, 2)) {
+                *err = G_EFAULT;
+                return -1;
+        }
+
+        return 0;
+}
+
+void hostcall(MIPS_state_t *state)
+{
+        uint32_t a0 = state->r[4], a1 = state->r[5], a2 = state->r[6];
+        int err = 0, r;
+
+        ++yari->n_effects;
+        switch (state->r[2]) {
+        case HOSTCALL_EXIT:
+                fflush(stdout);
+                sim_exit(a0);
+
+        case HOSTCALL_OPEN:
+                r = host_open(a0, a1, a2, &err);
+                break;
+
+        case HOSTCALL_CLOSE:
+                if (a0 < HOST_SERIAL)
+                        r = 0;
+                else if (host_fd(a0) < 0) {
+                        err = G_EBADF;
+                        r = -1;
+                } else {
+                        r = close(host_fd(a0));
+                        if (r < 0)
+                                err = guest_errno(errno);
+                        hostio()->fd[a0] = -1;
+                }
+                break;
+
+        case HOSTCALL_READ:
+                r = host_read(a0, a1, a2, &err);
+                break;
+
+        case HOSTCALL_WRITE:
+                r = host_write(a0, a1, a2, &err);
+                break;
+
+        case HOSTCALL_LSEEK:
+                if (a0 < HOST_SERIAL || host_fd(a0) < 0) {
+                        err = a0 < HOST_SERIAL ? ESPIPE : G_EBADF;
+                        r = -1;
+                } else {
+                        off_t o = lseek(host_fd(a0), (int32_t) a1, a2);
+
+                        if (o < 0)
+                                err = guest_errno(errno);
+                        else if (o > INT32_MAX) {
+                                err = G_EINVAL;
+                                o = -1;
+                        }
+                        r = o;
+                }
+                break;
+
+        case HOSTCALL_FSTAT:
+                r = host_fstat(a0, a1, &err);
+                break;
+
+        case HOSTCALL_GETTIMEOFDAY:
+                r = host_gettimeofday(a0, &err);
+                break;
+
+        default:
+                err = G_ENOSYS;
+                r = -1;
+        }
+
+        state->r[2] = r;
+        if (r == -1)
+                state->r[3] = err;
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,119 @@
+/*
+ * Idle time.  Programs waiting on the serial port spin on its status
+ * registers (tinymon's serial_in(), the gdbstub's getDebugChar()),
+ * and WAIT waits for whatever comes next.  Simulating either keeps a
+ * host core busy doing nothing, so we skip ahead instead.
+ *
+ * A poll of the serial status that finds the machine exactly as at
+ * the previous one -- the same status, registers and number of
+ * instructions since, and no stores, other I/O or host calls in
+ * between (n_effects) -- is a loop that can't change until the port
+ * does.  After IDLE_CONFIRM such polls in a row, serial_idle() moves
+ * on to when the port can change, blocking on the input if it has to,
+ * and TSC advances by the cycles skipped.
+ *
+ * As nothing raises interrupts, WAIT only ends when serial input
+ * arrives, and right away if none ever can.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "mips32.h"
+#include "runmips.h"
+
+#define IDLE_MAX_LOOP   32      // Instructions from one poll to the next
+#define IDLE_CONFIRM    4       // Identical polls before skipping
+#define IDLE_BACKOFF    4096    // Polls to let go by after a failed skip
+
+struct idle {
+        uint32_t r[32], hi, lo;
+        unsigned reg, value;
+        uint64_t n_issue, n_effects;
+        uint64_t period;
+        unsigned matches;
+        unsigned backoff;
+};
+
+static struct idle *idle(void)
+{
+        if (!yari->idle) {
+                yari->idle = calloc(1, sizeof *yari->idle);
+                if (!yari->idle)
+                        fatal("Out of memory for the idle detection\n");
+        }
+
+        return yari->idle;
+}
+
+void idle_free(yarisim_t *y)
+{
+        free(y->idle);
+        y->idle = NULL;
+}
+
+static void idle_skip(uint64_t cycles)
+{
+        yari->TSC += cycles;
+        yari->n_idle += cycles;
+        tc_skip_cycles(cycles);
+        timing_idle(cycles);
+}
+
+/* A load of serial port register reg gave value */
+void idle_poll(unsigned reg, unsigned value)
+{
+        struct idle *id = idle();
+        MIPS_state_t *s = &yari->state;
+        uint64_t period = yari->n_issue - id->n_issue;
+        int64_t cycles;
+
+        if (reg == id->reg && value == id->value &&
+            period == id->period && period <= IDLE_MAX_LOOP &&
+            yari->n_effects == id->n_effects + 1 &&
+            s->hi == id->hi && s->lo == id->lo &&
+            memcmp(s->r, id->r, sizeof id->r) == 0)
+                ++id->matches;
+        else {
+                id->matches = 0;
+                memcpy(id->r, s->r, sizeof id->r);
+                id->hi     = s->hi;
+                id->lo     = s->lo;
+                id->reg    = reg;
+                id->value  = value;
+                id->period = period;
+        }
+        id->n_issue   = yari->n_issue;
+        id->n_effects = yari->n_effects;
+
+        if (id->matches < IDLE_CONFIRM)
+                return;
+        id->matches = 0;
+
+        if (id->backoff) {
+                --id->backoff;
+                return;
+        }
+
+        cycles = serial_idle(reg);
+        if (cycles < 0)
+                id->backoff = IDLE_BACKOFF / IDLE_CONFIRM;
+        else
+                idle_skip(cycles);
+}
+
+/* C0 WAIT */
+void idle_wait(void)
+{
+        int64_t cycles = serial_idle(2);
+
+        if (cycles > 0)
+                idle_skip(cycles);
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
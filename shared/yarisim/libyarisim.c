@@ -0,0 +1,201 @@
+/*
+ * libyarisim, see yarisim.h.
+ *
+ * The core finds the machine it works on through the thread's yari,
+ * which every entry point sets.  fatal() and the ways a program ends
+ * (sim_exit()) jump back here through yari->bail rather than exiting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+#include "mips32.h"
+#include "runmips.h"
+#include "yarisim.h"
+
+/*
+ * Call fn(arg) on y, returning 0 if it returned, 1 if the program
+ * exited and 2 on an error.
+ */
+static int guarded(yarisim_t *y, void (*fn)(void *), void *arg)
+{
+        sigjmp_buf bail;
+        int r;
+
+        yari = y;
+        y->bail = &bail;
+        r = sigsetjmp(bail, 1);
+        if (r == 0)
+                fn(arg);
+        y->bail = NULL;
+        flat_segv_report();
+
+        return r;
+}
+
+static void create(void *arg)
+{
+        /* The RTL's I$, see init_caches() in sim.c */
+        cache_init(&yari->icache, "I$", 4, 7, 4, CACHE_ROUND_ROBIN, 1);
+        init_reg_use_map();
+}
+
+yarisim_t *yarisim_create(void)
+{
+        yarisim_t *y = sim_new();
+
+        if (!y)
+                return NULL;
+
+        y->echo_serial = 0;
+        if (guarded(y, create, NULL)) {
+                sim_free(y);
+                return NULL;
+        }
+
+        return y;
+}
+
+void yarisim_destroy(yarisim_t *y)
+{
+        if (yari == y)
+                yari = NULL;
+        sim_free(y);
+}
+
+static void load_elf(void *filename)
+{
+        readelf(filename);
+        reset_mips_state(&yari->state);
+        yari->state.pc = yari->program_entry;
+}
+
+int yarisim_load_elf(yarisim_t *y, const char *filename)
+{
+        return guarded(y, load_elf, (void *) filename) ? YARISIM_ERROR : YARISIM_RUNNING;
+}
+
+static void checkpoint(void *filename)
+{
+        checkpoint_save(filename);
+}
+
+int yarisim_checkpoint(yarisim_t *y, const char *filename)
+{
+        return guarded(y, checkpoint, (void *) filename) ? YARISIM_ERROR : YARISIM_RUNNING;
+}
+
+static void restore(void *filename)
+{
+        checkpoint_restore(filename);
+}
+
+int yarisim_restore(yarisim_t *y, const char *filename)
+{
+        return guarded(y, restore, (void *) filename) ? YARISIM_ERROR : YARISIM_RUNNING;
+}
+
+static void run(void *arg)
+{
+        run_tcache(&yari->state);
+}
+
+int yarisim_run_for(yarisim_t *y, uint64_t n)
+{
+        int r;
+
+        if (y->stopped)
+                return y->stopped;
+
+        y->stop_issue = y->n_issue + n;
+        r = guarded(y, run, NULL);
+        tc_fold_stats();
+        serial_flush();
+
+        if (y->segfault)
+                y->stopped = YARISIM_FAULT;
+        else if (r == 1)
+                y->stopped = YARISIM_EXITED;
+        else if (r == 2)
+                y->stopped = YARISIM_ERROR;
+
+        return y->stopped;
+}
+
+int yarisim_read_mem(yarisim_t *y, uint32_t address, void *buf, size_t len)
+{
+        uint8_t *p = buf;
+
+        yari = y;
+        for (; len; --len, ++address) {
+                if (!addr_mapped(address))
+                        return YARISIM_FAULT;
+                *p++ = *(uint8_t *) addr2phys(address);
+        }
+
+        return YARISIM_RUNNING;
+}
+
+int yarisim_write_mem(yarisim_t *y, uint32_t address, const void *buf, size_t len)
+{
+        const uint8_t *p = buf;
+
+        yari = y;
+        for (; len; --len, ++address) {
+                if (!addr_mapped(address))
+                        return YARISIM_FAULT;
+                *(uint8_t *) addr2phys(address) = *p++;
+
+                /* What store() does on the side */
+                icache_note_store(address);
+                if (address - y->framebuffer_start < y->framebuffer_size)
+                        framebuffer_note_store(address);
+                tc_invalidate(address);
+        }
+
+        return YARISIM_RUNNING;
+}
+
+void yarisim_set_serial(yarisim_t *y, int in_fd, int out_fd)
+{
+        y->rs232in_fd  = in_fd;
+        y->rs232out_fd = out_fd;
+}
+
+const char *yarisim_error(yarisim_t *y)
+{
+        return y->error;
+}
+
+int yarisim_exit_status(yarisim_t *y)
+{
+        return y->exit_status;
+}
+
+uint64_t yarisim_instructions(yarisim_t *y)
+{
+        return y->n_issue;
+}
+
+uint64_t yarisim_cycles(yarisim_t *y)
+{
+        return y->TSC;
+}
+
+uint32_t yarisim_pc(yarisim_t *y)
+{
+        return y->state.pc;
+}
+
+uint32_t yarisim_reg(yarisim_t *y, unsigned r)
+{
+        return r < 32 ? y->state.r[r] : 0;
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,407 @@
+/*
+ * Guest profiler, enabled with --profile=<gmon file>.
+ *
+ * Nothing is looked up while the program runs.  Retired
+ * instructions, I$ misses and load-use stall cycles are counted per
+ * instruction address, in pages that are allocated as code gets
+ * executed (so JIT compiled code is covered too), and calls are
+ * counted per call site and target.  The translation cache hands
+ * over its per block counts when folding its statistics, the
+ * reference interpreter counts every instruction.
+ *
+ * At the end the counts are attributed to the functions of the
+ * symbol table for a flat profile and the busiest call graph edges,
+ * and written as a gmon.out file for
+ *
+ *      mips-elf-gprof prog.mips gmon.out
+ *
+ * The gmon histogram has a bin for every instruction of the symbols'
+ * address range, scaled to fit 16 bits, in units of k, M or G
+ * instructions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "mips32.h"
+#include "runmips.h"
+
+#define PROF_PAGE_BITS  12
+#define PROF_PAGE_WORDS (1 << (PROF_PAGE_BITS - 2))
+#define PROF_TOP        30      // Lines in the printed profiles
+
+typedef struct prof_page {
+        uint64_t insts[PROF_PAGE_WORDS];
+        uint64_t icache_misses[PROF_PAGE_WORDS];
+        uint64_t stalls[PROF_PAGE_WORDS];
+} prof_page_t;
+
+typedef struct prof_arc {
+        uint32_t from, to;
+        uint64_t count;
+} prof_arc_t;
+
+struct profile {
+        prof_page_t *page[1 << (32 - PROF_PAGE_BITS)];
+        prof_arc_t  *arc;               // Open addressing on from and to
+        unsigned     arcs, arc_slots;   // arc_slots a power of two
+};
+
+/* What a function or a page of unknown code adds up to */
+typedef struct prof_entry {
+        uint32_t    address;
+        const char *name;
+        uint64_t    insts, icache_misses, stalls, calls;
+} prof_entry_t;
+
+void profile_start(void)
+{
+        yari->profile = calloc(1, sizeof *yari->profile);
+        if (!yari->profile)
+                fatal("Out of memory for the profile\n");
+}
+
+void profile_free(yarisim_t *y)
+{
+        unsigned k;
+
+        if (!y->profile)
+                return;
+
+        for (k = 0; k < 1 << (32 - PROF_PAGE_BITS); ++k)
+                free(y->profile->page[k]);
+        free(y->profile->arc);
+        free(y->profile);
+        y->profile = NULL;
+}
+
+static prof_page_t *prof_page(uint32_t pc)
+{
+        prof_page_t **p = &yari->profile->page[pc >> PROF_PAGE_BITS];
+
+        if (!*p) {
+                *p = calloc(1, sizeof **p);
+                if (!*p)
+                        fatal("Out of memory for the profile\n");
+        }
+
+        return *p;
+}
+
+#define PROF_WORD(pc) (((pc) >> 2) & (PROF_PAGE_WORDS - 1))
+
+/* n consecutive instructions from pc were each retired count times */
+void profile_block(uint32_t pc, unsigned n, uint64_t count)
+{
+        for (; n; --n, pc += 4)
+                prof_page(pc)->insts[PROF_WORD(pc)] += count;
+}
+
+void profile_icache_miss(uint32_t pc)
+{
+        ++prof_page(pc)->icache_misses[PROF_WORD(pc)];
+}
+
+void profile_stall(uint32_t pc, unsigned cycles)
+{
+        prof_page(pc)->stalls[PROF_WORD(pc)] += cycles;
+}
+
+#define ARC_HASH(from, to) (((from) * 0x9E3779B1U ^ (to) * 0x85EBCA6BU) >> 7)
+
+static prof_arc_t *prof_arc(prof_arc_t *arc, unsigned slots, uint32_t from, uint32_t to)
+{
+        unsigned k = ARC_HASH(from, to);
+
+        for (;; ++k) {
+                prof_arc_t *a = &arc[k & (slots - 1)];
+
+                if (!a->count || (a->from == from && a->to == to))
+                        return a;
+        }
+}
+
+void profile_call(uint32_t from, uint32_t to)
+{
+        struct profile *p = yari->profile;
+        prof_arc_t *a;
+
+        if (2 * (p->arcs + 1) > p->arc_slots) {
+                unsigned slots = p->arc_slots ? 2 * p->arc_slots : 1024, k;
+                prof_arc_t *arc = calloc(slots, sizeof *arc);
+
+                if (!arc)
+                        fatal("Out of memory for the profile\n");
+
+                for (k = 0; k < p->arc_slots; ++k)
+                        if (p->arc[k].count)
+                                *prof_arc(arc, slots, p->arc[k].from, p->arc[k].to) = p->arc[k];
+
+                free(p->arc);
+                p->arc = arc;
+                p->arc_slots = slots;
+        }
+
+        a = prof_arc(p->arc, p->arc_slots, from, to);
+        if (!a->count++) {
+                a->from = from;
+                a->to   = to;
+                ++p->arcs;
+        }
+}
+
+static int by_insts(const void *a, const void *b)
+{
+        const prof_entry_t *x = a, *y = b;
+
+        return x->insts < y->insts ? 1 : x->insts > y->insts ? -1 : 0;
+}
+
+static int by_count(const void *a, const void *b)
+{
+        const prof_arc_t *x = a, *y = b;
+
+        return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+/*
+ * Where the counts at pc go: a function, or the page for code
+ * without symbols
+ */
+static prof_entry_t *prof_entry(prof_entry_t *e, unsigned *n, uint32_t pc)
+{
+        const symbol_t *s = symbol_lookup(pc);
+        uint32_t address = s ? s->address : pc & ~((1 << PROF_PAGE_BITS) - 1);
+
+        /* The counts come in address order */
+        if (*n && e[*n - 1].address == address && (e[*n - 1].name != NULL) == (s != NULL))
+                return &e[*n - 1];
+
+        memset(&e[*n], 0, sizeof e[*n]);
+        e[*n].address = address;
+        e[*n].name    = s ? s->name : NULL;
+
+        return &e[(*n)++];
+}
+
+static const char *prof_name(const prof_entry_t *e)
+{
+        static char buf[32];
+
+        if (e->name)
+                return e->name;
+
+        snprintf(buf, sizeof buf, "[%08x]", e->address);
+        return buf;
+}
+
+void profile_print(void)
+{
+        struct profile *p = yari->profile;
+        prof_entry_t *e = NULL;
+        prof_arc_t *arc;
+        uint64_t total = 0;
+        unsigned n = 0, max = 0, k, w;
+
+        /* Gather everything in address order */
+        for (k = 0; k < 1 << (32 - PROF_PAGE_BITS); ++k) {
+                prof_page_t *pg = p->page[k];
+
+                if (!pg)
+                        continue;
+
+                for (w = 0; w < PROF_PAGE_WORDS; ++w) {
+                        uint32_t pc = (k << PROF_PAGE_BITS) + 4 * w;
+                        prof_entry_t *f;
+
+                        if (!pg->insts[w] && !pg->icache_misses[w] && !pg->stalls[w])
+                                continue;
+
+                        if (n == max) {
+                                max = max ? 2 * max : 256;
+                                e = realloc(e, max * sizeof *e);
+                                if (!e)
+                                        fatal("Out of memory for the profile\n");
+                        }
+
+                        f = prof_entry(e, &n, pc);
+                        f->insts         += pg->insts[w];
+                        f->icache_misses += pg->icache_misses[w];
+                        f->stalls        += pg->stalls[w];
+                        total            += pg->insts[w];
+                }
+        }
+
+        arc = malloc(p->arcs * sizeof *arc + 1);
+        if (!arc)
+                fatal("Out of memory for the profile\n");
+        for (k = w = 0; k < p->arc_slots; ++k)
+                if (p->arc[k].count)
+                        arc[w++] = p->arc[k];
+
+        /* Calls go to the entry of the callee */
+        for (k = 0; k < p->arcs; ++k) {
+                prof_entry_t key = { .insts = 0 };
+                unsigned lo = 0, hi = n;
+                const symbol_t *s = symbol_lookup(arc[k].to);
+
+                key.address = s ? s->address : arc[k].to & ~((1 << PROF_PAGE_BITS) - 1);
+                while (lo < hi) {
+                        unsigned mid = (lo + hi) / 2;
+
+                        if (e[mid].address < key.address)
+                                lo = mid + 1;
+                        else
+                                hi = mid;
+                }
+                if (lo < n && e[lo].address == key.address)
+                        e[lo].calls += arc[k].count;
+        }
+
+        qsort(e, n, sizeof *e, by_insts);
+        qsort(arc, p->arcs, sizeof *arc, by_count);
+
+        printf("\nFlat profile:\n"
+               "  %%insts  instructions  I$ misses  load-use stalls      calls  function\n");
+        for (k = 0; k < n && k < PROF_TOP; ++k)
+                printf("  %5.2f%% %13llu %10llu %16llu %10llu  %s\n",
+                       total ? 100.0 * e[k].insts / total : 0.0,
+                       (long long unsigned) e[k].insts,
+                       (long long unsigned) e[k].icache_misses,
+                       (long long unsigned) e[k].stalls,
+                       (long long unsigned) e[k].calls,
+                       prof_name(&e[k]));
+
+        if (p->arcs)
+                printf("\nCall graph edges:\n"
+                       "       calls  call site -> callee\n");
+        for (k = 0; k < p->arcs && k < PROF_TOP; ++k) {
+                const symbol_t *from = symbol_lookup(arc[k].from);
+                const symbol_t *to   = symbol_lookup(arc[k].to);
+
+                printf("  %10llu  ", (long long unsigned) arc[k].count);
+                if (from)
+                        printf("%s+0x%x", from->name, arc[k].from - from->address);
+                else
+                        printf("%08x", arc[k].from);
+                printf(" -> ");
+                if (to && to->address == arc[k].to)
+                        printf("%s\n", to->name);
+                else if (to)
+                        printf("%s+0x%x\n", to->name, arc[k].to - to->address);
+                else
+                        printf("%08x\n", arc[k].to);
+        }
+
+        free(arc);
+        free(e);
+}
+
+/* gmon.out is in the byte order of the target */
+static void put8(FILE *f, uint8_t v)
+{
+        fputc(v, f);
+}
+
+static void put16(FILE *f, uint16_t v)
+{
+        if (yari->endian_is_big)
+                put8(f, v >> 8), put8(f, v);
+        else
+                put8(f, v), put8(f, v >> 8);
+}
+
+static void put32(FILE *f, uint32_t v)
+{
+        if (yari->endian_is_big)
+                put16(f, v >> 16), put16(f, v);
+        else
+                put16(f, v), put16(f, v >> 16);
+}
+
+static uint64_t prof_insts(uint32_t pc)
+{
+        prof_page_t *pg = yari->profile->page[pc >> PROF_PAGE_BITS];
+
+        return pg ? pg->insts[PROF_WORD(pc)] : 0;
+}
+
+void profile_write_gmon(const char *filename)
+{
+        static const struct { uint64_t unit; const char *name; } units[] = {
+                { 1000, "kinstructions" }, { 1000000, "Minstructions" },
+                { 1000000000, "Ginstructions" },
+        };
+        struct profile *p = yari->profile;
+        uint32_t low, high, pc;
+        uint64_t max = 0, scale = 1;
+        char dimen[15];
+        unsigned k, u;
+        FILE *f;
+
+        if (yari->nsymbols) {
+                symbol_t *last = &yari->symbols[yari->nsymbols - 1];
+
+                low  = yari->symbols[0].address;
+                high = last->address + (last->size ? last->size : 4);
+        } else {
+                low  = yari->text_start;
+                high = yari->text_start + yari->text_size;
+        }
+        low  &= ~3;
+        high  = (high + 3) & ~3;
+        if (high <= low)
+                high = low + 4;
+
+        for (pc = low; pc != high; pc += 4)
+                if (max < prof_insts(pc))
+                        max = prof_insts(pc);
+
+        while (max / scale > 65535)
+                scale *= 10;
+        for (u = 0; u + 1 < sizeof units / sizeof units[0] && units[u].unit < scale; ++u)
+                ;
+
+        f = fopen(filename, "w");
+        if (!f) {
+                perror(filename);
+                return;
+        }
+
+        fwrite("gmon", 4, 1, f);
+        put32(f, 1);                    // Version
+        put32(f, 0), put32(f, 0), put32(f, 0);
+
+        put8(f, 0);                     // Histogram
+        put32(f, low);
+        put32(f, high);
+        put32(f, (high - low) / 4);
+        put32(f, units[u].unit / scale ? units[u].unit / scale : 1);
+        memset(dimen, 0, sizeof dimen);
+        memcpy(dimen, units[u].name, strlen(units[u].name));
+        fwrite(dimen, sizeof dimen, 1, f);
+        put8(f, units[u].name[0]);
+        for (pc = low; pc != high; pc += 4) {
+                uint64_t v = prof_insts(pc) / scale;
+
+                put16(f, v > 65535 ? 65535 : v);
+        }
+
+        for (k = 0; k < p->arc_slots; ++k)
+                if (p->arc[k].count) {
+                        put8(f, 1);     // Call graph arc
+                        put32(f, p->arc[k].from);
+                        put32(f, p->arc[k].to);
+                        put32(f, p->arc[k].count > 0xFFFFFFFF ? 0xFFFFFFFF : p->arc[k].count);
+                }
+
+        if (fclose(f))
+                perror(filename);
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
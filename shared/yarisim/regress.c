@@ -0,0 +1,328 @@
+/*
+ * yariregress, run test programs concurrently on libyarisim.
+ *
+ * Every program is loaded straight from its ELF file (no tinymon and
+ * no serial download) and run on a pool of worker threads, each test
+ * with its own machine.  A test passes when the program exits through
+ * the TEST SUCCESS hack, see crt0.S.  Tests are stopped when they
+ * exceed the instruction budget or the wall clock timeout.
+ *
+ * If foo.in exists next to foo.mips, it's fed to the serial port.
+ * With -l the serial output of each test goes to <dir>/<test>.log.
+ *
+ * A table goes to stdout and, with -o, a JSON summary with the
+ * result, instructions retired, simulated MIPS and wall time of every
+ * test, which doubles as a performance baseline.
+ */
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include "yarisim.h"
+
+#define SLICE 1000000   // Instructions between budget and timeout checks
+
+typedef struct test {
+        const char *filename;
+        char        name[64];
+        const char *result;
+        int         exit_status;
+        uint64_t    instructions;
+        uint64_t    cycles;
+        double      wall;
+        char        error[256];
+} test_t;
+
+static test_t  *tests;
+static int      ntests;
+static int      next_test;
+
+static uint64_t budget  = 10000000000ULL;
+static double   timeout = 60;
+static char    *log_dir;
+
+static double now(void)
+{
+        struct timeval t;
+
+        gettimeofday(&t, NULL);
+        return t.tv_sec + 1e-6 * t.tv_usec;
+}
+
+/* foo/bar.mips -> bar */
+static void test_name(char *name, size_t size, const char *filename)
+{
+        const char *base = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+        char *dot;
+
+        snprintf(name, size, "%s", base);
+        dot = strrchr(name, '.');
+        if (dot && dot != name)
+                *dot = 0;
+}
+
+static int open_input(const char *filename)
+{
+        char path[1024];
+        char *dot;
+
+        snprintf(path, sizeof path - 3, "%s", filename);
+        dot = strrchr(path, '.');
+        if (!dot || strchr(dot, '/'))
+                dot = path + strlen(path);
+        strcpy(dot, ".in");
+
+        return open(path, O_RDONLY);
+}
+
+static int open_log(const char *name)
+{
+        char path[1024];
+
+        if (!log_dir)
+                return -1;
+
+        snprintf(path, sizeof path, "%s/%s.log", log_dir, name);
+        return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+static void run_test(test_t *t)
+{
+        double start = now();
+        yarisim_t *y;
+        int in_fd, out_fd, r;
+
+        test_name(t->name, sizeof t->name, t->filename);
+
+        y = yarisim_create();
+        if (!y) {
+                t->result = "error";
+                snprintf(t->error, sizeof t->error, "Out of memory");
+                return;
+        }
+
+        in_fd  = open_input(t->filename);
+        out_fd = open_log(t->name);
+        yarisim_set_serial(y, in_fd, out_fd);
+
+        if (yarisim_load_elf(y, t->filename) != YARISIM_RUNNING) {
+                t->result = "error";
+                snprintf(t->error, sizeof t->error, "%s", yarisim_error(y));
+                goto out;
+        }
+
+        for (;;) {
+                uint64_t left = budget - yarisim_instructions(y);
+
+                r = yarisim_run_for(y, left < SLICE ? left : SLICE);
+                if (r != YARISIM_RUNNING)
+                        break;
+
+                if (yarisim_instructions(y) >= budget) {
+                        t->result = "budget";
+                        break;
+                }
+
+                if (now() - start > timeout) {
+                        t->result = "timeout";
+                        break;
+                }
+        }
+
+        switch (r) {
+        case YARISIM_EXITED:
+                t->exit_status = yarisim_exit_status(y);
+                t->result = t->exit_status == 0 ? "pass" : "fail";
+                break;
+        case YARISIM_FAULT:
+                t->result = "fault";
+                break;
+        case YARISIM_ERROR:
+                t->result = "error";
+                snprintf(t->error, sizeof t->error, "%s", yarisim_error(y));
+                break;
+        }
+
+out:
+        t->error[strcspn(t->error, "\n")] = 0;
+        t->instructions = yarisim_instructions(y);
+        t->cycles       = yarisim_cycles(y);
+        yarisim_destroy(y);
+        if (in_fd >= 0)
+                close(in_fd);
+        if (out_fd >= 0)
+                close(out_fd);
+        t->wall = now() - start;
+}
+
+static int worker(void *arg)
+{
+        int k;
+
+        while ((k = __atomic_fetch_add(&next_test, 1, __ATOMIC_RELAXED)) < ntests)
+                run_test(&tests[k]);
+
+        return 0;
+}
+
+static void json_string(FILE *f, const char *s)
+{
+        fputc('"', f);
+        for (; *s; ++s)
+                if (*s == '"' || *s == '\\')
+                        fprintf(f, "\\%c", *s);
+                else if ((unsigned char) *s < ' ')
+                        fprintf(f, "\\u%04x", *s);
+                else
+                        fputc(*s, f);
+        fputc('"', f);
+}
+
+static void write_summary(const char *filename, int jobs, int passed, double wall)
+{
+        FILE *f = fopen(filename, "w");
+        int k;
+
+        if (!f) {
+                perror(filename);
+                return;
+        }
+
+        fprintf(f, "{\n  \"jobs\": %d,\n  \"tests\": %d,\n  \"passed\": %d,\n"
+                "  \"wall_seconds\": %.3f,\n  \"results\": [\n",
+                jobs, ntests, passed, wall);
+
+        for (k = 0; k < ntests; ++k) {
+                test_t *t = &tests[k];
+
+                fprintf(f, "    {\"name\": ");
+                json_string(f, t->name);
+                fprintf(f, ", \"file\": ");
+                json_string(f, t->filename);
+                fprintf(f, ", \"result\": \"%s\", \"exit_status\": %d, "
+                        "\"instructions\": %llu, \"cycles\": %llu, "
+                        "\"wall_seconds\": %.3f, \"mips\": %.2f",
+                        t->result, t->exit_status,
+                        (long long unsigned) t->instructions,
+                        (long long unsigned) t->cycles,
+                        t->wall, t->wall > 0 ? t->instructions / (1e6 * t->wall) : 0.0);
+                if (t->error[0]) {
+                        fprintf(f, ", \"error\": ");
+                        json_string(f, t->error);
+                }
+                fprintf(f, "}%s\n", k + 1 < ntests ? "," : "");
+        }
+
+        fprintf(f, "  ]\n}\n");
+        fclose(f);
+}
+
+static void usage(char *program)
+{
+        fprintf(stderr,
+                "Usage: %s [options] <mips-elf-files ...>\n"
+                "\n"
+                "  -j jobs          worker threads (default: one per core)\n"
+                "  -n instructions  budget per test (default %llu)\n"
+                "  -t seconds       wall clock timeout per test (default %g)\n"
+                "  -o file          write a JSON summary\n"
+                "  -l dir           write the serial output of each test to dir/<test>.log\n"
+                "  -v               keep the simulator's own messages\n",
+                program, (long long unsigned) budget, timeout);
+        exit(1);
+}
+
+int main(int argc, char **argv)
+{
+        SDL_Thread **threads;
+        char *summary = NULL;
+        int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        int verbose = 0, passed = 0, stdout_fd = -1;
+        double start;
+        int c, k;
+
+        while ((c = getopt(argc, argv, "j:n:t:o:l:v")) != -1)
+                switch (c) {
+                case 'j': jobs    = atoi(optarg); break;
+                case 'n': budget  = strtoull(optarg, NULL, 0); break;
+                case 't': timeout = atof(optarg); break;
+                case 'o': summary = optarg; break;
+                case 'l': log_dir = optarg; break;
+                case 'v': verbose = 1; break;
+                default:  usage(argv[0]);
+                }
+
+        if (optind >= argc)
+                usage(argv[0]);
+
+        ntests = argc - optind;
+        tests  = calloc(ntests, sizeof tests[0]);
+        if (jobs < 1)
+                jobs = 1;
+        if (jobs > ntests)
+                jobs = ntests;
+        threads = calloc(jobs, sizeof threads[0]);
+        if (!tests || !threads) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+        }
+
+        for (k = 0; k < ntests; ++k)
+                tests[k].filename = argv[optind + k];
+
+        /* The engines chat on stdout (TEST SUCCESS! etc.) */
+        if (!verbose) {
+                int null_fd = open("/dev/null", O_WRONLY);
+
+                fflush(stdout);
+                stdout_fd = dup(1);
+                if (null_fd >= 0 && stdout_fd >= 0)
+                        dup2(null_fd, 1);
+                if (null_fd >= 0)
+                        close(null_fd);
+        }
+
+        start = now();
+        for (k = 0; k < jobs; ++k)
+                threads[k] = SDL_CreateThread(worker, NULL);
+        for (k = 0; k < jobs; ++k)
+                if (threads[k])
+                        SDL_WaitThread(threads[k], NULL);
+                else
+                        worker(NULL);
+
+        if (stdout_fd >= 0) {
+                fflush(stdout);
+                dup2(stdout_fd, 1);
+                close(stdout_fd);
+        }
+
+        for (k = 0; k < ntests; ++k) {
+                test_t *t = &tests[k];
+
+                passed += strcmp(t->result, "pass") == 0;
+                printf("%-24s %-8s %12llu insts %8.3fs %9.2f MIPS  %s\n",
+                       t->name, t->result,
+                       (long long unsigned) t->instructions, t->wall,
+                       t->wall > 0 ? t->instructions / (1e6 * t->wall) : 0.0,
+                       t->error);
+        }
+        printf("%d of %d passed, %d jobs, %.2fs\n", passed, ntests, jobs, now() - start);
+
+        if (summary)
+                write_summary(summary, jobs, passed, now() - start);
+
+        return passed == ntests ? 0 : 1;
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
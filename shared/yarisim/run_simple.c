@@ -12,7 +12,6 @@
 #include "runmips.h"
 #include "perfcounters.h"
 
-unsigned coverage[64+64+32];
 char *inst_name[64+64+32] = {
         // ROOT MAP
         // "SPECIAL", "REGIMM",
@@ -153,46 +152,6 @@ void init_reg_use_map(void)
 #define UNTESTED() ({ if (tested[__LINE__]++ == 0) printf(__FILE__ ":%d: not tested\n", __LINE__); })
 #define TESTED()
 
-#define KEEP_LINES 400
-#define RTL_MAX_LINE 200
-char last[KEEP_LINES][RTL_MAX_LINE];
-unsigned last_p = 0;
-
-int get_rtl_commit(uint64_t *cycle, unsigned *pc, unsigned *wbr, unsigned *wbv)
-{
-        char buf[RTL_MAX_LINE];
-        long long unsigned time = ~0;
-        unsigned watchdog = 1000;
-
-        for (;;) {
-                int r;
-                char *p = fgets(buf, sizeof buf, stdin);
-                if (!p)
-                        return 0;
-
-                if (--watchdog == 0) {
-                        fprintf(stderr, "No commits found in quite a long run, bailing\n");
-                        return 0;
-                }
-
-                strncpy(last[last_p++], buf, sizeof last[0]);
-                if (last_p == KEEP_LINES)
-                        last_p = 0;
-
-                r = sscanf(buf,
-                           "%llu  COMMIT  %x:r%d <- %x\n",
-                           &time, pc, wbr, wbv);
-
-                if (r != 4)
-                        continue;
-
-                *cycle = time / 100;
-
-                return 1;
-        }
-
-}
-
 // return 1 if divergence detected, 2 if EOF, 0 otherwise
 int note_commit(unsigned io,
                 unsigned pc, unsigned wbr, unsigned *wbv,
@@ -204,7 +163,7 @@ int note_commit(unsigned io,
         if (enable_cosimulation) {
                 uint64_t rtl_cycle;
                 int r = get_rtl_commit(&rtl_cycle, rtl_pc, rtl_wbr, rtl_wbv);
-                n_cycle = rtl_cycle;
+                yari->n_cycle = rtl_cycle;
 
                 if (!r)
                         return 2;
@@ -229,7 +188,7 @@ void print_coverage(void)
         for (i = 0; i < 64+64+32; ++i)
                 if (inst_name[i]) {
                         ++n;
-                        if (coverage[i])
+                        if (yari->coverage[i])
                                 ++n_tested;
                 }
 
@@ -240,88 +199,145 @@ void print_coverage(void)
                (100.0 * n_tested) / n);
 
         for (i = 0; i < 64+64+32; ++i)
-                if (inst_name[i] && !coverage[i] /*< 20*/)
+                if (inst_name[i] && !yari->coverage[i] /*< 20*/)
                         printf(" %s", inst_name[i]);
         putchar(' ');
 }
 
 /*
- * Simulate a simple 8 KiB 4-way I$.
+ * The I$ sits on top of the generic cache model (cache.c), which
+ * also keeps the line contents so stale instructions are executed
+ * just like on the hardware.  The default geometry is the RTL's
+ * 8 KiB 4-way with 16 B lines.
  */
 
-#define IC_SET_INDEX_BITS  2    // Caches has four sets
-#define IC_LINE_INDEX_BITS 7    // Each set has 128 lines
-#define IC_WORD_INDEX_BITS 2    // Each line has 4 32-bit words (128 bits)
-
-
-unsigned next_way;
-
-uint32_t icache_data[1 << IC_SET_INDEX_BITS][1 << IC_LINE_INDEX_BITS][1 << IC_WORD_INDEX_BITS];
-uint32_t icache_tag[1 << IC_SET_INDEX_BITS][1 << IC_LINE_INDEX_BITS];
+/* Only lines in pages that have been written can be stale */
+static void icache_check(uint32_t address, uint32_t ic_data)
+{
+        if ((enable_check_icache || icache_page_dirty(address)) &&
+            ic_data != load(address, 4, 1))
+                printf("CRITICAL WARNING: executing stale I$ data for %08x\n",
+                       address);
+}
 
-uint32_t icache_fetch(uint32_t address)
+/* The line holding address, fetched through the I$ model */
+static const uint32_t *icache_fetch_line(uint32_t address)
 {
-        unsigned line = (address >> (IC_WORD_INDEX_BITS + 2)) & ((1 << IC_LINE_INDEX_BITS) - 1);
-        unsigned word = (address >> 2)                        & ((1 << IC_WORD_INDEX_BITS) - 1);
-        unsigned way;
-        unsigned tag = address >> (IC_LINE_INDEX_BITS + IC_WORD_INDEX_BITS + 2);
+        unsigned word = (address >> 2) & ((1 << (yari->icache.line_log2 - 2)) - 1);
         unsigned fill_address, i;
+        uint32_t *line;
+        int way;
 
-        for (way = 0; way < (1 << IC_SET_INDEX_BITS); ++way)
-                if (icache_tag[way][line] == tag) {
-                        uint32_t ic_data = icache_data[way][line][word];
-                        // I$ hit
-                        ++n_icache_hits;
+        if (enable_cache_sweep)
+                cache_sweep_access(&yari->icache_sweep, address);
 
-                        if (ic_data != load(address, 4, 1))
-                                printf("CRITICAL WARNING: executing stale I$ data for %08x\n",
-                                       address);
+        way = cache_probe(&yari->icache, address);
+        if (way >= 0) {
+                line = cache_line(&yari->icache, address, way);
+                // I$ hit
+                ++yari->icache.hits;
 
-                        return ic_data;
-                }
-        ++n_icache_misses;
+                icache_check(address, line[word]);
+
+                return line;
+        }
+        ++yari->icache.misses;
+        if (yari->profile)
+                profile_icache_miss(address);
 
         // Fill a line
-        way = next_way++ & ((1 << IC_SET_INDEX_BITS) - 1);
-        fill_address = address & ~((1 << (IC_WORD_INDEX_BITS + 2)) - 1);
-        for (i = 0; i < 1 << IC_WORD_INDEX_BITS; ++i, fill_address += 4)
-                icache_data[way][line][i] = load(fill_address, 4, 1);
-        icache_tag[way][line] = tag;
+        way = cache_fill(&yari->icache, address);
+        line = cache_line(&yari->icache, address, way);
+        fill_address = address & ~((1 << yari->icache.line_log2) - 1);
+        for (i = 0; i < 1 << (yari->icache.line_log2 - 2); ++i, fill_address += 4)
+                line[i] = load(fill_address, 4, 1);
 
-        if (icache_data[way][line][word] != load(address, 4, 1))
+        if (enable_check_icache && line[word] != load(address, 4, 1))
                 printf("BROKEN!\n");
 
-        return icache_data[way][line][word];
+        return line;
 }
 
-static void synci(unsigned address)
+uint32_t icache_fetch(uint32_t address)
 {
-        unsigned line = (address >> (IC_WORD_INDEX_BITS + 2)) & ((1 << IC_LINE_INDEX_BITS) - 1);
-        unsigned tag = address >> (IC_LINE_INDEX_BITS + IC_WORD_INDEX_BITS + 2);
-        unsigned way;
-
-        for (way = 0; way < (1 << IC_SET_INDEX_BITS); ++way)
-                if (icache_tag[way][line] == tag)
-                        // XXX I'm assuming here and elsewhere that 0 means invalid
-                        // which means that physical memory cannot be at 0 + I$ size
-                        icache_tag[way][line] = 0;
+        unsigned word = (address >> 2) & ((1 << (yari->icache.line_log2 - 2)) - 1);
+
+        return icache_fetch_line(address)[word];
 }
 
-uint64_t TSC;
+/*
+ * What fetching address would give, without touching the I$ state or
+ * statistics: the line contents when resident, else memory.  *stale
+ * tells whether those differ from memory.
+ */
+uint32_t icache_peek(uint32_t address, int *stale)
+{
+        unsigned word = (address >> 2) & ((1 << (yari->icache.line_log2 - 2)) - 1);
+        uint32_t w = load(address, 4, 1);
+        int way = cache_lookup(&yari->icache, address);
+        uint32_t ic_data = way < 0 ? w : cache_line(&yari->icache, address, way)[word];
+
+        *stale = ic_data != w;
+
+        return ic_data;
+}
+
+/*
+ * Account for fetching n consecutive instructions starting at
+ * address.  Only the first fetch from each line goes through the I$
+ * model, the rest are hits by construction, but each word gets the
+ * stale check of icache_fetch().  Used by the translation cache which
+ * doesn't need the data.
+ */
+void icache_fetch_block(uint32_t address, unsigned n)
+{
+        const unsigned line_words = 1 << (yari->icache.line_log2 - 2);
+        const uint32_t *line;
+        unsigned i;
+
+        while (n) {
+                unsigned k = line_words - ((address >> 2) & (line_words - 1));
+
+                if (k > n)
+                        k = n;
+
+                line = icache_fetch_line(address);
+                yari->icache.hits += k - 1;
+                if (k > 1 && (enable_check_icache || icache_page_dirty(address))) {
+                        unsigned word = (address >> 2) & (line_words - 1);
+                        const uint32_t *mem = addr2phys(address);
+
+                        for (i = 1; i < k; ++i)
+                                if (line[word + i] != (yari->endian_is_big ?
+                                                       ntohl(mem[i]) : mem[i]))
+                                        icache_check(address + 4 * i, line[word + i]);
+                }
+                if (enable_cache_sweep)
+                        for (i = 1; i < k; ++i)
+                                cache_sweep_access(&yari->icache_sweep, address + 4 * i);
+                address += 4 * k;
+                n -= k;
+        }
+}
+
+void synci(unsigned address)
+{
+        cache_invalidate(&yari->icache, address);
+}
 
-static int rdhwr(unsigned r)
+int rdhwr(unsigned r)
 {
         switch (r) {
         case 0: // No of processors
                 return 1;
         case 1: // I$ line size
-                return 4 << IC_WORD_INDEX_BITS;
+                return 1 << yari->icache.line_log2;
         case 2: // Free running counter
         {
                 struct timeval t;
                 gettimeofday(&t, NULL);
 
-                TSC = (t.tv_sec + t.tv_usec * 1e-6) * 50e6;
+                yari->TSC = (t.tv_sec + t.tv_usec * 1e-6) * 50e6;
 
                 /*
                 printf("t.tv_sec = %llu, t.tv_usec = %llu, TSC=%llu sec = %llu\n",
@@ -329,7 +345,7 @@ static int rdhwr(unsigned r)
                        TSC, TSC / 50000000);
                 */
 
-                return TSC >> 4;
+                return yari->TSC >> 4;
         }
         case 3: // cycles pr above count
                 return 1 << 4;
@@ -338,6 +354,370 @@ static int rdhwr(unsigned r)
         }
 }
 
+/*
+ * Cycle approximate timing model of the YARI pipeline, enabled with
+ * --timing.  Every instruction issues in one cycle unless it hits one
+ * of the stall causes the RTL has perf counters for, in which case
+ * the pipeline is restarted from the stage detecting it (DE for
+ * load-use hazards and delay slot bubbles, EX for taken branches and
+ * a busy mult/div unit, ME for memory and IO).  Restarts waiting on a
+ * busy resource are repeated until it's free, just like the RTL does.
+ * The penalties are estimates from the RTL, not measurements.
+ */
+
+#define RESTART_D       3       // Refill of IF1, IF2 and IF
+#define RESTART_X       4
+#define RESTART_M       5
+#define MEMORY_LATENCY  8       // Until the first word of a line fill
+#define STORE_BUFFER    7       // Usable entries of the 8 entry store buffer
+#define STORE_DRAIN     4       // Cycles to write one buffered store
+#define IO_LATENCY      4       // Peripheral transaction
+
+struct timing {
+        uint64_t cycles;
+        uint64_t perf[PERF_COUNTERS];
+        uint64_t stall[PERF_COUNTERS];
+        uint64_t icache_misses, dcache_misses;
+        uint64_t hilo_ready;            // Mult/div unit done
+        int      hilo_perf;             // PERF_MULT_HAZARD or PERF_DIV_HAZARD
+        uint64_t io_ready;              // Peripherals done
+        uint64_t sb_done[STORE_BUFFER]; // Store buffer drain cycles, ring
+        unsigned sb_head, sb_count;
+        unsigned load_dest;             // Of a load in the previous instruction
+        uint32_t store_word;            // Of a store in the previous instruction
+};
+
+static struct timing *timing_new(void)
+{
+        struct timing *tm = calloc(1, sizeof *tm);
+
+        if (!tm)
+                fatal("Out of memory for the timing model\n");
+        tm->store_word = ~0U;
+
+        return tm;
+}
+
+static void timing_event(int perf, unsigned cycles)
+{
+        struct timing *tm = yari->timing;
+
+        ++tm->perf[perf];
+        tm->stall[perf] += cycles;
+        tm->cycles += cycles;
+}
+
+static void timing_wait(uint64_t ready, unsigned restart, int perf)
+{
+        struct timing *tm = yari->timing;
+
+        while (tm->cycles < ready)
+                timing_event(perf, restart + 1);
+}
+
+/*
+ * Account for the instruction i just executed and return the number
+ * of stall cycles it suffered.
+ */
+static unsigned timing_commit(uint32_t pc, inst_t i, uint32_t address, uint32_t s,
+                              uint32_t t, int is_delay_slot, int taken)
+{
+        struct timing *tm = yari->timing;
+        uint64_t start = tm->cycles;
+        unsigned opcode = i.j.opcode;
+        int is_io = (address >> 24) == 0xFF;
+        unsigned load_dest = tm->load_dest;
+        uint32_t store_word = tm->store_word;
+
+        tm->load_dest = 0;
+        tm->store_word = ~0U;
+
+        while (tm->icache_misses < yari->icache.misses) {
+                ++tm->icache_misses;
+                timing_event(PERF_ICACHE_MISSES,
+                             MEMORY_LATENCY + (1 << (yari->icache.line_log2 - 2)));
+
+                /* The delay slot wasn't there in time, the branch restarts */
+                if (is_delay_slot)
+                        timing_event(PERF_DELAY_SLOT_BUBBLE, RESTART_D);
+        }
+
+        /* Same test as the RTL; stores forward rt late */
+        if (load_dest && (i.r.rs == load_dest ||
+                          (i.r.rt == load_dest && (opcode >> 4) != 2))) {
+                timing_event(PERF_LOAD_USE_HAZARD, RESTART_D);
+                if (yari->profile)
+                        profile_stall(pc, RESTART_D);
+        }
+
+        if (opcode == SPECIAL)
+                switch (i.r.funct) {
+                case MFHI:
+                case MFLO:
+                case MTHI:
+                case MTLO:
+                        timing_wait(tm->hilo_ready, RESTART_X, tm->hilo_perf);
+                        break;
+
+                case MULT:
+                case MULTU: {
+                        /* Radix-2, one cycle per significant multiplier bit */
+                        int neg = i.r.funct == MULT && (int) (s ^ t) < 0;
+                        uint32_t b = i.r.funct == MULT && (int) t < 0 ? -t : t;
+
+                        timing_wait(tm->hilo_ready, RESTART_X, tm->hilo_perf);
+                        tm->hilo_ready = tm->cycles + MULT_LATENCY + neg +
+                                (b ? 32 - __builtin_clz(b) : 0);
+                        tm->hilo_perf = PERF_MULT_HAZARD;
+                        break;
+                }
+
+                case DIV:
+                case DIVU:
+                        timing_wait(tm->hilo_ready, RESTART_X, tm->hilo_perf);
+                        tm->hilo_ready = tm->cycles + DIV_LATENCY;
+                        tm->hilo_perf = PERF_DIV_HAZARD;
+                        break;
+
+                default:
+                        break;
+                }
+
+        if (taken)
+                timing_event(PERF_BRANCH_HAZARD, RESTART_X);
+
+        if ((opcode >> 3) == 4) {
+                if (is_io) {
+                        /* The load keeps restarting until the data is back */
+                        uint64_t ready = tm->cycles + IO_LATENCY;
+
+                        if (ready < tm->io_ready)
+                                ready = tm->io_ready;
+                        timing_wait(ready, RESTART_M, PERF_IO_LOAD_BUSY);
+                        tm->io_ready = tm->cycles;
+                } else {
+                        if (address >> 2 == store_word)
+                                timing_event(PERF_LOAD_HIT_STORE_HAZARD, RESTART_M);
+
+                        while (tm->dcache_misses < yari->dcache.misses) {
+                                ++tm->dcache_misses;
+                                timing_event(PERF_DCACHE_MISSES, RESTART_M +
+                                             MEMORY_LATENCY + (1 << (yari->dcache.line_log2 - 2)));
+                        }
+                }
+
+                tm->load_dest = i.r.rt;
+        } else if ((opcode >> 3) == 5) {
+                if (is_io) {
+                        timing_wait(tm->io_ready, RESTART_M, PERF_IO_STORE_BUSY);
+                        tm->io_ready = tm->cycles + IO_LATENCY;
+                } else {
+                        uint64_t done;
+
+                        while (tm->sb_count &&
+                               tm->sb_done[tm->sb_head] <= tm->cycles) {
+                                tm->sb_head = (tm->sb_head + 1) % STORE_BUFFER;
+                                --tm->sb_count;
+                        }
+
+                        if (tm->sb_count == STORE_BUFFER) {
+                                timing_wait(tm->sb_done[tm->sb_head],
+                                            RESTART_M, PERF_SB_FULL);
+                                tm->sb_head = (tm->sb_head + 1) % STORE_BUFFER;
+                                --tm->sb_count;
+                        }
+
+                        done = tm->cycles;
+                        if (tm->sb_count) {
+                                unsigned last = (tm->sb_head + tm->sb_count - 1) % STORE_BUFFER;
+                                if (done < tm->sb_done[last])
+                                        done = tm->sb_done[last];
+                        }
+                        tm->sb_done[(tm->sb_head + tm->sb_count++) % STORE_BUFFER] =
+                                done + STORE_DRAIN;
+                        tm->store_word = address >> 2;
+                }
+        }
+
+        ++tm->cycles;
+
+        return tm->cycles - start - 1;
+}
+
+void timing_print(void)
+{
+        static const int cause[] = {
+                PERF_ICACHE_MISSES, PERF_DELAY_SLOT_BUBBLE, PERF_LOAD_USE_HAZARD,
+                PERF_BRANCH_HAZARD, PERF_MULT_HAZARD, PERF_DIV_HAZARD,
+                PERF_DCACHE_MISSES, PERF_LOAD_HIT_STORE_HAZARD, PERF_SB_FULL,
+                PERF_IO_LOAD_BUSY, PERF_IO_STORE_BUSY,
+        };
+        struct timing *tm = yari->timing;
+        unsigned k;
+
+        if (!tm)
+                return;
+
+        printf("Timing model: %llu cycles, CPI %4.2f\n",
+               (long long unsigned) tm->cycles,
+               yari->n_issue ? (double) tm->cycles / yari->n_issue : 0.0);
+
+        for (k = 0; k < sizeof cause / sizeof cause[0]; ++k)
+                printf("  %-22s %12llu events %12llu cycles (CPI %4.2f)\n",
+                       __perf_counter_names[cause[k]],
+                       (long long unsigned) tm->perf[cause[k]],
+                       (long long unsigned) tm->stall[cause[k]],
+                       yari->n_issue ? (double) tm->stall[cause[k]] / yari->n_issue : 0.0);
+}
+
+uint64_t timing_cycles(void)
+{
+        return yari->timing ? yari->timing->cycles : 0;
+}
+
+/* Cycles skipped while idle, see idle.c */
+void timing_idle(uint64_t cycles)
+{
+        if (yari->timing)
+                yari->timing->cycles += cycles;
+}
+
+/*
+ * Pick up the timing model after the machine has been run without
+ * it (see sample.c): the cache misses since then weren't ours and
+ * the pipeline has long drained.
+ */
+void timing_skip(void)
+{
+        struct timing *tm;
+
+        if (!yari->timing)
+                yari->timing = timing_new();
+
+        tm = yari->timing;
+        tm->icache_misses = yari->icache.misses;
+        tm->dcache_misses = yari->dcache.misses;
+        tm->hilo_ready    = tm->io_ready = tm->cycles;
+        tm->sb_count      = 0;
+        tm->load_dest     = 0;
+        tm->store_word    = ~0U;
+}
+
+uint32_t perf_counter(unsigned r)
+{
+        switch (r) {
+        case PERF_RETIRED_INST:
+                return yari->TSC >> 4;
+
+        case PERF_FREQUENCY:
+                return 75000;
+
+        case PERF_ICACHE_MISSES:
+                return yari->icache.misses;
+
+        case PERF_DCACHE_MISSES:
+                return yari->dcache.misses;
+
+        default:
+                /* The stall counts only exist in the timing model */
+                return yari->timing && r < PERF_COUNTERS ? yari->timing->perf[r] : 0;
+        }
+}
+
+/*
+ * Move to CP0 register reg, shared by the execution engines.
+ */
+void mtc0(MIPS_state_t *state, unsigned reg, uint32_t v)
+{
+        state->cp0r[reg] = v;
+        switch (reg) {
+        case CP0_INDEX:         //  0
+                /* Five low-order bits to index an entry in the TLB. */
+                break;
+        case CP0_RANDOM:        //  1
+                /*
+                 * Read-only! Index into the TBL incremented for
+                 * every instruction executed.
+                 */
+                break;
+        case CP0_ENTRYLO0:      //  2
+        case CP0_ENTRYLO1:      //  3
+                /*
+                 * TBL Entry:
+                 * 0:4 PFN:22 C:3 D:1 V:1 G:1
+                 */
+                break;
+        case CP0_CONTEXT:       //  4
+                /*
+                 * Pointer to an entry in the page table entry array
+                 * PTEBase:7 BadVPN2:21 0:4
+                 */
+                break;
+        case CP0_PAGEMASK:      //  5
+                break;
+        case CP0_WIRED:         //  6
+                /* Lower boundry of random TBL entry */
+                break;
+                //case CP0_INFO:        //  7
+                //case CP0_BADVADDR:    //  8
+                //case CP0_COUNT:       //  9
+        case CP0_ENTRYHI:       // 10
+                /*
+                 * Holds the high-order bits of a TBL entry.
+                 * VPN2:21 0:3 ASID:8
+                 */
+                break;
+                //case CP0_COMPARE:     // 11
+
+        case CP0_STATUS:
+                state->cp0_status.raw = v;
+                state->cp0_status.res1 = state->cp0_status.res2 = 0;
+                printf("Operating mode %s\n",
+                       state->cp0_status.ksu == 0 ? "kernel" :
+                       state->cp0_status.ksu == 1 ? "supervisor" :
+                       state->cp0_status.ksu == 2 ? "user" : "??");
+                printf("Exception level %d\n", state->cp0_status.exl);
+                printf("Error level %d\n", state->cp0_status.erl);
+                printf("Interrupts %sabled\n",
+                       state->cp0_status.ie ? "en" : "dis");
+                break;
+
+                //case CP0_CAUSE:
+        case CP0_EPC:
+        case CP0_ERROREPC:
+                break;
+
+        default:
+                fprintf(stderr, "Setting an unknown CP0 register %d\n", reg);
+                // assert(0);
+        }
+}
+
+void reset_mips_state(MIPS_state_t *state)
+{
+        state->epc = 0xDEADBEEF;
+        memset(state->r,    0, sizeof state->r);
+        memset(state->cp0r, 0, sizeof state->cp0r);
+        state->lo = state->hi = 0;
+
+        // Status after reset
+        state->cp0_status.ds_ts = 0;
+        state->cp0_status.ds_sr = 0;
+        state->cp0_status.erl   = 1;
+        state->cp0_status.ds_bev= 1;
+}
+
+/* Remember load and shift destinations for the hazard statistics */
+#if HAZARD_STATS
+#define NOTE_LOAD(r)   (last_load_dest = (r))
+#define NOTE_LOAD32(r) (last_load_dest = last_load32_dest = (r))
+#define NOTE_SHIFT(r)  (last_shift_dest = (r))
+#else
+#define NOTE_LOAD(r)   ((void) 0)
+#define NOTE_LOAD32(r) ((void) 0)
+#define NOTE_SHIFT(r)  ((void) 0)
+#endif
+
 void run_simple(MIPS_state_t *state)
 {
         uint32_t oldreg[32];
@@ -350,32 +730,35 @@ void run_simple(MIPS_state_t *state)
         int branch_delay_slot = 0;
         int annul_delay_slot = 0;
 
+#if HAZARD_STATS
         int last_shift_dest = 0;
         int last_load_dest = 0;
         int last_load32_dest = 0;
+#endif
 
-        atexit(print_coverage);
+        if (enable_timing && !yari->timing)
+                yari->timing = timing_new();
 
-        state->epc = 0xDEADBEEF;
-        memset(state->r,    0, sizeof state->r);
         memset(oldreg,  0, sizeof oldreg);
-        memset(state->cp0r, 0, sizeof state->cp0r);
-        state->lo = state->hi = 0;
-
-        // Status after reset
-        state->cp0_status.ds_ts = 0;
-        state->cp0_status.ds_sr = 0;
-        state->cp0_status.erl   = 1;
-        state->cp0_status.ds_bev= 1;
 
         for (;;) {
                 int j;
                 inst_t i;
                 uint32_t w, sh;
 
-                ++TSC; // Just an optimistic approximation
+                /* Stop when asked to, but not in the middle of a branch */
+                if ((yari->n_issue >= yari->stop_issue || state->pc == yari->stop_pc) &&
+                    !branch_delay_slot_next && !annul_delay_slot)
+                        break;
+
+                /* For the divergence replay, see cosim.c */
+                if (enable_cosimulation && yari->n_issue >= cosim_next_checkpoint)
+                        cosim_checkpoint();
+
+                ++yari->TSC; // Just an optimistic approximation
 
                 pc_prev = state->pc;
+                yari->watch_pc = pc_prev;
                 if (!branch_delay_slot)
                         state->epc = state->pc;
 
@@ -390,10 +773,11 @@ void run_simple(MIPS_state_t *state)
                 state->pc = pc_next;
                 pc_next += sizeof(inst_t);
 
+#if HAZARD_STATS
                 if (i.raw == 0) {
-                        stat_nop++;
+                        yari->stat_nop++;
                         if (branch_delay_slot_next)
-                                stat_nop_delay_slots++;
+                                yari->stat_nop_delay_slots++;
                         if (last_load_dest) {
                                 // lw <last_load_dest, ...
                                 // nop
@@ -401,7 +785,7 @@ void run_simple(MIPS_state_t *state)
                                 inst_t next = { .raw = load(state->pc, 4, 1) };
                                 // XXX This is quite approximative
                                 if (last_load32_dest != next.r.rs && last_load32_dest != next.r.rt)
-                                        stat_nop_useless++;
+                                        yari->stat_nop_useless++;
                         }
                 }
                 if (wbr == i.r.rs)
@@ -413,20 +797,20 @@ void run_simple(MIPS_state_t *state)
                         case LW:
                         case LWL:
                         case LWR:
-                                 stat_gen_load_hazard++; break;
+                                 yari->stat_gen_load_hazard++; break;
                         default: break;
                         }
 
                 // XXX This is quite approximative
                 if (last_load_dest && last_load_dest == i.r.rs)
-                        stat_load_use_hazard_rs++;
+                        yari->stat_load_use_hazard_rs++;
 
                 if (last_load_dest && last_load_dest == i.r.rt)
-                        stat_load_use_hazard_rt++;
+                        yari->stat_load_use_hazard_rt++;
 
                 if (0 && last_load32_dest && (last_load32_dest == i.r.rs ||
                                          last_load32_dest == i.r.rt)) {
-                        stat_load32_use_hazard++;
+                        yari->stat_load32_use_hazard++;
                         printf("lw-use?  ");
                         inst_t pi = {.raw = load(pc_prev-4, 4, 1) };
                         disass(pc_prev-4,pi);
@@ -436,9 +820,10 @@ void run_simple(MIPS_state_t *state)
 
                 if (last_shift_dest && (last_shift_dest == i.r.rs ||
                                         last_shift_dest == i.r.rt))
-                        stat_shift_use_hazard++;
+                        yari->stat_shift_use_hazard++;
 
                 last_load_dest = last_load32_dest = last_shift_dest = 0;
+#endif
 
 
                 if (enable_disass & !enable_regwrites)
@@ -454,9 +839,7 @@ void run_simple(MIPS_state_t *state)
                 s = state->r[i.r.rs];
                 t = state->r[i.r.rt];
 
-                unsigned reg_use = reg_use_map[i.j.opcode == SPECIAL?  64 + i.r.funct :
-                                               i.j.opcode == REGIMM ? 128 + i.r.rt :
-                                               /*                  */ i.j.opcode];
+                unsigned reg_use = reg_use_map[INST_INDEX(i)];
                 if (!(reg_use & USE_RS))
                         s = 0xDEAD1111;
                 if (!(reg_use & (USE_RT | USE_RT_LATE)))
@@ -467,9 +850,7 @@ void run_simple(MIPS_state_t *state)
                 unsigned address = s + i.i.imm;
 
 
-                ++coverage[i.j.opcode == SPECIAL?  64 + i.r.funct :
-                           i.j.opcode == REGIMM ? 128 + i.r.rt :
-                           /*                  */ i.j.opcode];
+                ++yari->coverage[INST_INDEX(i)];
 
                 // Grab the old store value for comparison, but avoid IO
                 st_old = 0; // IO accesses defaults to this
@@ -488,23 +869,23 @@ void run_simple(MIPS_state_t *state)
                 case SPECIAL: // all R-type, thus rd is target register
                         wbr = i.r.rd;
                         switch (i.r.funct) {
-                        case SLL:  last_shift_dest = wbr; wbv = t << i.r.sa; break;
-                        case SRL:  last_shift_dest = wbr; wbv = t >> i.r.sa; break;
-                        case SRA:  last_shift_dest = wbr; wbv = (int)t >> i.r.sa; break;
-                        case SLLV: last_shift_dest = wbr; wbv = t << (s & 31); break;
-                        case SRLV: last_shift_dest = wbr; wbv = t >> (s & 31); break;
-                        case SRAV: last_shift_dest = wbr; wbv = (int)t >> (s & 31); break;
+                        case SLL:  NOTE_SHIFT(wbr); wbv = t << i.r.sa; break;
+                        case SRL:  NOTE_SHIFT(wbr); wbv = t >> i.r.sa; break;
+                        case SRA:  NOTE_SHIFT(wbr); wbv = (int)t >> i.r.sa; break;
+                        case SLLV: NOTE_SHIFT(wbr); wbv = t << (s & 31); break;
+                        case SRLV: NOTE_SHIFT(wbr); wbv = t >> (s & 31); break;
+                        case SRAV: NOTE_SHIFT(wbr); wbv = (int)t >> (s & 31); break;
 
                         case JALR: wbv = pc_next;
+                                   if (yari->profile)
+                                           profile_call(pc_prev, s);
                         case JR:   pc_next = s;
                                    branch_delay_slot_next = 1;
                                    break;
 
                         case SYSCALL:
-                                // XXX FATAL!
-                                fatal("%08x:syscall(%d) not handled\n",
-                                       pc_prev, state->r[2]);
-                                exit(0);
+                                wbr = 0;
+                                hostcall(state);
                                 break;
 
                         case MFHI: wbv = state->hi; break;
@@ -543,26 +924,24 @@ void run_simple(MIPS_state_t *state)
                                         state->lo = 0;
                                 }
                                 break;
-                        case SUB:
-                                t = -(int)t;
-                                /* Fall-though */
-
                         case ADD:
-                                wbv = s + t;
+                        case SUB:
+                                wbv = i.r.funct == ADD ? s + t : s - t;
 
                                 /*
                                  * Check for overflow, that is, if the
                                  * sign of the truncated result is
                                  * different from sign of the true
-                                 * addition. One cheap way to test it:
+                                 * addition.  For ADD:
                                  * s.sign t.sign r.sign
                                  * 1      0      X      -> ok
                                  * 0      1      X      -> ok
                                  * 0      0      1      -> overflow
                                  * 1      1      0      -> overflow
-                                 * IOW: ss ^ ts | ss ^ rs
+                                 * SUB likewise, with t negated.
                                  */
-                                if (((s^t)|(s^wbr)) >> 31) {
+                                if (i.r.funct == ADD ? ADD_OVERFLOWS(s, t, wbv)
+                                                     : SUB_OVERFLOWS(s, t, wbv)) {
                                         state->cp0_cause.exc_code = EXC_OV;
                                         state->cp0_cause.ce = 0;
                                         state->cp0_cause.bd = branch_delay_slot;
@@ -630,10 +1009,12 @@ void run_simple(MIPS_state_t *state)
                         break;
 
                 case JAL:
-                        ++n_call;
+                        ++yari->n_call;
                         wbr = 31; wbv = pc_next;
                         pc_next = (state->pc & ~((1<<28)-1)) | (i.j.offset << 2);
                         branch_delay_slot_next = 1;
+                        if (yari->profile)
+                                profile_call(pc_prev, pc_next);
                         break;
                 case J: wbr = 0;
                         pc_next = (state->pc & ~((1<<28)-1)) | (i.j.offset << 2);
@@ -648,7 +1029,7 @@ void run_simple(MIPS_state_t *state)
 
                         /* Special hack. Terminate on endless loops */
                         if (i.raw == 0x1000FFFF && icache_fetch(state->pc + 4) == 0)
-                                exit(0);
+                                sim_exit(0);
                         break;
                 case BNE:
                         wbr = 0;
@@ -695,6 +1076,11 @@ void run_simple(MIPS_state_t *state)
                                         }
                                         break;
                                 }
+                                if ((c0_map_t) i.r.funct == C0_WAIT) {
+                                        wbr = 0;
+                                        idle_wait();
+                                        break;
+                                }
                                 /* C1 format */
                                 fprintf(stderr,
                                         "Unhandled CP0 command %s\n",
@@ -710,78 +1096,7 @@ void run_simple(MIPS_state_t *state)
                                 assert(i.r.funct == 0);
                                 if (i.r.rs & 4) {
                                         wbr = 0;
-                                        state->cp0r[i.r.rd] = t;
-                                        switch (i.r.rd) {
-                                        case CP0_INDEX:         //  0
-                                                /*
-                                                 * Five low-order bits
-                                                 * to index an entry
-                                                 * in the TLB.
-                                                 */
-                                                break;
-                                        case CP0_RANDOM:        //  1
-                                                /*
-                                                 * Read-only! Index
-                                                 * into the TBL
-                                                 * incremented for
-                                                 * every instruction
-                                                 * executed.
-                                                 */
-                                                break;
-                                        case CP0_ENTRYLO0:      //  2
-                                        case CP0_ENTRYLO1:      //  3
-                                                /*
-                                                 * TBL Entry:
-                                                 * 0:4 PFN:22 C:3 D:1 V:1 G:1
-                                                 */
-                                                break;
-                                        case CP0_CONTEXT:       //  4
-                                                /*
-                                                 * Pointer to an entry
-                                                 * in the page table
-                                                 * entry array
-                                                 * PTEBase:7 BadVPN2:21 0:4
-                                                 */
-                                                break;
-                                        case CP0_PAGEMASK:      //  5
-                                                break;
-                                        case CP0_WIRED:         //  6
-                                                /* Lower boundry of random TBL entry */
-                                                break;
-                                                //case CP0_INFO:                //  7
-                                                //case CP0_BADVADDR:    //  8
-                                                //case CP0_COUNT:               //  9
-                                        case CP0_ENTRYHI:       // 10
-                                                /*
-                                                 * Holds the high-order bits of a TBL entry.
-                                                 * VPN2:21 0:3 ASID:8
-                                                 */
-                                                break;
-                                                //case CP0_COMPARE:     // 11
-                                                //case CP0_STATUS:      // 12
-
-                                        case CP0_STATUS:
-                                                state->cp0_status.raw = t;
-                                                state->cp0_status.res1 = state->cp0_status.res2 = 0;
-                                                printf("Operating mode %s\n",
-                                                       state->cp0_status.ksu == 0 ? "kernel" :
-                                                       state->cp0_status.ksu == 1 ? "supervisor" :
-                                                       state->cp0_status.ksu == 2 ? "user" : "??");
-                                                printf("Exception level %d\n", state->cp0_status.exl);
-                                                printf("Error level %d\n", state->cp0_status.erl);
-                                                printf("Interrupts %sabled\n",
-                                                       state->cp0_status.ie ? "en" : "dis");
-                                                break;
-
-                                                //case CP0_CAUSE:
-                                        case CP0_EPC:
-                                        case CP0_ERROREPC:
-                                                break;
-
-                                        default:
-                                                fprintf(stderr, "Setting an unknown CP0 register %d\n", i.r.rd);
-                                                // assert(0);
-                                        }
+                                        mtc0(state, i.r.rd, t);
                                 } else {
                                         wbv = state->cp0r[i.r.rd];
                                 }
@@ -791,11 +1106,11 @@ void run_simple(MIPS_state_t *state)
                         if (i.raw == 0x48000000) { // A hack
                                 if (state->lo == 0x87654321) {
                                         printf("TEST SUCCESS!\n");
-                                        exit(0);
+                                        sim_exit(0);
                                 } else {
                                         printf("TEST FAILED WITH $2 = 0x%08x\n",
                                                state->lo);
-                                        exit(1);
+                                        sim_exit(1);
                                 }
                         }
 
@@ -804,18 +1119,7 @@ void run_simple(MIPS_state_t *state)
                         if (~i.r.rs & 0x10)
                                 if (~i.r.rs & 4) {
                                         // printf("MFC2 here!\n");
-                                        switch (i.r.rd) {
-                                        case PERF_RETIRED_INST:
-                                                wbv = TSC >> 4;
-                                                break;
-
-                                        case PERF_FREQUENCY:
-                                                wbv = 75000;
-                                                break;
-                                        default:
-                                                wbv = 0;
-                                                break;
-                                        }
+                                        wbv = perf_counter(i.r.rd);
                                 }
                         break;
                 }
@@ -827,13 +1131,13 @@ void run_simple(MIPS_state_t *state)
                         }
                         goto unhandled;
 
-                case LB:   last_load_dest = wbr; wbv = EXT8(LD8(address)); break;
-                case LH:   last_load_dest = wbr; wbv = EXT16(LD16(address)); break;
-                case LBU:  last_load_dest = wbr; wbv = LD8(address); break;
-                case LHU:  last_load_dest = wbr; wbv = LD16(address); break;
-                case LW:   last_load_dest = last_load32_dest = wbr; wbv = LD32(address); break;
+                case LB:   NOTE_LOAD(wbr); wbv = EXT8(LD8(address)); break;
+                case LH:   NOTE_LOAD(wbr); wbv = EXT16(LD16(address)); break;
+                case LBU:  NOTE_LOAD(wbr); wbv = LD8(address); break;
+                case LHU:  NOTE_LOAD(wbr); wbv = LD16(address); break;
+                case LW:   NOTE_LOAD32(wbr); wbv = LD32(address); break;
                 case LWL:
-                        last_load_dest = wbr;
+                        NOTE_LOAD(wbr);
                         w = LD32(address & ~3);
                         sh = (address & 3) * 8;
                         wbv = (w << sh) | (~(~0 << sh) & t); // gcc -Wall stupidity
@@ -841,7 +1145,7 @@ void run_simple(MIPS_state_t *state)
                         break;
 
                 case LWR:
-                        last_load_dest = wbr;
+                        NOTE_LOAD(wbr);
                         w = LD32(address & ~3);
                         sh = 24 - (address & 3) * 8;
                         wbv = (w >> sh) | (~(~0U >> sh) & t); // gcc -Wall stupidity
@@ -897,10 +1201,18 @@ void run_simple(MIPS_state_t *state)
                 }
 
                 // Statistics
-                ++n_issue;
+                ++yari->n_issue;
+                if (yari->profile)
+                        profile_block(pc_prev, 1, 1);
+
+                if (enable_timing)
+                        yari->TSC += timing_commit(pc_prev, i, address, s, t,
+                                                   branch_delay_slot,
+                                                   branch_delay_slot_next &&
+                                                   pc_next != state->pc + 4);
 
-                if (0 && (n_issue & 0xFFF) == 0)
-                        fprintf(stderr, "\rCycle %llu", n_issue);
+                if (0 && (yari->n_issue & 0xFFF) == 0)
+                        fprintf(stderr, "\rCycle %llu", yari->n_issue);
 
                 unsigned rtl_pc = 0, rtl_wbr = 0, rtl_wbv = 0;
                 int r = 0;
@@ -918,6 +1230,11 @@ void run_simple(MIPS_state_t *state)
                         state->r[wbr] = wbv;
                 }
 
+                if (yari->trace)
+                        trace_commit(pc_prev, i.raw, wbr, wbv,
+                                     (i.j.opcode >> 3) == 4 || (i.j.opcode >> 3) == 5,
+                                     address);
+
                 if (enable_disass_user && (pc_prev & 0xF0000000) == 0x40000000)
                         enable_disass = 1;
 
@@ -954,12 +1271,13 @@ void run_simple(MIPS_state_t *state)
                         printf("\n");
                 }
 
-                if (segfault) {
+                if (yari->segfault) {
                         printf("Access violation, execution aborted\n");
                         break;
                 }
 
                 if (r == 1) {
+                        cosim_replay();
                         printf("Divergence detected\n");
 
                         printf("%08x %08x ", pc_prev, i.raw);
@@ -969,18 +1287,12 @@ void run_simple(MIPS_state_t *state)
                         printf("RTL %08x: r%d <- %08x\n", rtl_pc, rtl_wbr, rtl_wbv);
 
                         printf("RTL output leading up to this:\n");
+                        cosim_print_history();
 
-                        unsigned i;
-                        for (i = 0; i < KEEP_LINES; ++i) {
-                                unsigned k = (i + last_p) % KEEP_LINES;
-                                if (last[k])
-                                        printf("%s", last[k]);
-                        }
-
-                        exit(1);
+                        sim_exit(1);
                 } else if (r == 2) {
                         printf("RTL trace ended at this point\n");
-                        exit(0);
+                        sim_exit(0);
                 }
 
         }
@@ -988,6 +1300,532 @@ void run_simple(MIPS_state_t *state)
 
 }
 
+/*
+ * Threaded interpreter.
+ *
+ * This implements the same machine as run_simple(), minus tracing,
+ * register dumps and co-simulation, but rather than going through the
+ * two-level switch, every instruction ends by fetching the next one
+ * and jumping straight to its handler through a table of label
+ * addresses (GCC's labels-as-values), indexed with INST_INDEX().
+ * Each handler thus gets its own indirect jump, which the host branch
+ * predictor copes with much better than the single one of a switch.
+ *
+ * The hazard statistics are only gathered when built with
+ * HAZARD_STATS.
+ */
+
+#if HAZARD_STATS
+#define NOTE_HAZARDS()                                                  \
+        do {                                                            \
+                if (i.raw == 0) {                                       \
+                        yari->stat_nop++;                                     \
+                        if (branch_delay_slot_next)                     \
+                                yari->stat_nop_delay_slots++;                 \
+                        if (last_load_dest) {                           \
+                                inst_t next = { .raw = load(state->pc, 4, 1) }; \
+                                if (last_load32_dest != next.r.rs &&    \
+                                    last_load32_dest != next.r.rt)      \
+                                        yari->stat_nop_useless++;             \
+                        }                                               \
+                }                                                       \
+                if (wbr == i.r.rs && LB <= i.j.opcode && i.j.opcode <= LWR) \
+                        yari->stat_gen_load_hazard++;                         \
+                if (last_load_dest && last_load_dest == i.r.rs)         \
+                        yari->stat_load_use_hazard_rs++;                      \
+                if (last_load_dest && last_load_dest == i.r.rt)         \
+                        yari->stat_load_use_hazard_rt++;                      \
+                if (last_shift_dest && (last_shift_dest == i.r.rs ||    \
+                                        last_shift_dest == i.r.rt))     \
+                        yari->stat_shift_use_hazard++;                        \
+                last_load_dest = last_load32_dest = last_shift_dest = 0; \
+        } while (0)
+#else
+#define NOTE_HAZARDS() do { } while (0)
+#endif
+
+/*
+ * Fetch and decode the next instruction and jump to its handler.
+ */
+#define FETCH_AND_DISPATCH()                                            \
+        do {                                                            \
+                ++yari->TSC;                                                  \
+                pc_prev = state->pc;                                    \
+                yari->watch_pc = pc_prev;                               \
+                if (!branch_delay_slot)                                 \
+                        state->epc = state->pc;                         \
+                i.raw = annul_delay_slot ? 0 : icache_fetch(state->pc); \
+                state->pc = pc_next;                                    \
+                pc_next += sizeof(inst_t);                              \
+                NOTE_HAZARDS();                                         \
+                branch_delay_slot = branch_delay_slot_next;             \
+                branch_delay_slot_next = 0;                             \
+                annul_delay_slot = 0;                                   \
+                                                                        \
+                s = state->r[i.r.rs];                                   \
+                t = state->r[i.r.rt];                                   \
+                wbr = i.r.rt;                                           \
+                address = s + i.i.imm;                                  \
+                k = INST_INDEX(i);                                      \
+                ++yari->coverage[k];                                          \
+                goto *handlers[k];                                      \
+        } while (0)
+
+/*
+ * Retire the current instruction and move on to the next.
+ * Instructions that don't write a register set wbr = 0.
+ */
+#define RETIRE()                                                        \
+        do {                                                            \
+                state->r[wbr] = wbv;                                    \
+                state->r[0] = 0;                                        \
+                ++yari->n_issue;                                              \
+        } while (0)
+
+#define DISPATCH()                                                      \
+        do {                                                            \
+                RETIRE();                                               \
+                FETCH_AND_DISPATCH();                                   \
+        } while (0)
+
+/* Loads and stores may fault */
+#define DISPATCH_MEM()                                                  \
+        do {                                                            \
+                if (yari->segfault)                                           \
+                        goto access_violation;                          \
+                DISPATCH();                                             \
+        } while (0)
+
+#define BRANCH_IF(cond)                                                 \
+        do {                                                            \
+                wbr = 0;                                                \
+                if (cond)                                               \
+                        pc_next = state->pc + (i.i.imm << 2);           \
+                branch_delay_slot_next = 1;                             \
+                DISPATCH();                                             \
+        } while (0)
+
+#define LOADS_AND_STORES(E)                                             \
+op_lb_##E:                                                              \
+        NOTE_LOAD(wbr);                                                 \
+        wbv = EXT8(ld8_##E(address));                                   \
+        DISPATCH_MEM();                                                 \
+op_lh_##E:                                                              \
+        NOTE_LOAD(wbr);                                                 \
+        wbv = EXT16(ld16_##E(address));                                 \
+        DISPATCH_MEM();                                                 \
+op_lbu_##E:                                                             \
+        NOTE_LOAD(wbr);                                                 \
+        wbv = ld8_##E(address);                                         \
+        DISPATCH_MEM();                                                 \
+op_lhu_##E:                                                             \
+        NOTE_LOAD(wbr);                                                 \
+        wbv = ld16_##E(address);                                        \
+        DISPATCH_MEM();                                                 \
+op_lw_##E:                                                              \
+        NOTE_LOAD32(wbr);                                               \
+        wbv = ld32_##E(address);                                        \
+        DISPATCH_MEM();                                                 \
+op_lwl_##E:                                                             \
+        NOTE_LOAD(wbr);                                                 \
+        w = ld32_##E(address & ~3);                                     \
+        sh = (address & 3) * 8;                                         \
+        wbv = (w << sh) | (~(~0 << sh) & t);                            \
+        DISPATCH_MEM();                                                 \
+op_lwr_##E:                                                             \
+        NOTE_LOAD(wbr);                                                 \
+        w = ld32_##E(address & ~3);                                     \
+        sh = 24 - (address & 3) * 8;                                    \
+        wbv = (w >> sh) | (~(~0U >> sh) & t);                           \
+        DISPATCH_MEM();                                                 \
+op_sb_##E:                                                              \
+        wbr = 0;                                                        \
+        st8_##E(address, t);                                            \
+        DISPATCH_MEM();                                                 \
+op_sh_##E:                                                              \
+        wbr = 0;                                                        \
+        st16_##E(address, t);                                           \
+        DISPATCH_MEM();                                                 \
+op_sw_##E:                                                              \
+        wbr = 0;                                                        \
+        st32_##E(address, t);                                           \
+        DISPATCH_MEM();                                                 \
+op_swl_##E:                                                             \
+        wbr = 0;                                                        \
+        w = ld32_##E(address & ~3);                                     \
+        sh = (address & 3) * 8;                                         \
+        st32_##E(address & ~3, (t >> sh) | (~(~0U >> sh) & w));         \
+        DISPATCH_MEM();                                                 \
+op_swr_##E:                                                             \
+        wbr = 0;                                                        \
+        w = ld32_##E(address & ~3);                                     \
+        sh = 24 - (address & 3) * 8;                                    \
+        st32_##E(address & ~3, (t << sh) | (~(~0 << sh) & w));          \
+        DISPATCH_MEM();
+
+/* The endian is settled by now, pick the matching memory handlers */
+#define MEM(op) (yari->endian_is_big ? &&op##_be : &&op##_le)
+
+void run_threaded(MIPS_state_t *state)
+{
+        void *const handlers[64+64+32] = {
+                [0 ... 63]       = &&unhandled,
+                [64 ... 127]     = &&special_unhandled,
+                [128 ... 159]    = &&regimm_unhandled,
+
+                [J]              = &&op_j,
+                [JAL]            = &&op_jal,
+                [BEQ]            = &&op_beq,
+                [BNE]            = &&op_bne,
+                [BLEZ]           = &&op_blez,
+                [BGTZ]           = &&op_bgtz,
+                [ADDI]           = &&op_addi,
+                [ADDIU]          = &&op_addiu,
+                [SLTI]           = &&op_slti,
+                [SLTIU]          = &&op_sltiu,
+                [ANDI]           = &&op_andi,
+                [ORI]            = &&op_ori,
+                [XORI]           = &&op_xori,
+                [LUI]            = &&op_lui,
+                [CP0]            = &&op_cp0,
+                [CP1]            = &&op_cp1,
+                [CP2]            = &&op_cp2,
+                [RDHWR]          = &&op_rdhwr,
+                [LB]             = MEM(op_lb),
+                [LH]             = MEM(op_lh),
+                [LWL]            = MEM(op_lwl),
+                [LW]             = MEM(op_lw),
+                [LBU]            = MEM(op_lbu),
+                [LHU]            = MEM(op_lhu),
+                [LWR]            = MEM(op_lwr),
+                [SB]             = MEM(op_sb),
+                [SH]             = MEM(op_sh),
+                [SWL]            = MEM(op_swl),
+                [SW]             = MEM(op_sw),
+                [SWR]            = MEM(op_swr),
+                [LWC1]           = &&op_lwc1,
+
+                [64 + SLL]       = &&op_sll,
+                [64 + SRL]       = &&op_srl,
+                [64 + SRA]       = &&op_sra,
+                [64 + SLLV]      = &&op_sllv,
+                [64 + SRLV]      = &&op_srlv,
+                [64 + SRAV]      = &&op_srav,
+                [64 + JR]        = &&op_jr,
+                [64 + JALR]      = &&op_jalr,
+                [64 + SYSCALL]   = &&op_syscall,
+                [64 + BREAK]     = &&op_break,
+                [64 + MFHI]      = &&op_mfhi,
+                [64 + MTHI]      = &&op_mthi,
+                [64 + MFLO]      = &&op_mflo,
+                [64 + MTLO]      = &&op_mtlo,
+                [64 + MULT]      = &&op_mult,
+                [64 + MULTU]     = &&op_multu,
+                [64 + DIV]       = &&op_div,
+                [64 + DIVU]      = &&op_divu,
+                [64 + ADD]       = &&op_add,
+                [64 + ADDU]      = &&op_addu,
+                [64 + SUB]       = &&op_sub,
+                [64 + SUBU]      = &&op_subu,
+                [64 + AND]       = &&op_and,
+                [64 + OR]        = &&op_or,
+                [64 + XOR]       = &&op_xor,
+                [64 + NOR]       = &&op_nor,
+                [64 + SLT]       = &&op_slt,
+                [64 + SLTU]      = &&op_sltu,
+                [64 + TEQ]       = &&op_teq,
+
+                [128 + BLTZ]     = &&op_bltz,
+                [128 + BGEZ]     = &&op_bgez,
+                [128 + BLTZAL]   = &&op_bltzal,
+                [128 + BGEZAL]   = &&op_bgezal,
+                [128 + SYNCI]    = &&op_synci,
+        };
+
+        uint32_t pc_prev;
+        uint32_t pc_next = state->pc + 4;
+        uint32_t wbv = 0, s, t, address, w, sh;
+        int wbr = 0;
+        unsigned k;
+        inst_t i;
+
+        int branch_delay_slot_next = 0;
+        int branch_delay_slot = 0;
+        int annul_delay_slot = 0;
+
+#if HAZARD_STATS
+        int last_shift_dest = 0;
+        int last_load_dest = 0;
+        int last_load32_dest = 0;
+#endif
+
+        FETCH_AND_DISPATCH();
+
+        /* SPECIAL, all R-type, thus rd is the target register */
+op_sll:  wbr = i.r.rd; NOTE_SHIFT(wbr); wbv = t << i.r.sa; DISPATCH();
+op_srl:  wbr = i.r.rd; NOTE_SHIFT(wbr); wbv = t >> i.r.sa; DISPATCH();
+op_sra:  wbr = i.r.rd; NOTE_SHIFT(wbr); wbv = (int)t >> i.r.sa; DISPATCH();
+op_sllv: wbr = i.r.rd; NOTE_SHIFT(wbr); wbv = t << (s & 31); DISPATCH();
+op_srlv: wbr = i.r.rd; NOTE_SHIFT(wbr); wbv = t >> (s & 31); DISPATCH();
+op_srav: wbr = i.r.rd; NOTE_SHIFT(wbr); wbv = (int)t >> (s & 31); DISPATCH();
+
+op_jalr: wbr = i.r.rd; wbv = pc_next; pc_next = s;
+         branch_delay_slot_next = 1;
+         DISPATCH();
+op_jr:   wbr = 0; pc_next = s;
+         branch_delay_slot_next = 1;
+         DISPATCH();
+
+op_syscall: wbr = 0; hostcall(state); DISPATCH();
+
+op_mfhi: wbr = i.r.rd; wbv = state->hi; DISPATCH();
+op_mflo: wbr = i.r.rd; wbv = state->lo; DISPATCH();
+op_mthi: wbr = 0; state->hi = s; DISPATCH();
+op_mtlo: wbr = 0; state->lo = s; DISPATCH();
+
+op_mult: {
+        int64_t i64 = (int64_t) (int) s * (int64_t) (int) t;
+        state->lo = i64;
+        state->hi = i64 >> 32;
+        wbr = 0;
+        DISPATCH();
+}
+op_multu: {
+        u_int64_t u64 = (u_int64_t)s * (u_int64_t)t;
+        state->lo = u64;
+        state->hi = u64 >> 32;
+        wbr = 0;
+        DISPATCH();
+}
+op_div:
+        if (t) {
+                state->hi = (int)s % (int)t;
+                state->lo = (int)s / (int)t;
+        } else {
+                // Technically undefined
+                state->hi = s;
+                state->lo = 0;
+        }
+        wbr = 0;
+        DISPATCH();
+op_divu:
+        if (t) {
+                state->hi = s % t;
+                state->lo = s / t;
+        } else {
+                // Technically undefined
+                state->hi = s;
+                state->lo = 0;
+        }
+        wbr = 0;
+        DISPATCH();
+
+op_sub:
+        wbr = i.r.rd;
+        wbv = s - t;
+        if (SUB_OVERFLOWS(s, t, wbv))
+                goto overflow;
+        DISPATCH();
+
+op_add:
+        wbr = i.r.rd;
+        wbv = s + t;
+        if (ADD_OVERFLOWS(s, t, wbv)) {
+overflow:
+                state->cp0_cause.exc_code = EXC_OV;
+                state->cp0_cause.ce = 0;
+                state->cp0_cause.bd = branch_delay_slot;
+                state->cp0r[CP0_EPC] = pc_prev - 4 * branch_delay_slot;
+
+                pc_next = 0xBFC00280; // XXX Not too sure about this!
+                annul_delay_slot = 1;
+                state->cp0_status.exl = 1; // XXX This I know is wrong!
+                wbr = 0;
+        }
+        DISPATCH();
+
+op_addu: wbr = i.r.rd; wbv = s + t; DISPATCH();
+op_subu: wbr = i.r.rd; wbv = s - t; DISPATCH();
+op_and:  wbr = i.r.rd; wbv = s & t; DISPATCH();
+op_or:   wbr = i.r.rd; wbv = s | t; DISPATCH();
+op_xor:  wbr = i.r.rd; wbv = s ^ t; DISPATCH();
+op_nor:  wbr = i.r.rd; wbv = ~(s | t); DISPATCH();
+op_slt:  wbr = i.r.rd; wbv = (int) s < (int) t; DISPATCH();
+op_sltu: wbr = i.r.rd; wbv = s < t; DISPATCH();
+
+op_teq:
+        if (s == t)
+                fatal("Trap %d %d", i.r.rd, i.r.sa);
+        wbr = 0;
+        DISPATCH();
+
+op_break:
+        state->cp0_cause.exc_code = EXC_BP;
+        state->cp0_cause.ce = 0;
+        state->cp0_cause.bd = branch_delay_slot;
+        state->cp0r[CP0_EPC] = pc_prev - 4 * branch_delay_slot;
+
+        pc_next = 0xBFC00380;
+        annul_delay_slot = 1;
+        state->cp0_status.exl = 1;
+        wbr = 0;
+        DISPATCH();
+
+        /* REGIMM, all I-type */
+op_bltzal:
+        wbr = 31; wbv = pc_next;
+        if ((int)s < 0)
+                pc_next = state->pc + (i.i.imm << 2);
+        branch_delay_slot_next = 1;
+        DISPATCH();
+op_bgezal:
+        wbr = 31; wbv = pc_next;
+        if ((int)s >= 0)
+                pc_next = state->pc + (i.i.imm << 2);
+        branch_delay_slot_next = 1;
+        DISPATCH();
+op_bltz: BRANCH_IF((int)s < 0);
+op_bgez: BRANCH_IF((int)s >= 0);
+op_synci:
+        wbr = 0;
+        synci(address);
+        DISPATCH();
+
+op_jal:
+        ++yari->n_call;
+        wbr = 31; wbv = pc_next;
+        pc_next = (state->pc & ~((1<<28)-1)) | (i.j.offset << 2);
+        branch_delay_slot_next = 1;
+        DISPATCH();
+op_j:
+        wbr = 0;
+        pc_next = (state->pc & ~((1<<28)-1)) | (i.j.offset << 2);
+        branch_delay_slot_next = 1;
+        DISPATCH();
+
+op_beq:
+        /* Special hack. Terminate on endless loops */
+        if (i.raw == 0x1000FFFF && icache_fetch(state->pc + 4) == 0)
+                sim_exit(0);
+        BRANCH_IF(s == t);
+op_bne:  BRANCH_IF(s != t);
+op_blez: BRANCH_IF(0 >= (int)s);
+op_bgtz: BRANCH_IF(0 < (int)s);
+
+op_addi:  wbv = (int) address; DISPATCH();
+op_addiu: wbv =       address; DISPATCH();
+op_slti:  wbv = (int) s < i.i.imm; DISPATCH();
+op_sltiu: wbv = s < (unsigned) i.i.imm; DISPATCH();
+op_andi:  wbv = s & i.u.imm; DISPATCH();
+op_ori:   wbv = s | i.u.imm; DISPATCH();
+op_xori:  wbv = s ^ i.u.imm; DISPATCH();
+op_lui:   wbv = i.u.imm << 16; DISPATCH();
+
+op_cp0:
+        wbv = 0xDEADBEEF;
+        if (i.r.rs & 0x10) {
+                if ((c0_map_t) i.r.funct == C0_ERET) {
+                        /* Exception Return */
+                        annul_delay_slot = 1;
+                        if (branch_delay_slot)
+                                fprintf(stderr, "ERET in a delay slot is illegal!\n");
+
+                        if (state->cp0_status.erl) {
+                                pc_next = state->cp0r[CP0_ERROREPC];
+                                state->cp0_status.erl = 0;
+                        } else {
+                                pc_next = state->cp0r[CP0_EPC];
+                                state->cp0_status.exl = 0;
+                        }
+                        DISPATCH();
+                }
+                if ((c0_map_t) i.r.funct == C0_WAIT) {
+                        wbr = 0;
+                        idle_wait();
+                        DISPATCH();
+                }
+                fprintf(stderr,
+                        "Unhandled CP0 command %s\n",
+                        (c0_map_t) i.r.funct == C0_TLBR  ? "tlbr" :
+                        (c0_map_t) i.r.funct == C0_TLBWI ? "tlbwi" :
+                        (c0_map_t) i.r.funct == C0_TLBWR ? "tlbwr" :
+                        (c0_map_t) i.r.funct == C0_TLBP  ? "tlbp" :
+                        (c0_map_t) i.r.funct == C0_DERET ? "deret" :
+                        (c0_map_t) i.r.funct == C0_WAIT  ? "wait" :
+                        "???");
+        } else {
+                assert(i.r.funct == 0);
+                if (i.r.rs & 4) {
+                        wbr = 0;
+                        mtc0(state, i.r.rd, t);
+                } else
+                        wbv = state->cp0r[i.r.rd];
+        }
+        DISPATCH();
+
+op_cp2:
+        if (i.raw == 0x48000000) { // A hack
+                if (state->lo == 0x87654321) {
+                        printf("TEST SUCCESS!\n");
+                        sim_exit(0);
+                } else {
+                        printf("TEST FAILED WITH $2 = 0x%08x\n",
+                               state->lo);
+                        sim_exit(1);
+                }
+        }
+
+        wbv = 0xDEADBEEF;
+        if (~i.r.rs & 0x10 && ~i.r.rs & 4)
+                wbv = perf_counter(i.r.rd);
+        DISPATCH();
+
+op_rdhwr:
+        if (i.r.funct != 59)
+                goto unhandled;
+        wbv = rdhwr(i.r.rd);
+        DISPATCH();
+
+        /* Loads and stores, specialized by endian */
+        LOADS_AND_STORES(le)
+        LOADS_AND_STORES(be)
+
+op_lwc1:
+        state->f[wbr] = LD32(address);
+        wbr = 0;
+        DISPATCH_MEM();
+
+op_cp1:
+        if (i.r.rs == 16 /* S */)
+                fatal("%08x:%08x, opcode 0x%x.s not handled\n",
+                      pc_prev, i.raw, i.r.funct);
+        if (i.r.rs == 17 /* D */)
+                fatal("%08x:%08x, opcode 0x%x.d not handled\n",
+                      pc_prev, i.raw, i.r.funct);
+        fatal("%08x:%08x, opcode CP1 rs=0x%x not handled\n",
+              pc_prev, i.raw, i.r.rs);
+
+special_unhandled:
+        fatal("SPECIAL sub-opcode %d not handled\n", i.r.funct);
+regimm_unhandled:
+        fatal("REGIMM rt=0d%d not handled\n", i.r.rt);
+unhandled:
+        fatal("%08x:%08x, opcode %d not handled\n", pc_prev, i.raw, i.j.opcode);
+
+access_violation:
+        RETIRE();
+        printf("Access violation, execution aborted\n");
+}
+
+#undef NOTE_HAZARDS
+#undef FETCH_AND_DISPATCH
+#undef RETIRE
+#undef DISPATCH
+#undef DISPATCH_MEM
+#undef BRANCH_IF
+#undef LOADS_AND_STORES
+#undef MEM
+
 // Local Variables:
 // mode: C
 // c-style-variables-are-local-p: t
@@ -4,11 +4,13 @@
 #include <SDL.h>
 #include <sys/time.h>
 #include <stdint.h>
+#include <setjmp.h>
+#include <netinet/in.h>
 
-/* Basic latencies */
+/* Basic latencies, used by the timing model */
 #define LOAD_LATENCY 0
-#define MULT_LATENCY 0
-#define DIV_LATENCY  0
+#define MULT_LATENCY 1  // Plus one cycle per significant multiplier bit
+#define DIV_LATENCY  33
 #define SH_LATENCY   0
 
 extern int enable_disass;
@@ -21,21 +23,21 @@ extern int enable_regwrites;
 extern int enable_firmware_mode;
 extern int enable_cosimulation;
 extern int enable_register_dump;
-
-extern int endian_is_big;
+extern int enable_tcache;
+extern int enable_threaded;
+extern int enable_dbt;
+extern int enable_flat_memory;
+extern int enable_check_icache;
 
 extern struct timeval stat_start_time, stat_stop_time;
 
 /* The hazards here count def-use cases with no intervening cycles,
-   not all hazards today */
-uint64_t stat_gen_load_hazard;
-uint64_t stat_load_use_hazard_rs;
-uint64_t stat_load_use_hazard_rt;
-uint64_t stat_load32_use_hazard;
-uint64_t stat_shift_use_hazard;
-uint64_t stat_nop;
-uint64_t stat_nop_delay_slots;
-uint64_t stat_nop_useless;
+   not all hazards today.  Gathering them costs the interpreters a
+   handful of compares per instruction; build with HAZARD_STATS=0 to
+   leave them out entirely. */
+#ifndef HAZARD_STATS
+#define HAZARD_STATS 1
+#endif
 
 /*
   The simulation space address to physical address translation is a
@@ -74,20 +76,42 @@ uint64_t stat_nop_useless;
      addr2phys(x) = memory_segment'[segment(x)] + x
 
    BUT we don't do it like that below, for clairity.
+
+   FLAT MODE
+
+   On a 64-bit host we can in fact afford the 1-1 mapping.  With
+   --flat-memory the whole 4 GiB simulation space is reserved with a
+   single inaccessible mmap and pages are made accessible as they get
+   mapped, FLAT_PAGE_BITS at a time, thus
+
+     addr2phys(x) = flat_memory + x
+
+   and host pointers into simulation memory stay valid for good.
+   load() and store() only range check against the boot PROM and IO
+   space (everything from FLAT_FAST_LIMIT up), accessing unmapped
+   memory below that is caught by flat_segv().
 */
 
 #define SEGMENTBITS 4
 #define OFFSETBITS (32 - SEGMENTBITS)
 #define NSEGMENT (1 << SEGMENTBITS)
 
-extern void    *memory_segment[NSEGMENT];
-extern unsigned memory_segment_size[NSEGMENT];
+#define FLAT_PAGE_BITS  16      // A multiple of any sane host page size
+#define FLAT_FAST_LIMIT 0xBFC00000
+
+#define flat_mapped(x) \
+        (yari->flat_page_map[((unsigned)(x)) >> (FLAT_PAGE_BITS + 5)] & \
+         (1U << ((((unsigned)(x)) >> FLAT_PAGE_BITS) & 31)))
 
 #define segment(x)     (((unsigned)(x)) >> OFFSETBITS)
 #define seg2virt(s)     (((unsigned)(s)) << OFFSETBITS)
 #define offset(x)      (((unsigned)(x)) & ((1 << OFFSETBITS) - 1))
-#define addr2phys(x)   (memory_segment[segment(x)] + offset(x))
-#define addr_mapped(x) (offset(x) < memory_segment_size[segment(x)])
+#define addr2phys(x)   (yari->flat_memory                              \
+                        ? (void *) (yari->flat_memory + (unsigned)(x)) \
+                        : yari->memory_segment[segment(x)] + offset(x))
+#define addr_mapped(x) (yari->flat_memory                              \
+                        ? flat_mapped(x) != 0                          \
+                        : offset(x) < yari->memory_segment_size[segment(x)])
 
 #define EXT8(b) ((int8_t) (u_int8_t) (b))
 #define EXT16(h)((int16_t)(u_int16_t)(h))
@@ -99,29 +123,128 @@ extern unsigned memory_segment_size[NSEGMENT];
 #define ST16(a,v) store(a,v,2)
 #define ST32(a,v) store(a,v,4)
 
-#define fatal(msg...) ({printf(msg); exit(1);})
-
-extern unsigned program_entry;
-extern unsigned text_start, text_size;
-extern unsigned mif_size;
+/*
+ * Whether ADD and SUB overflow, r being the truncated result: the
+ * operands have the same sign (different for SUB) and r has the other
+ */
+#define ADD_OVERFLOWS(s,t,r) ((~((s) ^ (t)) & ((s) ^ (r))) >> 31)
+#define SUB_OVERFLOWS(s,t,r) ((((s) ^ (t)) & ((s) ^ (r))) >> 31)
 
-long long unsigned n_cycle, n_stall;
-long long unsigned n_issue;
-long long unsigned n_call;
-long long unsigned n_icache_hits, n_icache_misses;
+/* Index into the compressed opcode space of inst_name[], reg_use_map[], etc. */
+#define INST_INDEX(i) ((i).j.opcode == SPECIAL ?  64 + (i).r.funct : \
+                       (i).j.opcode == REGIMM  ? 128 + (i).r.rt :    \
+                       /*                     */ (i).j.opcode)
 
-extern int rs232in_fd;
-extern int rs232out_fd;
+/*
+ * Leaving the simulation.  These return through yari->bail with the
+ * guest's exit status or the error message, to run_machine() in sim.c,
+ * which exits, or to the API call of the library (libyarisim.c).
+ * Without a bail they simply exit.
+ */
+void sim_exit(int status) __attribute__((noreturn));
+void sim_fatal(const char *fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
+void flat_segv_report(void);
 
-unsigned keys;
+#define fatal(msg...) sim_fatal(msg)
 
-unsigned segfault;
-uint32_t framebuffer_start, framebuffer_size;
-unsigned framebuffer_generation;
+extern unsigned mif_size;
 
 // Cache parameters in words log2
-uint32_t icache_way_lines_log2, icache_words_in_line_log2;
-uint32_t dcache_way_lines_log2, dcache_words_in_line_log2;
+extern uint32_t icache_way_lines_log2, icache_words_in_line_log2;
+extern uint32_t dcache_way_lines_log2, dcache_words_in_line_log2;
+
+/* Set associative cache model, see cache.c */
+enum { CACHE_LRU, CACHE_ROUND_ROBIN, CACHE_RANDOM };
+
+typedef struct cache {
+        const char *name;
+        unsigned    ways;
+        unsigned    sets_log2;  // Lines per way
+        unsigned    line_log2;  // Bytes per line
+        int         policy;
+        uint32_t   *tag;        // [set][way]
+        uint64_t   *stamp;      // [set][way], LRU only
+        uint32_t   *data;       // [set][way][word], if kept
+        uint64_t    clock;
+        uint64_t    lfsr;
+        unsigned    next_way;
+        uint64_t    hits, misses;
+} cache_t;
+
+#define cache_set(c, a)  (((a) >> (c)->line_log2) & ((1U << (c)->sets_log2) - 1))
+#define cache_line(c, a, way) \
+        ((c)->data + (((cache_set(c, a) * (c)->ways + (way))) << ((c)->line_log2 - 2)))
+
+int  cache_policy(const char *name);
+void cache_init(cache_t *c, const char *name,
+                unsigned ways, unsigned sets_log2, unsigned line_log2,
+                int policy, int keep_data);
+void cache_free(cache_t *c);
+void cache_print(cache_t *c);
+int  cache_lookup(cache_t *c, uint32_t address);
+int  cache_probe(cache_t *c, uint32_t address);
+int  cache_fill(cache_t *c, uint32_t address);
+int  cache_access(cache_t *c, uint32_t address, int allocate);
+void cache_invalidate(cache_t *c, uint32_t address);
+
+/*
+ * Cache sweep: LRU stack distances for every power-of-two
+ * configuration from 1 to 64 KiB and 1 to 8 ways, in a single pass.
+ */
+#define SWEEP_WAYS_LOG2     3
+#define SWEEP_MIN_SIZE_LOG2 10
+#define SWEEP_MAX_SIZE_LOG2 16
+#define SWEEP_MAX_SETS_LOG2 (SWEEP_MAX_SIZE_LOG2 - 2)
+
+typedef struct cache_sweep {
+        const char *name;
+        unsigned    line_log2;
+        unsigned    min_sets_log2, max_sets_log2;
+        uint32_t   *stack[SWEEP_MAX_SETS_LOG2 + 1];  // [set][depth]
+        uint64_t    dist[SWEEP_MAX_SETS_LOG2 + 1][(1 << SWEEP_WAYS_LOG2) + 1];
+        uint64_t    accesses;
+} cache_sweep_t;
+
+/*
+ * Binary cosimulation commit record, as written by the testbench's
+ * $fwrite("%u") in host byte order
+ */
+#define COMMIT_TAG 0xC0CC0000
+
+typedef struct commit_record {
+        uint32_t tag;           // COMMIT_TAG | wbr
+        uint32_t pc;
+        uint32_t wbv;
+        uint32_t cycle;         // $time / 100, truncated to 32 bits
+} commit_record_t;
+
+void cosim_open_trace(const char *filename);
+void cosim_spawn_rtl(const char *command);
+void cosim_open_model(const char *dir);
+void cosim_start(void);
+void cosim_print_history(void);
+void cosim_checkpoint(void);
+void cosim_replay(void);
+extern uint64_t cosim_interval, cosim_next_checkpoint;
+int  get_rtl_commit(uint64_t *cycle, unsigned *pc, unsigned *wbr, unsigned *wbv);
+
+extern int enable_timing;
+extern int enable_stop_on_watch;
+void timing_print(void);
+uint64_t timing_cycles(void);
+void timing_skip(void);
+
+/* Sampled simulation, see sample.c */
+extern uint64_t sample_period, sample_window, sample_warmup;
+void run_sampled(MIPS_state_t *s);
+void sample_print(void);
+
+extern int enable_cache_sweep;
+
+void cache_sweep_init(cache_sweep_t *s, const char *name, unsigned line_log2);
+void cache_sweep_free(cache_sweep_t *s);
+void cache_sweep_access(cache_sweep_t *s, uint32_t address);
+void cache_sweep_print(cache_sweep_t *s);
 
 void exception(char *kind);
 void loadsection(FILE *f, unsigned f_offset, unsigned f_len, unsigned m_addr, unsigned m_len);
@@ -134,7 +257,333 @@ void store(unsigned a, unsigned v, int c);
 void disass(unsigned pc, inst_t i);
 
 void init_reg_use_map(void);
+void reset_mips_state(MIPS_state_t *s);
 void run_simple(MIPS_state_t *s);
+void run_threaded(MIPS_state_t *s);
+void run_tcache(MIPS_state_t *s);
+void print_coverage(void);
+uint32_t icache_fetch(uint32_t address);
+uint32_t icache_peek(uint32_t address, int *stale);
+void icache_fetch_block(uint32_t address, unsigned n);
+uint32_t perf_counter(unsigned r);
+void synci(unsigned address);
+void mtc0(MIPS_state_t *state, unsigned reg, uint32_t v);
+int rdhwr(unsigned r);
+
+
+/*
+ * The translation cache keeps a bitmap of the guest memory that has
+ * been translated, at a granularity of 2^TC_GRANULE_BITS bytes (an I$
+ * line).
+ * Stores hitting a marked granule drop the translations of the word.
+ */
+#define TC_GRANULE_BITS 4
+
+#define tc_is_code(a) \
+        (yari->tc_code_map[((unsigned)(a)) >> (TC_GRANULE_BITS + 5)] & \
+         (1U << ((((unsigned)(a)) >> TC_GRANULE_BITS) & 31)))
+
+void tc_invalidate(unsigned address);
+void tc_invalidate_range(unsigned address, unsigned len);
+
+/*
+ * Pages written since the program was loaded.  The I$ model only
+ * checks hits against memory for lines in dirty pages, unless
+ * --check-icache asks for every fetch to be checked.
+ */
+#define ICACHE_PAGE_BITS 12
+
+#define icache_note_store(a) \
+        (yari->icache_dirty_map[((unsigned)(a)) >> (ICACHE_PAGE_BITS + 5)] |= \
+         1U << ((((unsigned)(a)) >> ICACHE_PAGE_BITS) & 31))
+
+#define icache_page_dirty(a) \
+        (yari->icache_dirty_map[((unsigned)(a)) >> (ICACHE_PAGE_BITS + 5)] & \
+         (1U << ((((unsigned)(a)) >> ICACHE_PAGE_BITS) & 31)))
+
+/*
+ * The 1024x768 RGB332 framebuffer (--graphics and --frames).  Stores
+ * mark the scanlines they touch and the screen update takes them, so
+ * only what changed gets copied.  The marking is atomic as the update
+ * runs in the UI thread.
+ */
+#define FB_WIDTH  1024
+#define FB_HEIGHT 768
+
+#define framebuffer_note_store(a)                                       \
+        do {                                                            \
+                unsigned _line = ((a) - yari->framebuffer_start) / FB_WIDTH; \
+                uint32_t _bit = 1U << (_line & 31);                     \
+                                                                        \
+                if (!(yari->framebuffer_dirty[_line / 32] & _bit))      \
+                        __atomic_fetch_or(&yari->framebuffer_dirty[_line / 32], \
+                                          _bit, __ATOMIC_RELAXED);      \
+        } while (0)
+
+/* The functions of the loaded programs, see readelf() */
+typedef struct symbol {
+        uint32_t        address, size;
+        const char     *name;
+} symbol_t;
+
+/*
+ * Everything that belongs to one simulated machine, so that a process
+ * can run any number of them, one per thread at a time.  The thread's
+ * current machine is yari.  The command line options (enable_*) and
+ * the cache geometry stay process wide.
+ */
+typedef struct yarisim {
+        MIPS_state_t    state;
+
+        /* Memory, see the top of this file */
+        void           *memory_segment[NSEGMENT];
+        unsigned        memory_segment_size[NSEGMENT];
+        char           *flat_memory;
+        uint32_t        flat_page_map[1 << (32 - FLAT_PAGE_BITS - 5)];
+        int             memory_is_initialized;
+        int             endian_is_big;
+
+        /* The loaded program */
+        unsigned        program_entry;
+        unsigned        text_start, text_size;
+        unsigned        nsections;
+        unsigned        section_start[99];
+        unsigned        section_size[99];
+        int             text_segments;
+        symbol_t       *symbols;        // Sorted on address
+        unsigned        nsymbols;
+
+        /* Devices */
+        int             rs232in_fd, rs232out_fd;
+        int             echo_serial;    // Serial output also goes to stdout
+        int             serial_wait;
+        unsigned        rs232in_data;
+        unsigned char   rs232in_cnt;
+        unsigned        rs232in_pending; // last one is simulation only
+        uint64_t        rs232out_ready, rs232in_ready; // TSC, baud timing only
+        struct serial  *serial;         // Private to serial.c
+        unsigned        keys;
+        uint32_t        vsynccnt;
+        uint32_t        framebuffer_start, framebuffer_size;
+        uint32_t        framebuffer_dirty[FB_HEIGHT / 32];
+
+        /* Execution */
+        uint64_t        TSC;
+        unsigned        segfault;
+        int             flat_fault;     // See flat_segv_report()
+        uint32_t        flat_fault_address;
+        uint64_t        stop_issue;     // The engines stop at n_issue >= this
+        uint32_t        stop_pc;        // or here, ~0 for nowhere
+        uint64_t        n_effects;      // Stores, device loads and host calls
+        unsigned        coverage[64+64+32];
+        cache_t         icache, dcache;
+        cache_sweep_t   icache_sweep, dcache_sweep;
+        uint32_t        icache_dirty_map[1 << (32 - ICACHE_PAGE_BITS - 5)];
+        uint32_t       *tc_code_map;
+        struct tcache  *tc;             // Private to tcache.c
+        struct timing  *timing;         // Private to run_simple.c
+        struct sampling *sampling;      // Private to sample.c
+        struct profile *profile;        // Private to profile.c, if profiling
+        struct hostio  *hostio;         // Private to hostcall.c
+        struct trace   *trace;          // Private to trace.c, if tracing
+        struct idle    *idle;           // Private to idle.c
+        struct gdb     *gdb;            // Private to gdbserver.c
+        uint32_t       *break_map;      // See at_break(), NULL for none
+        struct watch   *watch;          // Private to watch.c
+        uint32_t       *watch_map;      // See watched(), NULL for none
+        uint32_t        watch_pc;       // The instruction accessing memory
+
+        /* Statistics */
+        long long unsigned n_cycle, n_stall;
+        long long unsigned n_issue;
+        long long unsigned n_call;
+        long long unsigned n_tc_blocks, n_tc_flushes;
+        long long unsigned n_dbt_blocks; // Given host code
+        uint64_t        n_idle;         // Cycles skipped while idle
+
+        uint64_t        stat_gen_load_hazard;
+        uint64_t        stat_load_use_hazard_rs;
+        uint64_t        stat_load_use_hazard_rt;
+        uint64_t        stat_load32_use_hazard;
+        uint64_t        stat_shift_use_hazard;
+        uint64_t        stat_nop;
+        uint64_t        stat_nop_delay_slots;
+        uint64_t        stat_nop_useless;
+
+        /* Set while the machine runs, see sim_exit() */
+        sigjmp_buf     *bail;
+        int             exit_status;
+        int             stopped;        // Why the program stopped, YARISIM_*
+        char            error[256];
+} yarisim_t;
+
+extern __thread yarisim_t *yari;
+
+yarisim_t *sim_new(void);
+void sim_free(yarisim_t *y);
+void tc_free_all(yarisim_t *y);
+void tc_fold_stats(void);
+
+const symbol_t *symbol_lookup(uint32_t address);
+
+/* The guest profiler, see profile.c.  Only call these if yari->profile. */
+void profile_start(void);
+void profile_free(yarisim_t *y);
+void profile_block(uint32_t pc, unsigned n, uint64_t count);
+void profile_icache_miss(uint32_t pc);
+void profile_stall(uint32_t pc, unsigned cycles);
+void profile_call(uint32_t from, uint32_t to);
+void profile_print(void);
+void profile_write_gmon(const char *filename);
+
+/* The binary instruction trace, see trace.c */
+typedef struct trace_record {
+        uint32_t pc, inst;
+        unsigned wbr;           // Zero if none
+        uint32_t wbv;
+        int      is_mem;
+        uint32_t address;       // If is_mem
+} trace_record_t;
+
+void trace_start(const char *filename);
+void trace_commit(uint32_t pc, uint32_t inst, unsigned wbr, uint32_t wbv,
+                  int is_mem, uint32_t address);
+void trace_close(void);
+void trace_free(yarisim_t *y);
+struct trace *trace_open(const char *filename);
+int  trace_read(struct trace *t, trace_record_t *r);
+void trace_close_reader(struct trace *t);
+
+/*
+ * Breakpoints of the GDB server, see gdbserver.c.  break_map is a
+ * filter with a bit per word address modulo BREAK_MAP_BITS, exact
+ * only after gdb_break_at().
+ */
+#define BREAK_MAP_BITS 16
+#define BREAK_MAP_INDEX(a) (((uint32_t) (a) >> 2) & ((1 << BREAK_MAP_BITS) - 1))
+#define at_break(a)                                                     \
+        (yari->break_map &&                                             \
+         (yari->break_map[BREAK_MAP_INDEX(a) >> 5] & (1U << (BREAK_MAP_INDEX(a) & 31))) && \
+         gdb_break_at(a))
+
+int  gdb_break_at(uint32_t pc);
+void gdb_serve(int port);
+void gdb_free(yarisim_t *y);
+
+/*
+ * Memory watchpoints, see watch.c.  watch_map has a bit per page
+ * holding one; accesses to those leave the fast paths for load() and
+ * store(), which pass them on for the exact check.  The engines keep
+ * watch_pc for the log.
+ */
+#define WATCH_PAGE_BITS 12
+
+#define watched(a)                                                      \
+        (yari->watch_map &&                                             \
+         (yari->watch_map[((unsigned)(a)) >> (WATCH_PAGE_BITS + 5)] &   \
+          (1U << ((((unsigned)(a)) >> WATCH_PAGE_BITS) & 31))))
+
+enum { WATCH_WRITE = 1, WATCH_READ, WATCH_ACCESS };
+
+int  watch_insert(uint32_t address, uint32_t len, int kind, int stop);
+int  watch_remove(uint32_t address, uint32_t len, int kind);
+int  watch_stopped(uint32_t *address, int *kind);
+void watch_load(uint32_t a, int c, uint32_t v);
+void watch_store(uint32_t a, int c, uint32_t v, uint32_t old);
+void watch_free(yarisim_t *y);
+void tc_invalidate_all(void);
+
+/* Skipping idle loops and WAIT, see idle.c */
+void idle_poll(unsigned reg, unsigned value);
+void idle_wait(void);
+void idle_free(yarisim_t *y);
+void tc_skip_cycles(uint64_t cycles);
+void timing_idle(uint64_t cycles);
+
+/* See serial.c */
+extern int serial_baud_accurate;
+extern unsigned serial_baud, serial_clock;
+void service_rs232(void);
+unsigned serial_load(unsigned reg);
+void serial_store(unsigned char ch);
+int serial_read(void *buf, unsigned len);
+int serial_write(const void *buf, unsigned len);
+void serial_flush(void);
+int64_t serial_idle(unsigned reg);
+void serial_free(yarisim_t *y);
+
+/* SYSCALL runs these on the host, see hostcall.c */
+enum {
+        HOSTCALL_EXIT = 1, HOSTCALL_OPEN, HOSTCALL_CLOSE, HOSTCALL_READ,
+        HOSTCALL_WRITE, HOSTCALL_LSEEK, HOSTCALL_FSTAT = 10,
+        HOSTCALL_GETTIMEOFDAY = 19,
+};
+
+void hostcall(MIPS_state_t *state);
+void hostcall_free(yarisim_t *y);
+
+/* See checkpoint.c */
+void checkpoint_save(const char *filename);
+void checkpoint_restore(const char *filename);
+
+/*
+ * Inline accessors for the execution engines, specialized by width
+ * and endian (ld32_be() etc.) so that plain RAM takes a few
+ * instructions.  Anything else (IO, the boot PROM, unaligned or
+ * unmapped accesses, watched pages and stores to translated code or
+ * the framebuffer) goes through load() and store(), as does everything
+ * when the D$ is modeled.
+ */
+static inline void *ram_ptr(uint32_t a, unsigned c)
+{
+        if (a >= FLAT_FAST_LIMIT || (a & (c - 1)) || yari->dcache.tag || watched(a))
+                return NULL;
+        if (yari->flat_memory)
+                return yari->flat_memory + a;
+        if (offset(a + c - 1) >= yari->memory_segment_size[segment(a)])
+                return NULL;
+        return yari->memory_segment[segment(a)] + offset(a);
+}
+
+#define RAM_LOAD(E, W, SWAP)                                            \
+static inline uint32_t ld##W##_##E(uint32_t a)                          \
+{                                                                       \
+        uint##W##_t *p = ram_ptr(a, W / 8);                             \
+                                                                        \
+        if (__builtin_expect(p != NULL, 1))                             \
+                return SWAP(*p);                                        \
+        return load(a, W / 8, 0);                                       \
+}
+
+#define RAM_STORE(E, W, SWAP)                                           \
+static inline void st##W##_##E(uint32_t a, uint32_t v)                  \
+{                                                                       \
+        uint##W##_t *p = ram_ptr(a, W / 8);                             \
+                                                                        \
+        if (__builtin_expect(p != NULL && !tc_is_code(a) &&             \
+                             a - yari->framebuffer_start >= yari->framebuffer_size, 1)) { \
+                *p = SWAP(v);                                           \
+                icache_note_store(a);                                   \
+                ++yari->n_effects;                                      \
+        } else                                                          \
+                store(a, v, W / 8);                                     \
+}
+
+RAM_LOAD(le, 8, )
+RAM_LOAD(le, 16, )
+RAM_LOAD(le, 32, )
+RAM_LOAD(be, 8, )
+RAM_LOAD(be, 16, ntohs)
+RAM_LOAD(be, 32, ntohl)
+RAM_STORE(le, 8, )
+RAM_STORE(le, 16, )
+RAM_STORE(le, 32, )
+RAM_STORE(be, 8, )
+RAM_STORE(be, 16, htons)
+RAM_STORE(be, 32, htonl)
+
+#undef RAM_LOAD
+#undef RAM_STORE
 void dump(const char *filename, char kind, uint32_t width, uint32_t *memory, uint32_t start, uint32_t size);
 void dump_tinymon(void);
 
@@ -0,0 +1,185 @@
+/*
+ * Sampled simulation, enabled with --sample-period.
+ *
+ * Every period of sample_period instructions ends with a detailed
+ * window: sample_warmup instructions on the reference interpreter
+ * with the timing model to fill the pipeline, then sample_window
+ * measured ones.  The rest of the period is fast-forwarded on the
+ * translation cache, which keeps both cache models warm, so the
+ * windows start with the caches in the state a full detailed run
+ * would have them in.
+ *
+ * The rates of every window (CPI, miss rates and hazards) are taken
+ * as a systematic sample of the whole run and reported with their
+ * 95% confidence intervals.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "mips32.h"
+#include "runmips.h"
+
+uint64_t sample_period = 0;
+uint64_t sample_window = 1000000;
+uint64_t sample_warmup = 10000;
+
+/* What a window counts */
+enum {
+        C_INSTS, C_CYCLES,
+        C_ICACHE_ACCESSES, C_ICACHE_MISSES,
+        C_DCACHE_ACCESSES, C_DCACHE_MISSES,
+        C_LOAD_USE, C_SHIFT_USE,
+        C_N
+};
+
+static const struct metric {
+        const char *name;
+        int         num, den;
+        double      scale;
+} metric[] = {
+        { "CPI",                C_CYCLES,        C_INSTS,           1 },
+        { "I$ miss rate %",     C_ICACHE_MISSES, C_ICACHE_ACCESSES, 100 },
+        { "D$ miss rate %",     C_DCACHE_MISSES, C_DCACHE_ACCESSES, 100 },
+#if HAZARD_STATS
+        { "Load use hazards %", C_LOAD_USE,      C_INSTS,           100 },
+        { "Shift use hazards %",C_SHIFT_USE,     C_INSTS,           100 },
+#endif
+};
+
+#define NMETRICS (sizeof metric / sizeof metric[0])
+
+struct sampling {
+        uint64_t samples;
+        uint64_t detailed;              // Instructions, warm-up included
+        uint64_t n[NMETRICS];           // Windows where the metric is defined
+        double   sum[NMETRICS], sumsq[NMETRICS];
+};
+
+static void count(uint64_t *c)
+{
+        c[C_INSTS]           = yari->n_issue;
+        c[C_CYCLES]          = timing_cycles();
+        c[C_ICACHE_ACCESSES] = yari->icache.hits + yari->icache.misses;
+        c[C_ICACHE_MISSES]   = yari->icache.misses;
+        c[C_DCACHE_ACCESSES] = yari->dcache.hits + yari->dcache.misses;
+        c[C_DCACHE_MISSES]   = yari->dcache.misses;
+        c[C_LOAD_USE]        = yari->stat_load_use_hazard_rs + yari->stat_load_use_hazard_rt;
+        c[C_SHIFT_USE]       = yari->stat_shift_use_hazard;
+}
+
+static void record(const uint64_t *before, const uint64_t *after)
+{
+        struct sampling *sm = yari->sampling;
+        unsigned k;
+
+        ++sm->samples;
+        for (k = 0; k < NMETRICS; ++k) {
+                uint64_t den = after[metric[k].den] - before[metric[k].den];
+                double x;
+
+                if (!den)
+                        continue;
+
+                x = metric[k].scale * (after[metric[k].num] - before[metric[k].num]) / den;
+                ++sm->n[k];
+                sm->sum[k]   += x;
+                sm->sumsq[k] += x * x;
+        }
+}
+
+/* Two-sided 95% quantile of Student's t with df degrees of freedom */
+static double t95(uint64_t df)
+{
+        static const double t[] = {
+                0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+                2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110,
+                2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056,
+                2.052, 2.048, 2.045, 2.042,
+        };
+
+        return df < sizeof t / sizeof t[0] ? t[df] : 1.960;
+}
+
+void run_sampled(MIPS_state_t *state)
+{
+        uint64_t before[C_N], after[C_N];
+
+        if (!yari->sampling) {
+                yari->sampling = calloc(1, sizeof *yari->sampling);
+                if (!yari->sampling)
+                        fatal("Out of memory for the sampling\n");
+        }
+
+        for (;;) {
+                uint64_t start = yari->n_issue;
+
+                yari->stop_issue = start + sample_period - sample_warmup - sample_window;
+                run_tcache(state);
+                if (yari->segfault)
+                        break;
+
+                timing_skip();
+                yari->stop_issue = start + sample_period - sample_window;
+                run_simple(state);
+                if (yari->segfault)
+                        break;
+
+                count(before);
+                yari->stop_issue = start + sample_period;
+                run_simple(state);
+                if (yari->segfault)
+                        break;
+
+                count(after);
+                yari->sampling->detailed += after[C_INSTS] - before[C_INSTS] + sample_warmup;
+                record(before, after);
+        }
+
+        yari->stop_issue = ~0ULL;
+}
+
+void sample_print(void)
+{
+        struct sampling *sm = yari->sampling;
+        unsigned k;
+
+        if (!sm)
+                return;
+
+        printf("Sampled %llu windows of %llu instructions (after %llu warm-up) "
+               "every %llu, %4.2f%% in detail\n",
+               (long long unsigned) sm->samples,
+               (long long unsigned) sample_window,
+               (long long unsigned) sample_warmup,
+               (long long unsigned) sample_period,
+               yari->n_issue ? 100.0 * sm->detailed / yari->n_issue : 0.0);
+
+        for (k = 0; k < NMETRICS; ++k) {
+                uint64_t n = sm->n[k];
+                double mean, var;
+
+                if (!n)
+                        continue;
+
+                mean = sm->sum[k] / n;
+                var  = n > 1 ? (sm->sumsq[k] - n * mean * mean) / (n - 1) : 0;
+                if (var < 0)
+                        var = 0;
+
+                if (n > 1)
+                        printf("  %-22s %10.4f +- %.4f (95%% confidence)\n",
+                               metric[k].name, mean, t95(n - 1) * sqrt(var / n));
+                else
+                        printf("  %-22s %10.4f (a single window)\n",
+                               metric[k].name, mean);
+        }
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,333 @@
+/*
+ * The serial port, RS232IN_DATA, RS232IN_TAG and the output port at
+ * 0xFF000000.
+ *
+ * Firmware like tinymon polls the tag in a tight loop, so the host
+ * side never reads a byte at a time: input is read into a buffer,
+ * as much as is available, and an empty buffer is only refilled
+ * every SERIAL_POLL_CYCLES.  Output collects in a buffer that is
+ * written out when full, at the end of a line when going to a
+ * terminal, when the program looks for input that isn't there and
+ * when the simulation stops (serial_flush()).
+ *
+ * Loops polling the port with nothing else going on are skipped, see
+ * idle.c and serial_idle().
+ *
+ * The timing is either
+ *
+ *   ideal  the output is never busy and a byte is taken from the host
+ *          as soon as the previous one has been read, showing up after
+ *          two polls of the tag (the default), or
+ *
+ *   baud   (--serial-timing=baud) like the RTL at --serial-baud and
+ *          --serial-clock: a byte keeps the output busy for the time
+ *          of 10 bits and bytes written meanwhile are lost, and input
+ *          arrives at most once every 10 bits, overwriting a byte that
+ *          wasn't read in time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "mips32.h"
+#include "runmips.h"
+
+#define SERIAL_IN_SIZE          65536
+#define SERIAL_OUT_SIZE         4096
+#define SERIAL_POLL_CYCLES      4096    // About a byte time at 115200 bps
+
+int      serial_baud_accurate = 0;
+unsigned serial_baud  = 115200;
+unsigned serial_clock = 48000000;       // Hz, as the LPRP-3c25 and Fmax targets
+
+struct serial {
+        unsigned char in[SERIAL_IN_SIZE];
+        unsigned      in_rp, in_wp;
+        uint64_t      in_next_poll;     // TSC
+        unsigned char out[SERIAL_OUT_SIZE];
+        unsigned      out_n;
+        int           out_is_tty;       // -1 until known
+};
+
+static struct serial *serial(void)
+{
+        if (!yari->serial) {
+                yari->serial = calloc(1, sizeof *yari->serial);
+                if (!yari->serial)
+                        fatal("Out of memory for the serial port\n");
+                yari->serial->out_is_tty = -1;
+        }
+
+        return yari->serial;
+}
+
+void serial_flush(void)
+{
+        struct serial *s = yari ? yari->serial : NULL;
+
+        fflush(stdout);
+        if (!s || !s->out_n)
+                return;
+
+        if (yari->rs232out_fd >= 0) {
+                unsigned done = 0;
+                int n;
+
+                /* The output may be non-blocking */
+                while (done < s->out_n) {
+                        n = write(yari->rs232out_fd, s->out + done, s->out_n - done);
+                        if (n > 0)
+                                done += n;
+                        else if (n < 0 && errno == EAGAIN) {
+                                struct pollfd p = { .fd = yari->rs232out_fd, .events = POLLOUT };
+                                poll(&p, 1, -1);
+                        } else if (n < 0 && errno != EINTR)
+                                break;
+                }
+        }
+        s->out_n = 0;
+}
+
+void serial_free(yarisim_t *y)
+{
+        yarisim_t *saved = yari;
+
+        if (!y->serial)
+                return;
+
+        yari = y;
+        serial_flush();
+        yari = saved;
+        free(y->serial);
+        y->serial = NULL;
+}
+
+static unsigned serial_char_cycles(void)
+{
+        return (uint64_t) 10 * serial_clock / serial_baud;
+}
+
+/* The next byte of input, or -1 if there's none for now */
+static int serial_getc(void)
+{
+        struct serial *s = serial();
+        int n;
+
+        if (s->in_rp == s->in_wp) {
+                if (yari->rs232in_fd < 0 || yari->TSC < s->in_next_poll)
+                        return -1;
+
+                n = read(yari->rs232in_fd, s->in, sizeof s->in);
+                if (n <= 0) {
+                        /* Waiting for input, so show what's been written */
+                        s->in_next_poll = yari->TSC + SERIAL_POLL_CYCLES;
+                        serial_flush();
+                        return -1;
+                }
+                s->in_rp = 0;
+                s->in_wp = n;
+        }
+
+        return s->in[s->in_rp++];
+}
+
+/*
+ * Check the serial port and update rs232in_data and rs232in_cnt
+ * accordingly.
+ */
+void service_rs232(void)
+{
+        int ch;
+
+        if (yari->rs232in_fd < 0)
+                return;
+
+        if (serial_baud_accurate) {
+                if (yari->TSC < yari->rs232in_ready)
+                        return;
+                ch = serial_getc();
+                if (ch >= 0) {
+                        yari->rs232in_data = ch;
+                        ++yari->rs232in_cnt;
+                        yari->rs232in_ready = yari->TSC + serial_char_cycles();
+                }
+        } else if (!yari->rs232in_pending) {
+                ch = serial_getc();
+                if (ch >= 0) {
+                        yari->rs232in_pending = 3; // Minimum 2
+                        yari->rs232in_data = ch;
+                }
+        }
+}
+
+/* Loads from 0xFF000000, 0xFF000004 and 0xFF000008 */
+unsigned serial_load(unsigned reg)
+{
+        unsigned res;
+
+        switch (reg) {
+        case 0: // rs232out_busy
+                if (serial_baud_accurate)
+                        res = yari->TSC < yari->rs232out_ready;
+                else if (yari->serial_wait) {
+                        yari->serial_wait--;  // Not quite accurate, but ..
+                        res = 1;
+                } else
+                        res = 0;
+                idle_poll(0, res);
+                return res;
+
+        case 1:
+                res = yari->rs232in_data & 255;
+                if (enable_disass) {
+                        fprintf(stderr, "\nSERIAL INPUT '%c' (%d)\n",
+                                res, res);
+                }
+                yari->rs232in_pending = 0;
+                return res;
+
+        default:
+                if (yari->rs232in_pending > 1) {
+                        if (--yari->rs232in_pending == 1)
+                                ++yari->rs232in_cnt;
+                }
+                idle_poll(2, yari->rs232in_cnt);
+                return yari->rs232in_cnt;
+        }
+}
+
+/*
+ * The program can't go on until status register reg changes (0 for
+ * the output, 2 for the input), see idle.c.  Return the cycles until
+ * it can, waiting for input to arrive if need be, or -1 if we can't
+ * tell.  Waiting on the host counts at serial_clock.
+ */
+int64_t serial_idle(unsigned reg)
+{
+        struct serial *s = serial();
+        struct pollfd p = { .fd = yari->rs232in_fd, .events = POLLIN };
+        struct timeval t0, t1;
+        uint64_t until = yari->TSC;
+        double waited;
+        int n;
+
+        if (reg == 0)
+                return serial_baud_accurate && yari->TSC < yari->rs232out_ready
+                        ? (int64_t) (yari->rs232out_ready - yari->TSC) : -1;
+
+        /* A byte on its way, or no input to ever come */
+        if (yari->rs232in_pending)
+                return 0;
+        if (yari->rs232in_fd < 0)
+                return -1;
+
+        if (serial_baud_accurate && until < yari->rs232in_ready)
+                until = yari->rs232in_ready;
+
+        if (s->in_rp == s->in_wp) {
+                if (until < s->in_next_poll)
+                        until = s->in_next_poll;
+
+                serial_flush();
+                gettimeofday(&t0, NULL);
+                while (poll(&p, 1, -1) < 0 && errno == EINTR)
+                        ;
+                gettimeofday(&t1, NULL);
+
+                n = read(yari->rs232in_fd, s->in, sizeof s->in);
+                if (n <= 0)
+                        return -1;
+                s->in_rp = 0;
+                s->in_wp = n;
+
+                waited = t1.tv_sec - t0.tv_sec + 1e-6 * (t1.tv_usec - t0.tv_usec);
+                if (until < yari->TSC + (uint64_t) (waited * serial_clock))
+                        until = yari->TSC + (uint64_t) (waited * serial_clock);
+        }
+
+        return until - yari->TSC;
+}
+
+/* A store to 0xFF000000 */
+void serial_store(unsigned char ch)
+{
+        struct serial *s;
+
+        if (serial_baud_accurate) {
+                if (yari->TSC < yari->rs232out_ready)
+                        return;
+                yari->rs232out_ready = yari->TSC + serial_char_cycles();
+        }
+
+        yari->serial_wait = 0;
+        if (enable_disass) {
+                fprintf(stderr, "\nSERIAL OUTPUT '%c' (%d)\n",
+                        ch, ch);
+        } else if (yari->echo_serial)
+                putchar(ch);
+
+        if (yari->rs232out_fd < 0)
+                return;
+
+        s = serial();
+        if (s->out_is_tty < 0)
+                s->out_is_tty = isatty(yari->rs232out_fd);
+        s->out[s->out_n++] = ch;
+        if (s->out_n == sizeof s->out || (ch == '\n' && s->out_is_tty))
+                serial_flush();
+}
+
+/*
+ * For the host calls: wait for at least one byte, return 0 at the
+ * end of the input
+ */
+int serial_read(void *buf, unsigned len)
+{
+        struct serial *s = serial();
+        struct pollfd p = { .fd = yari->rs232in_fd, .events = POLLIN };
+        int n;
+
+        if (yari->rs232in_fd < 0)
+                return 0;
+
+        if (s->in_rp != s->in_wp) {
+                n = s->in_wp - s->in_rp;
+                if (n > len)
+                        n = len;
+                memcpy(buf, s->in + s->in_rp, n);
+                s->in_rp += n;
+                return n;
+        }
+
+        serial_flush();
+        for (;;) {
+                n = read(yari->rs232in_fd, buf, len);
+                if (n >= 0 || (errno != EAGAIN && errno != EINTR))
+                        return n;
+                poll(&p, 1, -1);
+        }
+}
+
+int serial_write(const void *buf, unsigned len)
+{
+        serial_flush();
+        if (yari->echo_serial && !enable_disass) {
+                fwrite(buf, 1, len, stdout);
+                fflush(stdout);
+        }
+        if (yari->rs232out_fd >= 0 && write(yari->rs232out_fd, buf, len) < 0)
+                return -1;
+
+        return len;
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
@@ -15,25 +15,19 @@
 #include "mips32.h"
 #include "runmips.h"
 
-int enable_disass     = 0;
-int enable_disass_user= 0; // Enable disass once we reach user code (0x4...)
-int enable_verb_elf   = 0;
-int enable_forwarding = 0;
-int enable_fastbranch = 0;
-int enable_testcases  = 0;
-int enable_regwrites  = 1; // XXX
-int enable_firmware_mode = 0;
-int enable_cosimulation = 0;
 int enable_graphics = 0;
-int enable_register_dump = 0;
 
-int endian_is_big = 0;
-struct timeval stat_start_time, stat_stop_time;
+/* Cache model configuration, zero means the RTL default */
+static unsigned icache_ways, dcache_ways;
+static int icache_policy = CACHE_ROUND_ROBIN, dcache_policy = CACHE_ROUND_ROBIN;
+static int enable_dcache = 0;
 
-void    *memory_segment[NSEGMENT];
-unsigned memory_segment_size[NSEGMENT];
+struct timeval stat_start_time, stat_stop_time;
+static uint64_t stat_start_issue;       // What --restore brought along
 
-unsigned program_entry = 0;
+/* The one machine we simulate */
+static yarisim_t *machine;
+static void (*engine)(MIPS_state_t *);
 static SDL_Surface *screen;
 
 /*
@@ -48,6 +42,25 @@ static SDL_Surface *screen;
 static int run = '1';
 static char *filename = 0;
 
+/* --checkpoint-at stops the run and saves the machine here */
+static char *checkpoint_file = "yarisim.ckpt";
+static int enable_checkpoint = 0;
+static char *restore_file = NULL;
+
+/* --profile writes a gmon.out for gprof here */
+static char *profile_file = NULL;
+
+/* --frames writes <prefix>-NNNNNN.ppm every frame_interval instructions */
+static char *frame_prefix = NULL;
+static uint64_t frame_interval = 10000000;
+static unsigned frame_number;
+
+/* --trace writes a binary instruction trace here, see trace.c */
+static char *trace_file = NULL;
+
+/* --gdb serves the GDB remote protocol on this port, see gdbserver.c */
+static int gdb_port = 0;
+
 
 static struct option long_options[] = {
         {"help",           0, NULL, '?'},
@@ -67,10 +80,43 @@ static struct option long_options[] = {
         {"cosimulation",   0, &enable_cosimulation, 1},
         {"graphics",       0, &enable_graphics, 1},
         {"regdump",       0, &enable_register_dump, 1},
+        {"no-tcache",      0, &enable_tcache, 0},
+        {"no-threaded",    0, &enable_threaded, 0},
+        {"no-dbt",         0, &enable_dbt, 0},      // no x86-64 code for hot blocks
+        {"flat-memory",    0, &enable_flat_memory, 1},
+        {"check-icache",   0, &enable_check_icache, 1},
         {"icache-way-lines-log2",     1, 0, 1000},
         {"icache-words-in-line-log2", 1, 0, 1001},
         {"dcache-way-lines-log2",     1, 0, 1002},
         {"dcache-words-in-line-log2", 1, 0, 1003},
+        {"icache-ways",               1, 0, 1004},
+        {"dcache-ways",               1, 0, 1005},
+        {"icache-policy",             1, 0, 1006}, // lru, rr or random
+        {"dcache-policy",             1, 0, 1007},
+        {"cache-sweep",               0, &enable_cache_sweep, 1},
+        {"timing",         0, &enable_timing, 1},
+        {"commit-trace",   1, 0, 1008}, // binary RTL commit trace
+        {"rtl-command",    1, 0, 1009}, // cosimulate against its output
+        {"rtl-model",      1, 0, 1023}, // verilated core, its data directory
+        {"replay-interval",1, 0, 1024}, // divergence replay checkpoints, default 0 = none
+        {"gdb",            1, 0, 1025}, // GDB remote protocol on this TCP port
+        {"watch",          1, 0, 1026}, // log stores to <address>[,<length>]
+        {"rwatch",         1, 0, 1027}, // log loads
+        {"awatch",         1, 0, 1028}, // log both
+        {"stop-on-watch",  0, &enable_stop_on_watch, 1}, // and stop at the first hit
+        {"checkpoint-at",  1, 0, 1010}, // instruction count or pc=<address>
+        {"checkpoint-file",1, 0, 1011}, // default yarisim.ckpt
+        {"restore",        1, 0, 1012}, // start from a checkpoint
+        {"sample-period",  1, 0, 1013}, // detailed windows every this many
+        {"sample-window",  1, 0, 1014}, // default 1000000
+        {"sample-warmup",  1, 0, 1015}, // default 10000
+        {"profile",        1, 0, 1016}, // flat profile and gmon.out
+        {"serial-timing",  1, 0, 1017}, // ideal (default) or baud
+        {"serial-baud",    1, 0, 1018}, // default 115200
+        {"serial-clock",   1, 0, 1019}, // core clock in Hz, default 48000000
+        {"frames",         1, 0, 1020}, // headless, dump the framebuffer as PPM
+        {"frame-interval", 1, 0, 1021}, // instructions, default 10000000
+        {"trace",          1, 0, 1022}, // binary trace, .zst or .lz4 compressed
         // {"file",        1, 0, 'f'}, // 1 = required arg
         // {"serial_in",   1, 0, 'i'}, // 1 = required arg
         // {"serial_out",  1, 0, 'o'}, // 1 = required arg
@@ -103,6 +149,10 @@ void usage(char *program)
                 "  -i serialtty/file\n"
                 "  -s serialtty/file\n"
                 "\n"
+                "  --replay-interval=N makes --cosim fork a copy of the simulator every\n"
+                "  N instructions, to trace the run up to a divergence from the last\n"
+                "  copy.  Off by default, as forking costs; try 100000000.\n"
+                "\n"
                 "Comments to <tommy-git@thorn.ws>\n");
 
         exit(1);
@@ -110,54 +160,166 @@ void usage(char *program)
 
 void print_stats(void)
 {
+        /* We may be exiting from another thread */
+        yari = machine;
+        serial_flush();
+
+        tc_fold_stats();
+        print_coverage();
+
         gettimeofday(&stat_stop_time, NULL);
 
         double delta = stat_stop_time.tv_sec - stat_start_time.tv_sec
                 + 1e-6 * (stat_stop_time.tv_usec - stat_start_time.tv_usec);
 
+        uint64_t n = yari->n_issue - stat_start_issue;
+
         putchar('\n');
-        printf("Simulation of %llu instructions in %4.2fs ~= %4.6f MIPS \n",
-               n_issue, delta, n_issue / (1e6 * delta));
+        if (stat_start_issue)
+                printf("Simulation of %llu instructions (after %llu restored) in %4.2fs ~= %4.6f MIPS \n",
+                       (long long unsigned) n, (long long unsigned) stat_start_issue,
+                       delta, n / (1e6 * delta));
+        else
+                printf("Simulation of %llu instructions in %4.2fs ~= %4.6f MIPS \n",
+                       (long long unsigned) n, delta, n / (1e6 * delta));
 
         // printf("%4.2f%% jal\n", 100.0 * n_call / n_issue);
-        printf("I$ %llu hits / %llu misses = %4.2f%% miss rate\n",
-               n_icache_hits, n_icache_misses,
-               100.0 * n_icache_misses / (n_icache_hits + n_icache_misses));
+        cache_print(&yari->icache);
+        if (yari->dcache.tag)
+                cache_print(&yari->dcache);
+        if (enable_cache_sweep) {
+                cache_sweep_print(&yari->icache_sweep);
+                cache_sweep_print(&yari->dcache_sweep);
+        }
+        if (sample_period)
+                sample_print();
+        else if (enable_timing)
+                timing_print();
+        if (profile_file) {
+                profile_print();
+                profile_write_gmon(profile_file);
+        }
+        trace_close();
+
+        if (yari->n_tc_blocks)
+                printf("Translation cache: %llu blocks translated (%llu to host code), %llu flushes\n",
+                       yari->n_tc_blocks, yari->n_dbt_blocks, yari->n_tc_flushes);
+
+        if (yari->n_idle)
+                printf("Idle: %llu cycles skipped\n",
+                       (long long unsigned) yari->n_idle);
 
         if (enable_cosimulation) {
                 double freq = 25.0;
 
-                printf("RTL stalls %llu\n", n_stall);
-                printf("RTL CPI: %4.2f  ", (double) n_cycle / (double) n_issue);
+                printf("RTL stalls %llu\n", yari->n_stall);
+                printf("RTL CPI: %4.2f  ", (double) yari->n_cycle / (double) yari->n_issue);
                 printf("Cosim speed %4.2fX slower than realtime (assuming %g MHz)\n",
-                       freq * 1e6 / (n_cycle / delta), freq);
+                       freq * 1e6 / (yari->n_cycle / delta), freq);
         }
 
-        printf("Gen load hazards:     %12"PRIu64" (%5.2f%%)\n", stat_gen_load_hazard,
-                stat_gen_load_hazard * 100.0 / n_issue);
+#if HAZARD_STATS
+        printf("Gen load hazards:     %12"PRIu64" (%5.2f%%)\n", yari->stat_gen_load_hazard,
+                yari->stat_gen_load_hazard * 100.0 / yari->n_issue);
 
-        printf("Load use hazards, rs: %12"PRIu64" (%5.2f%%)\n", stat_load_use_hazard_rs,
-               stat_load_use_hazard_rs * 100.0 / n_issue);
+        printf("Load use hazards, rs: %12"PRIu64" (%5.2f%%)\n", yari->stat_load_use_hazard_rs,
+               yari->stat_load_use_hazard_rs * 100.0 / yari->n_issue);
 
-        printf("                  rt: %12"PRIu64" (%5.2f%%)\n", stat_load_use_hazard_rt,
-               stat_load_use_hazard_rt * 100.0 / n_issue);
+        printf("                  rt: %12"PRIu64" (%5.2f%%)\n", yari->stat_load_use_hazard_rt,
+               yari->stat_load_use_hazard_rt * 100.0 / yari->n_issue);
 
-        printf("LW use hazards:       %12"PRIu64" (%5.2f%%)\n", stat_load32_use_hazard,
-               stat_load32_use_hazard * 100.0 / n_issue);
-        printf("Shift use hazards:    %12"PRIu64" (%5.2f%%)\n", stat_shift_use_hazard,
-               stat_shift_use_hazard  * 100.0 / n_issue);
-        printf("Nops:                 %12"PRIu64" (%5.2f%%)\n", stat_nop,
-               stat_nop * 100.0 / n_issue);
-        printf("Nops in delay slots:  %12"PRIu64" (%5.2f%%)\n", stat_nop_delay_slots,
-               stat_nop_delay_slots * 100.0 / n_issue);
+        printf("LW use hazards:       %12"PRIu64" (%5.2f%%)\n", yari->stat_load32_use_hazard,
+               yari->stat_load32_use_hazard * 100.0 / yari->n_issue);
+        printf("Shift use hazards:    %12"PRIu64" (%5.2f%%)\n", yari->stat_shift_use_hazard,
+               yari->stat_shift_use_hazard  * 100.0 / yari->n_issue);
+        printf("Nops:                 %12"PRIu64" (%5.2f%%)\n", yari->stat_nop,
+               yari->stat_nop * 100.0 / yari->n_issue);
+        printf("Nops in delay slots:  %12"PRIu64" (%5.2f%%)\n", yari->stat_nop_delay_slots,
+               yari->stat_nop_delay_slots * 100.0 / yari->n_issue);
         printf("Nops after loads that aren't needed:\n"
-               "                      %12"PRIu64" (%5.2f%%)\n", stat_nop_useless,
-               stat_nop_useless * 100.0 / n_issue);
+               "                      %12"PRIu64" (%5.2f%%)\n", yari->stat_nop_useless,
+               yari->stat_nop_useless * 100.0 / yari->n_issue);
+#endif
+}
+
+/* RGB332, as the VGA DAC */
+static void rgb332(unsigned i, uint8_t rgb[3])
+{
+        rgb[0] = (i >> 5) * (255 / 7.0);
+        rgb[1] = ((i >> 2) & 7) * (255 / 7.0);
+        rgb[2] = (i & 3) * (255 / 3.0);
+}
+
+/*
+ * Copy the scanlines written since the last update to the screen and
+ * update a rectangle per run of them.  A store racing with this sets
+ * its line again and gets picked up next time.
+ */
+static void update_screen(void)
+{
+        static SDL_Rect rects[FB_HEIGHT / 2];
+        uint32_t dirty[FB_HEIGHT / 32];
+        uint8_t *fb = addr2phys(yari->framebuffer_start);
+        int n = 0, start = -1, y, w;
+
+        for (w = 0; w < FB_HEIGHT / 32; ++w)
+                dirty[w] = __atomic_exchange_n(&yari->framebuffer_dirty[w], 0,
+                                               __ATOMIC_RELAXED);
+
+        for (y = 0; y <= FB_HEIGHT; ++y) {
+                int is_dirty = y < FB_HEIGHT && (dirty[y / 32] >> (y % 32) & 1);
+
+                if (is_dirty && start < 0)
+                        start = y;
+                else if (!is_dirty && start >= 0) {
+                        rects[n].x = 0;
+                        rects[n].y = start;
+                        rects[n].w = FB_WIDTH;
+                        rects[n].h = y - start;
+                        ++n;
+                        for (; start < y; ++start)
+                                memcpy((uint8_t *) screen->pixels + start * screen->pitch,
+                                       fb + start * FB_WIDTH, FB_WIDTH);
+                        start = -1;
+                }
+        }
+
+        if (n)
+                SDL_UpdateRects(screen, n, rects);
+}
+
+/* Write the framebuffer as <prefix>-NNNNNN.ppm */
+static void write_frame(void)
+{
+        static uint8_t rgb[FB_WIDTH * FB_HEIGHT * 3];
+        uint8_t *fb = addr2phys(yari->framebuffer_start);
+        char name[1024];
+        FILE *f;
+        int i;
+
+        snprintf(name, sizeof name, "%s-%06u.ppm", frame_prefix, frame_number++);
+        f = fopen(name, "wb");
+        if (!f)
+                fatal("Can't write the frame %s\n", name);
+
+        memset(yari->framebuffer_dirty, 0, sizeof yari->framebuffer_dirty);
+        for (i = 0; i < FB_WIDTH * FB_HEIGHT; ++i)
+                rgb332(fb[i], rgb + 3 * i);
+
+        fprintf(f, "P6\n%d %d\n255\n", FB_WIDTH, FB_HEIGHT);
+        if (fwrite(rgb, sizeof rgb, 1, f) != 1 || fclose(f))
+                fatal("Can't write the frame %s\n", name);
+}
+
+/* The program may exit() in the middle of an interval */
+static void write_last_frame(void)
+{
+        if (!yari->segfault)
+                write_frame();
 }
 
 void mainloop(void)
 {
-        unsigned last_generation = 0;
 
         for (;;) {
                 SDL_Event event;
@@ -177,16 +339,16 @@ void mainloop(void)
                                 //printf("Key down: %s\n", SDL_GetKeyName(event.key.keysym.sym));
                                 switch (event.key.keysym.sym) {
                                 case SDLK_ESCAPE: return;
-                                case SDLK_0: keys |= 1 << 0; break;
-                                case SDLK_1: keys |= 1 << 1; break;
-                                case SDLK_2: keys |= 1 << 2; break;
-                                case SDLK_3: keys |= 1 << 3; break;
-                                case SDLK_4: keys |= 1 << 4; break;
-                                case SDLK_5: keys |= 1 << 5; break;
-                                case SDLK_6: keys |= 1 << 6; break;
-                                case SDLK_7: keys |= 1 << 7; break;
-                                case SDLK_8: keys |= 1 << 8; break;
-                                case SDLK_9: keys |= 1 << 9; break;
+                                case SDLK_0: yari->keys |= 1 << 0; break;
+                                case SDLK_1: yari->keys |= 1 << 1; break;
+                                case SDLK_2: yari->keys |= 1 << 2; break;
+                                case SDLK_3: yari->keys |= 1 << 3; break;
+                                case SDLK_4: yari->keys |= 1 << 4; break;
+                                case SDLK_5: yari->keys |= 1 << 5; break;
+                                case SDLK_6: yari->keys |= 1 << 6; break;
+                                case SDLK_7: yari->keys |= 1 << 7; break;
+                                case SDLK_8: yari->keys |= 1 << 8; break;
+                                case SDLK_9: yari->keys |= 1 << 9; break;
                                 default: break;
                                 }
                                 break;
@@ -194,16 +356,16 @@ void mainloop(void)
                                 //printf("Key down: %s\n", SDL_GetKeyName(event.key.keysym.sym));
                                 switch (event.key.keysym.sym) {
                                 case SDLK_ESCAPE: return;
-                                case SDLK_0: keys &= ~(1 << 0); break;
-                                case SDLK_1: keys &= ~(1 << 1); break;
-                                case SDLK_2: keys &= ~(1 << 2); break;
-                                case SDLK_3: keys &= ~(1 << 3); break;
-                                case SDLK_4: keys &= ~(1 << 4); break;
-                                case SDLK_5: keys &= ~(1 << 5); break;
-                                case SDLK_6: keys &= ~(1 << 6); break;
-                                case SDLK_7: keys &= ~(1 << 7); break;
-                                case SDLK_8: keys &= ~(1 << 8); break;
-                                case SDLK_9: keys &= ~(1 << 9); break;
+                                case SDLK_0: yari->keys &= ~(1 << 0); break;
+                                case SDLK_1: yari->keys &= ~(1 << 1); break;
+                                case SDLK_2: yari->keys &= ~(1 << 2); break;
+                                case SDLK_3: yari->keys &= ~(1 << 3); break;
+                                case SDLK_4: yari->keys &= ~(1 << 4); break;
+                                case SDLK_5: yari->keys &= ~(1 << 5); break;
+                                case SDLK_6: yari->keys &= ~(1 << 6); break;
+                                case SDLK_7: yari->keys &= ~(1 << 7); break;
+                                case SDLK_8: yari->keys &= ~(1 << 8); break;
+                                case SDLK_9: yari->keys &= ~(1 << 9); break;
                                 default: break;
                                 }
                                 break;
@@ -216,25 +378,113 @@ void mainloop(void)
                         }
                 }
 
-                /* Only update the screen if the framebuffer has been written
-                   since last update */
-                if (last_generation != framebuffer_generation) {
-                        last_generation = framebuffer_generation;
-                        memcpy(screen->pixels, addr2phys(framebuffer_start),
-                               framebuffer_size);
+                update_screen();
 
-                        SDL_UpdateRect(screen, 0, 0, screen->w, screen->h);
-                        // SDL_Flip(screen); either seem to work
+                SDL_Delay(1000 / 30); // 30 fps
+        }
+}
+
+/* Whether --stop-on-watch stopped the engine, rather than its budget */
+static int stopped_on_watch(void)
+{
+        uint32_t address;
+        int kind;
+
+        if (!yari->watch_map || !watch_stopped(&address, &kind))
+                return 0;
+
+        printf("Stopped by the watchpoint at %08x\n", address);
+        return 1;
+}
+
+/*
+ * The engines only return when asked to stop (or on an access
+ * violation), which is where the checkpoint is taken.
+ */
+static void run_machine(void)
+{
+        sigjmp_buf bail;
+        int r;
+
+        if (gdb_port) {
+                gdb_serve(gdb_port);
+                return;
+        }
+
+        yari->bail = &bail;
+        r = sigsetjmp(bail, 1);
+        if (r) {
+                yari->bail = NULL;
+                flat_segv_report();
+                if (r == 2) {
+                        printf("%s", yari->error);
+                        exit(1);
                 }
+                exit(yari->exit_status);
+        }
 
-                SDL_Delay(1000 / 30); // 30 fps
+        /* --frames stops every interval for a frame */
+        while (frame_prefix && !yari->segfault) {
+                yari->stop_issue = yari->n_issue + frame_interval;
+                engine(&yari->state);
+                if (yari->n_issue < yari->stop_issue || stopped_on_watch()) {
+                        yari->bail = NULL;
+                        return;
+                }
+                write_frame();
+        }
+
+        engine(&yari->state);
+
+        yari->bail = NULL;
+
+        if (stopped_on_watch())
+                return;
+
+        if (enable_checkpoint && !yari->segfault) {
+                checkpoint_save(checkpoint_file);
+                exit(0);
         }
 }
 
+/* The engine runs in its own thread when we have a screen to update */
+static int run_engine(void *context)
+{
+        yari = context;
+        run_machine();
+        return 0;
+}
+
+static void checkpoint_at(const char *arg)
+{
+        enable_checkpoint = 1;
+        if (strncmp(arg, "pc=", 3) == 0)
+                yari->stop_pc = strtoul(arg + 3, NULL, 0);
+        else
+                yari->stop_issue = strtoull(arg, NULL, 0);
+}
+
+static void watch_at(const char *arg, int kind)
+{
+        char *end;
+        uint32_t address = strtoul(arg, &end, 0), len = 4;
+
+        if (*end == ',')
+                len = strtoul(end + 1, &end, 0);
+        if (*end || watch_insert(address, len, kind, 0))
+                fatal("Bad or too many watchpoints at %s\n", arg);
+}
+
+static void start_framebuffer(void)
+{
+        yari->framebuffer_start = 0x40000000 + 1024*1024;
+        yari->framebuffer_size  = FB_WIDTH * FB_HEIGHT;
+        memset(yari->framebuffer_dirty, 0xff, sizeof yari->framebuffer_dirty);
+}
+
 void start_sdl(void)
 {
-        framebuffer_start = 0x40000000 + 1024*1024;
-        framebuffer_size  = 1024*768;
+        start_framebuffer();
 
         if (SDL_Init(SDL_INIT_VIDEO) < 0) {
                 fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
@@ -243,7 +493,7 @@ void start_sdl(void)
 
         atexit(SDL_Quit);
 
-        screen = SDL_SetVideoMode(1024, 768, 8, SDL_SWSURFACE);
+        screen = SDL_SetVideoMode(FB_WIDTH, FB_HEIGHT, 8, SDL_SWSURFACE);
         if (screen == NULL) {
                 fprintf(stderr, "Unable to set video: %s\n", SDL_GetError());
                 return;
@@ -258,9 +508,12 @@ void start_sdl(void)
 
         /* Fill colors with color information RGB332 */
         for (i = 0; i < 256; ++i) {
-                colors[i].r = (i >> 5) * (255 / 7.0);
-                colors[i].g = ((i >> 2) & 7) * (255 / 7.0);
-                colors[i].b = (i & 3) * (255 / 3.0);
+                uint8_t rgb[3];
+
+                rgb332(i, rgb);
+                colors[i].r = rgb[0];
+                colors[i].g = rgb[1];
+                colors[i].b = rgb[2];
         }
 
         /* Set palette */
@@ -272,6 +525,39 @@ void start_sdl(void)
         }
 }
 
+/*
+ * Build the cache models from the command line.  The defaults match
+ * the RTL: 8 KiB 4-way with 16 B lines and round-robin replacement.
+ * The D$ is only modeled when asked for as it slows down every load
+ * and store.  --cache-sweep and --timing need the D$ too; the sweep
+ * piggybacks on the I$ and D$ address streams and uses their line
+ * sizes.
+ */
+static void
+init_caches(void)
+{
+        if (enable_cache_sweep || enable_timing)
+                enable_dcache = 1;
+
+        cache_init(&yari->icache, "I$",
+                   icache_ways ? icache_ways : 4,
+                   icache_way_lines_log2 ? icache_way_lines_log2 : 7,
+                   (icache_words_in_line_log2 ? icache_words_in_line_log2 : 2) + 2,
+                   icache_policy, 1);
+
+        if (enable_dcache)
+                cache_init(&yari->dcache, "D$",
+                           dcache_ways ? dcache_ways : 4,
+                           dcache_way_lines_log2 ? dcache_way_lines_log2 : 7,
+                           (dcache_words_in_line_log2 ? dcache_words_in_line_log2 : 2) + 2,
+                           dcache_policy, 0);
+
+        if (enable_cache_sweep) {
+                cache_sweep_init(&yari->icache_sweep, "I$", yari->icache.line_log2);
+                cache_sweep_init(&yari->dcache_sweep, "D$", yari->dcache.line_log2);
+        }
+}
+
 static void
 dump_cache_init_files(void)
 {
@@ -324,7 +610,7 @@ dump_cache_init_files(void)
                dcache_size / 1024, 1 << dcache_way_lines_log2, dcache_line_size);
 
         /* I$ data */
-        for (way = 0, start = text_start; way < 4; ++way, start += icache_way_size) {
+        for (way = 0, start = yari->text_start; way < 4; ++way, start += icache_way_size) {
                 snprintf(filename, sizeof filename, "icache_ram%d.%s", way, ext);
                 dump(filename, run, 32, NULL, start, icache_way_size);
         }
@@ -342,8 +628,8 @@ dump_cache_init_files(void)
         /* This is the tricky part: the tag identifies
            the non-index part of the physical address,
            thus all but the way index */
-        tag = text_start >> (2 + icache_words_in_line_log2 + icache_way_lines_log2);
-        for (way = 0, start = text_start; way < 4; ++way, start += icache_line_size * 4, ++tag) {
+        tag = yari->text_start >> (2 + icache_words_in_line_log2 + icache_way_lines_log2);
+        for (way = 0, start = yari->text_start; way < 4; ++way, start += icache_line_size * 4, ++tag) {
                 for (i = 0; i < 1 << icache_way_lines_log2; ++i)
                         tags[i] = tag;
                 snprintf(filename, sizeof filename, "icache_tag%d.%s", way, ext);
@@ -375,10 +661,10 @@ dump_cache_init_files(void)
 
 int main(int argc, char **argv)
 {
-        /* The Global MIPS State */
-        MIPS_state_t mips_state;
+        yari = machine = sim_new();
+        if (!machine)
+                fatal("Out of memory\n");
 
-        rs232in_fd = rs232out_fd = -1;
         char *serial_input_file = NULL;
         char *serial_output_file = NULL;
 
@@ -407,18 +693,74 @@ int main(int argc, char **argv)
 
                 case 1000: icache_way_lines_log2     = atoi(optarg); break;
                 case 1001: icache_words_in_line_log2 = atoi(optarg); break;
-                case 1002: dcache_way_lines_log2     = atoi(optarg); break;
-                case 1003: dcache_words_in_line_log2 = atoi(optarg); break;
+                case 1002: dcache_way_lines_log2     = atoi(optarg); enable_dcache = 1; break;
+                case 1003: dcache_words_in_line_log2 = atoi(optarg); enable_dcache = 1; break;
+                case 1004: icache_ways   = atoi(optarg); break;
+                case 1005: dcache_ways   = atoi(optarg); enable_dcache = 1; break;
+                case 1006: icache_policy = cache_policy(optarg); break;
+                case 1007: dcache_policy = cache_policy(optarg); enable_dcache = 1; break;
+                case 1008: cosim_open_trace(optarg); break;
+                case 1009: cosim_spawn_rtl(optarg); break;
+                case 1010: checkpoint_at(optarg); break;
+                case 1011: checkpoint_file = optarg; break;
+                case 1012: restore_file = optarg; break;
+                case 1013: sample_period = strtoull(optarg, NULL, 0); break;
+                case 1014: sample_window = strtoull(optarg, NULL, 0); break;
+                case 1015: sample_warmup = strtoull(optarg, NULL, 0); break;
+                case 1016: profile_file = optarg; profile_start(); break;
+                case 1017:
+                        if (strcmp(optarg, "ideal") && strcmp(optarg, "baud"))
+                                fatal("--serial-timing is ideal or baud\n");
+                        serial_baud_accurate = strcmp(optarg, "baud") == 0;
+                        break;
+                case 1018: serial_baud  = strtoul(optarg, NULL, 0); break;
+                case 1019: serial_clock = strtoul(optarg, NULL, 0); break;
+                case 1020: frame_prefix = optarg; break;
+                case 1021: frame_interval = strtoull(optarg, NULL, 0); break;
+                case 1022: trace_file = optarg; break;
+                case 1023: cosim_open_model(optarg); break;
+                case 1024: cosim_interval = strtoull(optarg, NULL, 0); break;
+                case 1025: gdb_port = atoi(optarg); break;
+                case 1026: watch_at(optarg, WATCH_WRITE); break;
+                case 1027: watch_at(optarg, WATCH_READ); break;
+                case 1028: watch_at(optarg, WATCH_ACCESS); break;
 
                 default:
                         printf ("?? getopt returned character code 0%o ??\n", c);
                 }
         }
 
-        if (optind >= argc) {
+        if (optind >= argc && !restore_file) {
                 usage(argv[0]);
         }
 
+        if (!serial_baud || serial_clock < 10 * serial_baud)
+                fatal("The serial port can't be faster than the clock\n");
+
+        if (sample_period && (!sample_window ||
+                              sample_period < sample_warmup + sample_window))
+                fatal("The sample period must cover the warm-up and the window\n");
+
+        if (frame_prefix && (!frame_interval || sample_period || enable_checkpoint))
+                fatal("--frames needs a non-zero --frame-interval and "
+                      "doesn't combine with sampling or --checkpoint-at\n");
+
+        if (sample_period && enable_checkpoint)
+                fatal("--checkpoint-at doesn't combine with sampling\n");
+
+        if (trace_file && (sample_period || enable_checkpoint))
+                fatal("--trace needs the interpreter throughout, "
+                      "not sampling or --checkpoint-at\n");
+
+        if (gdb_port && (sample_period || enable_checkpoint || frame_prefix ||
+                         enable_cosimulation || trace_file))
+                fatal("--gdb runs the program itself, without sampling, "
+                      "checkpoints, frames, cosimulation or tracing\n");
+
+        if (optind < argc && restore_file)
+                fatal("--restore takes the program from the checkpoint, not %s\n",
+                      argv[optind]);
+
         while (optind < argc) {
                 readelf(argv[optind++]);
         }
@@ -428,18 +770,18 @@ int main(int argc, char **argv)
 
         if (serial_input_file) {
                 printf("serial input %s\n", serial_input_file);
-                rs232in_fd = open(serial_input_file, (is_bidir ? O_RDWR : O_RDONLY) | O_NONBLOCK);
-                if (rs232in_fd < 0)
+                yari->rs232in_fd = open(serial_input_file, (is_bidir ? O_RDWR : O_RDONLY) | O_NONBLOCK);
+                if (yari->rs232in_fd < 0)
                         perror(optarg), exit(1);
 
                 {
                         /* Turn off echo */
                         struct termios t;
-                        if (tcgetattr(rs232in_fd, &t))
+                        if (tcgetattr(yari->rs232in_fd, &t))
                                 /*perror("getattr")*/;
                         else {
                                 t.c_lflag &= ~(ECHO|ECHOE|ECHOK);
-                                if (tcsetattr(rs232in_fd, TCSANOW, &t))
+                                if (tcsetattr(yari->rs232in_fd, TCSANOW, &t))
                                         perror("setattr");
                         }
                 }
@@ -447,31 +789,74 @@ int main(int argc, char **argv)
 
         if (serial_output_file && !is_bidir) {
                 printf("serial output %s\n", serial_output_file);
-                rs232out_fd = open(serial_output_file, O_WRONLY | O_NONBLOCK);
-                if (rs232out_fd < 0)
+                yari->rs232out_fd = open(serial_output_file, O_WRONLY | O_NONBLOCK);
+                if (yari->rs232out_fd < 0)
                         perror(optarg), exit(1);
         }
 
         if (is_bidir)
-                rs232out_fd = rs232in_fd;
+                yari->rs232out_fd = yari->rs232in_fd;
 
         gettimeofday(&stat_start_time, NULL);
 
         switch (run) {
-        case '1':
-                if (enable_graphics)
+        case '1': {
+                /*
+                 * Only the reference interpreter can do per instruction
+                 * tracing and timing
+                 */
+                engine = run_simple;
+
+                /* Sampling takes the timing model, for the windows */
+                if (sample_period)
+                        enable_timing = 1;
+
+                if (!enable_disass && !enable_disass_user &&
+                    !enable_cosimulation && !enable_register_dump &&
+                    !enable_timing && !trace_file) {
+                        if (enable_tcache)
+                                engine = run_tcache;
+                        else if (enable_threaded && !profile_file)
+                                engine = run_threaded;
+                }
+
+                if (sample_period)
+                        engine = run_sampled;
+
+                /* The threaded engine doesn't stop for frames, checkpoints or watchpoints */
+                if ((frame_prefix || enable_checkpoint || enable_stop_on_watch) &&
+                    engine == run_threaded)
+                        engine = run_simple;
+
+                init_caches();
+                if (trace_file)
+                        trace_start(trace_file);
+                if (restore_file) {
+                        checkpoint_restore(restore_file);
+                        stat_start_issue = yari->n_issue;
+                } else {
+                        reset_mips_state(&yari->state);
+                        yari->state.pc = yari->program_entry;
+                }
+                if (enable_cosimulation)
+                        cosim_start();
+                if (enable_graphics && !frame_prefix)
                         start_sdl();
+                else if (frame_prefix)
+                        start_framebuffer();
                 atexit(print_stats);
+                if (frame_prefix)
+                        atexit(write_last_frame);
                 signal(SIGINT, exit);
-                mips_state.pc = program_entry;
                 init_reg_use_map();
 
                 if (screen) {
-                        SDL_CreateThread((int (*)(void *))run_simple, &mips_state);
+                        SDL_CreateThread(run_engine, machine);
                         mainloop();
                 } else
-                        run_simple(&mips_state);
+                        run_machine();
                 break;
+        }
 
         case 'b':
         case 'r':
@@ -491,11 +876,11 @@ int main(int argc, char **argv)
 
         if (enable_testcases) {
                 printf("Test ");
-                if (mips_state.r[7] == 0x1729) {
+                if (yari->state.r[7] == 0x1729) {
                         printf("SUCCEED!\n");
                         exit(0);
                 } else {
-                        printf("FAILED!  r7 = 0x%08x != 0x1729\n", mips_state.r[7]);
+                        printf("FAILED!  r7 = 0x%08x != 0x1729\n", yari->state.r[7]);
                         exit(1);
                 }
         }
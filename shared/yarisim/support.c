@@ -2,54 +2,212 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <signal.h>
 #include "elf.h"
 #include <getopt.h>
 #include "mips32.h"
 #include "runmips.h"
 #include <ctype.h>
+#include <errno.h>
 
-unsigned text_start = ~0;
-unsigned text_size  = 0;
 unsigned mif_size = 16384;
-int serial_wait = 0;
-int rs232in_fd, rs232out_fd;
-unsigned rs232in_data    = 0;
-unsigned char rs232in_cnt = 0;
-unsigned rs232in_pending = 0; // last one is simulation only
 
-unsigned nsections = 0;
-unsigned section_start[99];
-unsigned section_size[99];
-static int text_segments = 0;
+/* The command line configuration, shared by all machines */
+int enable_disass     = 0;
+int enable_disass_user= 0; // Enable disass once we reach user code (0x4...)
+int enable_verb_elf   = 0;
+int enable_forwarding = 0;
+int enable_fastbranch = 0;
+int enable_testcases  = 0;
+int enable_regwrites  = 1; // XXX
+int enable_firmware_mode = 0;
+int enable_cosimulation = 0;
+int enable_register_dump = 0;
+int enable_tcache = 1;
+int enable_threaded = 1;
+int enable_dbt = 1;
+int enable_flat_memory = 0;
+int enable_check_icache = 0;
+int enable_cache_sweep = 0;
+int enable_timing = 0;
+int enable_stop_on_watch = 0;
+
+// Cache parameters in words log2, see runmips.h
+uint32_t icache_way_lines_log2, icache_words_in_line_log2;
+uint32_t dcache_way_lines_log2, dcache_words_in_line_log2;
+
+__thread yarisim_t *yari;
+
+#define H(x) (yari->endian_is_big ? ntohs(x) : x)
+#define W(x) (yari->endian_is_big ? ntohl(x) : x)
 
-extern unsigned TSC;
+/*
+ * A new machine with nothing loaded yet.  The tcache's code map
+ * covers the whole address space but is only touched where code is
+ * translated, so it's left to the host to zero fill lazily.
+ */
+yarisim_t *sim_new(void)
+{
+        yarisim_t *y = calloc(1, sizeof *y);
+
+        if (!y)
+                return NULL;
 
-#define H(x) (endian_is_big ? ntohs(x) : x)
-#define W(x) (endian_is_big ? ntohl(x) : x)
+        y->tc_code_map = calloc(1 << (32 - TC_GRANULE_BITS - 5), sizeof y->tc_code_map[0]);
+        if (!y->tc_code_map) {
+                free(y);
+                return NULL;
+        }
+
+        y->text_start  = ~0;
+        y->rs232in_fd  = y->rs232out_fd = -1;
+        y->echo_serial = 1;
+        y->stop_issue  = ~0ULL;
+        y->stop_pc     = ~0;
+
+        return y;
+}
 
-void service_rs232(void)
+void sim_free(yarisim_t *y)
 {
-        /*
-         * Check the serial port and update rs232in_data and
-         * rs232in_cnt accordingly.
-         */
-        if (rs232in_fd >= 0 && !rs232in_pending) {
-                char ch;
-                int count = read(rs232in_fd, &ch, 1);
-                if (count == 1) {
-                        rs232in_pending = 3; // Minimum 2
-                        rs232in_data = ch;
-                }
+        int k;
+
+        if (y->flat_memory)
+                munmap(y->flat_memory, 1ULL << 32);
+        for (k = 0; k < NSEGMENT; ++k)
+                free(y->memory_segment[k]);
+        cache_free(&y->icache);
+        cache_free(&y->dcache);
+        cache_sweep_free(&y->icache_sweep);
+        cache_sweep_free(&y->dcache_sweep);
+        tc_free_all(y);
+        free(y->timing);
+        free(y->sampling);
+        profile_free(y);
+        hostcall_free(y);
+        serial_free(y);
+        trace_free(y);
+        idle_free(y);
+        gdb_free(y);
+        watch_free(y);
+        for (k = 0; k < y->nsymbols; ++k)
+                free((char *) y->symbols[k].name);
+        free(y->symbols);
+        free(y->tc_code_map);
+        free(y);
+}
+
+void sim_exit(int status)
+{
+        serial_flush();
+        if (yari && yari->bail) {
+                yari->exit_status = status;
+                siglongjmp(*yari->bail, 1);
+        }
+
+        exit(status);
+}
+
+void sim_fatal(const char *fmt, ...)
+{
+        va_list ap;
+
+        serial_flush();
+        va_start(ap, fmt);
+        if (yari && yari->bail) {
+                vsnprintf(yari->error, sizeof yari->error, fmt, ap);
+                va_end(ap);
+                siglongjmp(*yari->bail, 2);
+        }
+
+        vprintf(fmt, ap);
+        va_end(ap);
+        exit(1);
+}
+
+/*
+ * In flat mode, touching unmapped simulation memory below
+ * FLAT_FAST_LIMIT ends up here.  Anything else is a genuine crash.
+ *
+ * Neither stdio nor exit() is safe in a signal handler, so the fault is
+ * only recorded and the run abandoned through yari->bail, whose owner
+ * reports it with flat_segv_report().  Without one there is nobody to
+ * return to, and nothing left to do but _exit().
+ */
+static void flat_segv(int sig, siginfo_t *si, void *ctx)
+{
+        static const char msg[] = "Access violation, execution aborted\n";
+        char *p = si->si_addr;
+
+        if (!yari || p < yari->flat_memory || p >= yari->flat_memory + (1ULL << 32)) {
+                signal(SIGSEGV, SIG_DFL);
+                return;
+        }
+
+        yari->segfault = 1;
+        yari->flat_fault = 1;
+        yari->flat_fault_address = p - yari->flat_memory;
+        if (yari->bail) {
+                yari->exit_status = 1;
+                siglongjmp(*yari->bail, 1);
+        }
+
+        if (write(1, msg, sizeof msg - 1) < 0)
+                _exit(2);
+        _exit(1);
+}
+
+/* Say what flat_segv() couldn't, if anything */
+void flat_segv_report(void)
+{
+        if (!yari->flat_fault)
+                return;
+
+        yari->flat_fault = 0;
+        serial_flush();
+        fprintf(stderr, "Accessing outside memory 0x%08x\n", yari->flat_fault_address);
+        printf("Access violation, execution aborted\n");
+}
+
+static void initialize_flat_memory(void)
+{
+        struct sigaction sa;
+        void *p;
+
+        if (sizeof(void *) < 8) {
+                fprintf(stderr, "--flat-memory needs a 64-bit host, ignored\n");
+                return;
+        }
+
+        p = mmap(NULL, 1ULL << 32, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+                perror("Reserving flat simulation memory");
+                return;
         }
+
+        memset(&sa, 0, sizeof sa);
+        sa.sa_sigaction = flat_segv;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGSEGV, &sa, NULL))
+                perror("sigaction"), exit(1);
+
+        yari->flat_memory = p;
 }
 
 void initialize_memory(void)
 {
         const unsigned megabyte  = 1024 * 1024;
 
+        if (enable_flat_memory)
+                initialize_flat_memory();
+
         // See mymips.ld
         // ensure_mapped_memory_range(0, megabyte); // XXX Don't !
         ensure_mapped_memory_range(0x40000000, megabyte * 2);
@@ -57,15 +215,21 @@ void initialize_memory(void)
         // ensure_mapped_memory_range(0x80000000-megabyte+1, megabyte-1);
         ensure_mapped_memory_range(0xBFC00000, megabyte); // Really only 16KiB
 
+        uint32_t *watch_map = yari->watch_map;
         unsigned p;
         int k;
 
-        // Mimick real memory
+        // Mimick real memory, unseen by the watchpoints
+        yari->watch_map = NULL;
         for (p = 0x40000000, k = megabyte; k > 0; p += 4, k -= 4)
                 store(p, 0xe2e1e2e1, 4);
 
         for (p = 0x40000000, k = megabyte; k > 0; p += 4, k -= 4)
                 assert(load(p, 4, 0) == 0xe2e1e2e1);
+        yari->watch_map = watch_map;
+
+        // That wasn't self-modifying code
+        memset(yari->icache_dirty_map, 0, sizeof yari->icache_dirty_map);
 }
 
 void ensure_mapped_memory_range(unsigned addr, unsigned len)
@@ -76,6 +240,23 @@ void ensure_mapped_memory_range(unsigned addr, unsigned len)
                 printf("Ensure mapped [%08x; %08x]\n", addr, addr + len - 1);
         }
 
+        if (yari->flat_memory) {
+                uint64_t lo = addr & ~((1 << FLAT_PAGE_BITS) - 1);
+                uint64_t hi = (uint64_t) addr + len;
+                uint64_t p;
+
+                hi = (hi + (1 << FLAT_PAGE_BITS) - 1) & ~((1 << FLAT_PAGE_BITS) - 1);
+                if (mprotect(yari->flat_memory + lo, hi - lo, PROT_READ | PROT_WRITE))
+                        fatal("mprotect: %s\n", strerror(errno));
+
+                for (p = lo; p < hi; p += 1 << FLAT_PAGE_BITS)
+                        yari->flat_page_map[p >> (FLAT_PAGE_BITS + 5)] |=
+                                1U << ((p >> FLAT_PAGE_BITS) & 31);
+
+                assert(addr_mapped(addr + len - 1));
+                return;
+        }
+
         // Split it up
         while (segment(addr) != segment(addr + len - 1)) {
                 ensure_mapped_memory_range(addr, (1 << OFFSETBITS) - offset(addr));
@@ -86,20 +267,20 @@ void ensure_mapped_memory_range(unsigned addr, unsigned len)
 
         seg = segment(addr);
         if (!addr_mapped(addr + len - 1)) {
-                memory_segment_size[seg] = 1 + offset(addr + len - 1);
-                memory_segment[seg] =
-                        realloc(memory_segment[seg], memory_segment_size[seg]);
+                yari->memory_segment_size[seg] = 1 + offset(addr + len - 1);
+                yari->memory_segment[seg] =
+                        realloc(yari->memory_segment[seg], yari->memory_segment_size[seg]);
 
                 if (enable_disass) {
                         printf("Segment %2d virt [%08x; %08x] phys [%p; %p]\n",
                                seg,
                                addr, addr + len - 1,
-                               memory_segment[seg],
-                               memory_segment[seg] + memory_segment_size[seg] - 1);
+                               yari->memory_segment[seg],
+                               yari->memory_segment[seg] + yari->memory_segment_size[seg] - 1);
                 }
 
                 // Make sure it's good
-                *(char*)(memory_segment[seg] + memory_segment_size[seg] - 1) = 0;
+                *(char*)(yari->memory_segment[seg] + yari->memory_segment_size[seg] - 1) = 0;
         }
 
         assert(addr_mapped(addr + len - 1));
@@ -107,8 +288,7 @@ void ensure_mapped_memory_range(unsigned addr, unsigned len)
 
 void exception(char *kind)
 {
-        printf("Exception caught: %s\n", kind);
-        exit(1);
+        fatal("Exception caught: %s\n", kind);
 }
 
 void loadsection(FILE *f, unsigned f_offset, unsigned f_len, unsigned m_addr,
@@ -120,9 +300,9 @@ void loadsection(FILE *f, unsigned f_offset, unsigned f_len, unsigned m_addr,
 
         ensure_mapped_memory_range(m_addr, m_len);
 
-        section_start[nsections]  = m_addr;
-        section_size[nsections++] = m_len;
-        assert(nsections < sizeof section_start / sizeof(unsigned));
+        yari->section_start[yari->nsections]  = m_addr;
+        yari->section_size[yari->nsections++] = m_len;
+        assert(yari->nsections < sizeof yari->section_start / sizeof(unsigned));
 
         /*
          * We clear memory so that BBS doesn't need special
@@ -132,13 +312,117 @@ void loadsection(FILE *f, unsigned f_offset, unsigned f_len, unsigned m_addr,
         memset(phys, 0, m_len);
 
         fseek(f, f_offset, SEEK_SET);
-        assert(segment(m_addr) == segment(m_addr + m_len)); // Handle that case later
+        assert(yari->flat_memory ||
+               segment(m_addr) == segment(m_addr + m_len)); // Handle that case later
         fread(addr2phys(m_addr), f_len, 1, f);
 }
 
+static int symbol_order(const void *a, const void *b)
+{
+        const symbol_t *x = a, *y = b;
+
+        return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static int read_section_header(FILE *f, Elf32_Ehdr *ehdr, unsigned k, Elf32_Shdr *sh)
+{
+        return k < H(ehdr->e_shnum) &&
+                fseek(f, W(ehdr->e_shoff) + k * sizeof *sh, SEEK_SET) == 0 &&
+                fread(sh, sizeof *sh, 1, f) == 1;
+}
+
+/*
+ * Add the functions of the symbol table (if not stripped) to the
+ * machine's address sorted symbols.  Assembly entry points are
+ * untyped, so global untyped symbols in code count as functions too.
+ * Symbols without a size extend to the next one.
+ */
+static void read_symbols(FILE *f, Elf32_Ehdr *ehdr, char *name)
+{
+        Elf32_Shdr symtab, strtab, sh;
+        Elf32_Sym *sym = NULL;
+        char *strings = NULL;
+        unsigned i, n;
+
+        for (i = 0; read_section_header(f, ehdr, i, &symtab); ++i)
+                if (W(symtab.sh_type) == SHT_SYMTAB)
+                        break;
+
+        if (i == H(ehdr->e_shnum) ||
+            !read_section_header(f, ehdr, W(symtab.sh_link), &strtab))
+                return;
+
+        n = W(symtab.sh_size) / sizeof *sym;
+        sym = malloc(n * sizeof *sym + 1);
+        strings = malloc(W(strtab.sh_size) + 1);
+        yari->symbols = realloc(yari->symbols,
+                                (yari->nsymbols + n) * sizeof yari->symbols[0] + 1);
+        if (!sym || !strings || !yari->symbols)
+                fatal("Out of memory for the symbols of %s\n", name);
+
+        fseek(f, W(symtab.sh_offset), SEEK_SET);
+        if (n && fread(sym, n * sizeof *sym, 1, f) != 1)
+                fatal("Can't read the symbol table of %s\n", name);
+        fseek(f, W(strtab.sh_offset), SEEK_SET);
+        if (fread(strings, W(strtab.sh_size), 1, f) != 1)
+                fatal("Can't read the string table of %s\n", name);
+        strings[W(strtab.sh_size)] = 0;
+
+        for (i = 0; i < n; ++i) {
+                int type = ELF32_ST_TYPE(sym[i].st_info);
+                unsigned s = W(sym[i].st_name);
+
+                if (!H(sym[i].st_shndx) || s >= W(strtab.sh_size) || !strings[s])
+                        continue;
+                if (type != STT_FUNC &&
+                    (type != STT_NOTYPE || ELF32_ST_BIND(sym[i].st_info) != STB_GLOBAL ||
+                     !read_section_header(f, ehdr, H(sym[i].st_shndx), &sh) ||
+                     !(W(sh.sh_flags) & SHF_EXECINSTR)))
+                        continue;
+
+                yari->symbols[yari->nsymbols].address = W(sym[i].st_value);
+                yari->symbols[yari->nsymbols].size    = W(sym[i].st_size);
+                yari->symbols[yari->nsymbols].name    = strdup(strings + s);
+                ++yari->nsymbols;
+        }
+
+        qsort(yari->symbols, yari->nsymbols, sizeof yari->symbols[0], symbol_order);
+        for (i = 0; i + 1 < yari->nsymbols; ++i)
+                if (!yari->symbols[i].size)
+                        yari->symbols[i].size =
+                                yari->symbols[i + 1].address - yari->symbols[i].address;
+
+        free(strings);
+        free(sym);
+}
+
+/* The function containing address, if any */
+const symbol_t *symbol_lookup(uint32_t address)
+{
+        unsigned lo = 0, hi = yari->nsymbols;
+
+        /* The last symbol at or below address */
+        while (lo < hi) {
+                unsigned mid = (lo + hi) / 2;
+
+                if (yari->symbols[mid].address <= address)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        if (lo == 0)
+                return NULL;
+
+        --lo;
+        if (yari->symbols[lo].size && address - yari->symbols[lo].address >= yari->symbols[lo].size)
+                return NULL;
+
+        return &yari->symbols[lo];
+}
+
 void readelf(char *name)
 {
-        static int memory_is_initialized = 0;
 
         Elf32_Ehdr ehdr;
         Elf32_Phdr *ph;
@@ -156,15 +440,15 @@ void readelf(char *name)
         if (strncmp((char *) ehdr.e_ident, ELFMAG, SELFMAG))
                 fatal("%s is not an ELF file\n", name);
 
-        endian_is_big = ehdr.e_ident[EI_DATA] == 2;
+        yari->endian_is_big = ehdr.e_ident[EI_DATA] == 2;
 
         /*
          * We can't initialize memory until we know the endian,
          * otherwise the RTL view of memory will not match.
          */
-        if (!memory_is_initialized) {
+        if (!yari->memory_is_initialized) {
                 initialize_memory();
-                memory_is_initialized = 1;
+                yari->memory_is_initialized = 1;
         }
 
 
@@ -177,26 +461,22 @@ void readelf(char *name)
 
         if (enable_verb_elf) {
                 printf("%s:\n", name);
-                printf("%sendian\n", endian_is_big ? "big" : "little");
+                printf("%sendian\n", yari->endian_is_big ? "big" : "little");
                 printf("Entry:             %08x\n", W(ehdr.e_entry)); /* Entry point virtual address */
                 printf("Proc Flags:        %08x\n", W(ehdr.e_flags)); /* Processor-specific flags */
                 printf("Phdr.tbl entry cnt % 8d\n", H(ehdr.e_phnum));    /*Program header table entry count */
                 printf("Shdr.tbl entry cnt % 8d\n", H(ehdr.e_shnum));    /*Section header table entry count */
                 printf("Shdr.str tbl idx   % 8d\n", H(ehdr.e_shstrndx)); /*Section header string table index */
         }
-        program_entry = W(ehdr.e_entry);
+        yari->program_entry = W(ehdr.e_entry);
 
-        if (H(ehdr.e_ehsize) != sizeof(ehdr)) {
-                fprintf(stderr, "Oops, I can't handle this Elf header size");
-                exit(1);
-        }
+        if (H(ehdr.e_ehsize) != sizeof(ehdr))
+                fatal("Oops, I can't handle this Elf header size");
 
         phentsize = H(ehdr.e_phentsize);
 
-        if (H(ehdr.e_shentsize) != sizeof(Elf32_Shdr)) {
-                fprintf(stderr, "Oops, I can't handle this Elf section header size");
-                exit(1);
-        }
+        if (H(ehdr.e_shentsize) != sizeof(Elf32_Shdr))
+                fatal("Oops, I can't handle this Elf section header size");
 
         // Allocate program headers
         ph = malloc(sizeof(*ph) * H(ehdr.e_phnum));
@@ -240,9 +520,9 @@ void readelf(char *name)
                 if (W(ph[i].p_flags) & 1) {
                         // XXX I _think_ this means executable, but I
                         // haven't checked!
-                        text_segments++;
-                        text_start = W(ph[i].p_vaddr);
-                        text_size  = W(ph[i].p_memsz);
+                        yari->text_segments++;
+                        yari->text_start = W(ph[i].p_vaddr);
+                        yari->text_size  = W(ph[i].p_memsz);
                 }
         }
 
@@ -270,6 +550,11 @@ void readelf(char *name)
                 }
                 printf(" (now at %lx)\n", ftell(f));
         }
+
+        read_symbols(f, &ehdr, name);
+
+        free(ph);
+        fclose(f);
 }
 
 void dis_load_store(char *buf, char *name, inst_t i)
@@ -468,7 +753,6 @@ void disass(unsigned pc, inst_t i)
         printf("%-24s", buf);
 }
 
-uint32_t vsynccnt = 0;
 
 unsigned load(unsigned a,  // IN: address
               int c,       // IN: count of bytes to load
@@ -476,44 +760,45 @@ unsigned load(unsigned a,  // IN: address
 {
         unsigned res;
 
+        /* The D$ model only sees data, IO space is uncached */
+        if (yari->dcache.tag && !fetch && (a & 0xFF000000) != 0xFF000000) {
+                cache_access(&yari->dcache, a, 1);
+                if (enable_cache_sweep)
+                        cache_sweep_access(&yari->dcache_sweep, a);
+        }
+
+        /* Flat mode fast path, see runmips.h */
+        if (yari->flat_memory && a < FLAT_FAST_LIMIT && !(a & (c - 1)) && !watched(a))
+                switch (c) {
+                case 1: return *(u_int8_t *)(yari->flat_memory + a);
+                case 2: return H(*(u_int16_t*)(yari->flat_memory + a));
+                case 4: return W(*(u_int32_t*)(yari->flat_memory + a));
+                }
+
         /*
          * Handle special load devices.
          * So far we only have a serial output port.
          */
         if (!fetch && (a & 0xFF000000) == 0xFF000000) {
+                ++yari->n_effects;
                 switch ((a >> 2) & 0xFF) {
                 case 0: // rs232out_busy
-                        if (serial_wait) {
-                                serial_wait--;  // Not quite accurate, but ..
-                                res = 1;
-                        } else
-                                res = 0;
-                        break;
-                case 1: res = rs232in_data & 255;
-                        if (enable_disass) {
-                                fprintf(stderr, "\nSERIAL INPUT '%c' (%d)\n",
-                                        res, res);
-                        }
-                        rs232in_pending = 0;
+                case 1: // rs232in_data
+                case 2: // rs232in_tag
+                        res = serial_load((a >> 2) & 0xFF);
                         break;
-                case 2:
-                        if (rs232in_pending > 1) {
-                                if (--rs232in_pending == 1)
-                                        ++rs232in_cnt;
-                        }
-                        res = rs232in_cnt; break;
 
                 case 3:
                         // TSC
-                        res = TSC;
+                        res = yari->TSC;
                         break;
 
                 case 4:
-                        res = keys;
+                        res = yari->keys;
                         break;
 
                 case 5:
-                        res = vsynccnt++;
+                        res = yari->vsynccnt++;
                         break;
 
                 default:
@@ -536,7 +821,7 @@ unsigned load(unsigned a,  // IN: address
         if (!(addr_mapped(a) && addr_mapped(a + c - 1))) {
                 // fatal("Loading from outside memory 0x%08x\n", a);
                 fprintf(stderr, "Loading from outside memory 0x%08x\n", a);
-                segfault = 1;
+                yari->segfault = 1;
                 return 0;
         }
 
@@ -563,6 +848,9 @@ unsigned load(unsigned a,  // IN: address
         default: assert(0);
         }
 
+        if (!fetch && watched(a))
+                watch_load(a, c, res);
+
         if (0 && enable_disass && !fetch)
                 switch (c) {
                 case 1: printf("\t\t\t\t\t%02x <- [%08x]\n",
@@ -584,25 +872,28 @@ void store(unsigned a, unsigned v, int c)
         // XXX debug
         void *phys;
 
+        ++yari->n_effects;
+
+        /*
+         * The D$ is write-through without write-allocate, like the
+         * RTL, so stores only refresh the replacement state of lines
+         * already present and never count as misses.
+         */
+        if (yari->dcache.tag && (a & 0xFF000000) != 0xFF000000)
+                cache_probe(&yari->dcache, a);
+
+        /* Flat mode fast path, see runmips.h */
+        if (yari->flat_memory && a < FLAT_FAST_LIMIT && !(a & (c - 1)) && !watched(a)) {
+                phys = yari->flat_memory + a;
+                goto write;
+        }
+
         /*
          * Handle special load devices.
          * So far we only have a serial output port.
          */
         if (a == 0xFF000000) {
-                unsigned char ch = v;
-                serial_wait = 0;
-                if (enable_disass) {
-                        fprintf(stderr, "\nSERIAL OUTPUT '%c' (%d)\n",
-                                ch, ch);
-                } else {
-                        printf("%c", v);
-                        fflush(stdout);
-                }
-                if (rs232out_fd >= 0) {
-                        // fputc(ch, stderr);
-                        // fprintf(stderr, "SERIAL OUT '%c' (%d)\n", ch, ch);
-                        write(rs232out_fd, &ch, 1);
-                }
+                serial_store(v);
                 return;
         } else if ((a & 0xFF000000) == 0xFF000000 &&
                    a <= 0xFF00002C)
@@ -631,15 +922,25 @@ void store(unsigned a, unsigned v, int c)
                         break;
                 }
 
+        phys = addr2phys(a);
+        if (watched(a))
+                watch_store(a, c, v, c == 1 ? *(u_int8_t *)phys :
+                                     c == 2 ? H(*(u_int16_t*)phys) : W(*(u_int32_t*)phys));
+write:
         switch (c) {
-        case 1: *(u_int8_t *)(phys = addr2phys(a)) = v; break;
-        case 2: *(u_int16_t*)(phys = addr2phys(a)) = H(v); break;
-        case 4: *(u_int32_t*)(phys = addr2phys(a)) = W(v); break;
-        default: exit(1);
+        case 1: *(u_int8_t *)phys = v; break;
+        case 2: *(u_int16_t*)phys = H(v); break;
+        case 4: *(u_int32_t*)phys = W(v); break;
+        default: assert(0);
         }
 
-        if ((unsigned) (a - framebuffer_start) < framebuffer_size)
-                ++framebuffer_generation;
+        icache_note_store(a);
+
+        if ((unsigned) (a - yari->framebuffer_start) < yari->framebuffer_size)
+                framebuffer_note_store(a);
+
+        if (tc_is_code(a))
+                tc_invalidate(a);
 }
 
 static unsigned char
@@ -743,14 +1044,14 @@ void dump_tinymon_old(void)
 
         tinymon_cmd('c', 0);
 
-        for (k = 0; k < nsections; ++k) {
-                tinymon_cmd('l', section_start[k]);
-                unsigned end = section_start[k] + section_size[k];
-                for (p = section_start[k]; p < end; p += 4)
+        for (k = 0; k < yari->nsections; ++k) {
+                tinymon_cmd('l', yari->section_start[k]);
+                unsigned end = yari->section_start[k] + yari->section_size[k];
+                for (p = yari->section_start[k]; p < end; p += 4)
                         tinymon_cmd('w', load(p, 4, 1));
         }
 
-        tinymon_cmd('e', program_entry);
+        tinymon_cmd('e', yari->program_entry);
 }
 
 /*
@@ -788,14 +1089,14 @@ void dump_tinymon(void)
 
         tinymon_cmd('c', 0);
 
-        for (k = 0; k < nsections; ++k) {
+        for (k = 0; k < yari->nsections; ++k) {
                 unsigned w = 0, chk = 0;
-                unsigned end = section_start[k] + section_size[k];
+                unsigned end = yari->section_start[k] + yari->section_size[k];
                 unsigned b;
 
-                tinymon_cmd('l', section_start[k]);
-                tinymon_cmd('x', section_size[k] / 4);
-                for (b = 1, p = section_start[k]; p < end; p += 4, b++) {
+                tinymon_cmd('l', yari->section_start[k]);
+                tinymon_cmd('x', yari->section_size[k] / 4);
+                for (b = 1, p = yari->section_start[k]; p < end; p += 4, b++) {
                         w = load(p, 4, 1);
                         chk += w;
                         tinymon_encode_word_base85(w);
@@ -807,7 +1108,7 @@ void dump_tinymon(void)
                 putchar('\n');
         }
 
-        tinymon_cmd('e', program_entry);
+        tinymon_cmd('e', yari->program_entry);
 }
 
 // Local Variables:
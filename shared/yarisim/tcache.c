@@ -0,0 +1,1169 @@
+/*
+ * Translation cache.
+ *
+ * Rather than fetching and decoding every instruction as it is
+ * executed, as run_simple() does, we decode each guest basic block
+ * once (up to and including the branch delay slot) into an array of
+ * pre-decoded operations, each carrying a pointer to the handler that
+ * implements it.  Blocks are found through a hash table on the guest
+ * PC and are chained to their most recent successors.
+ *
+ * A store to translated code (tracked at TC_GRANULE_BITS granularity)
+ * drops just the blocks holding the word written, which predecessors
+ * then no longer chain to.  The translations are thrown away wholesale
+ * on a SYNCI of translated code or when the arena fills up.  Blocks are decoded from what the I$ would
+ * deliver, and instructions it holds stale (self-modifying code
+ * without SYNCI) are never translated but left to run_simple(), one
+ * at a time, until the line is invalidated or evicted.
+ *
+ * Blocks that get hot (DBT_HOT runs) are further translated to host
+ * code by dbt.c, on x86-64 hosts, unless --no-dbt.
+ *
+ * The semantics mirror run_simple(), which remains the reference
+ * (and is what --verbose, --regdump and --cosimulation use).  Use
+ * --no-tcache --no-threaded to cross-check the two.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include "mips32.h"
+#include "runmips.h"
+#include "tcache.h"
+
+/* Where the hazard counts go in yarisim_t */
+const size_t tc_stat[HZ_N] = {
+        [HZ_NOP]             = offsetof(yarisim_t, stat_nop),
+        [HZ_NOP_DELAY_SLOTS] = offsetof(yarisim_t, stat_nop_delay_slots),
+        [HZ_NOP_USELESS]     = offsetof(yarisim_t, stat_nop_useless),
+        [HZ_GEN_LOAD]        = offsetof(yarisim_t, stat_gen_load_hazard),
+        [HZ_LOAD_USE_RS]     = offsetof(yarisim_t, stat_load_use_hazard_rs),
+        [HZ_LOAD_USE_RT]     = offsetof(yarisim_t, stat_load_use_hazard_rt),
+        [HZ_SHIFT_USE]       = offsetof(yarisim_t, stat_shift_use_hazard),
+};
+
+#define TC_STAT(k) (*(uint64_t *) ((char *) yari + tc_stat[k]))
+
+#define HANDLER(name) static int name(MIPS_state_t *state, const tc_op_t *op)
+
+#define R        state->r
+#define S        R[op->rs]
+#define T        R[op->rt]
+#define ADDR     (S + op->imm)
+
+/* Bring TSC and n_issue up to date for the instruction being executed */
+#define TC_SYNC() (yari->TSC     = yari->tc->tsc_base + op->idx + 1, \
+                   yari->n_issue = yari->tc->issue_base + op->idx)
+
+/* Likewise for the I$ statistics and the profile, before leaving the simulation */
+#define TC_FINISH() (TC_SYNC(), icache_fetch_block(op[-op->idx].pc, op->idx + 1),     \
+                     yari->profile ? profile_block(op[-op->idx].pc, op->idx, 1) : (void) 0)
+
+#define TC_LOADED()  (yari->segfault ? TC_EXIT : TC_NEXT)
+#define TC_STORED()  (yari->tc->invalidated ? TC_EXIT : TC_NEXT)
+
+HANDLER(tc_nop)  { return TC_NEXT; }
+
+/* SPECIAL; the translator only uses these when rd != 0 */
+HANDLER(tc_sll)  { R[op->rd] = T << op->imm; return TC_NEXT; }
+HANDLER(tc_srl)  { R[op->rd] = T >> op->imm; return TC_NEXT; }
+HANDLER(tc_sra)  { R[op->rd] = (int) T >> op->imm; return TC_NEXT; }
+HANDLER(tc_sllv) { R[op->rd] = T << (S & 31); return TC_NEXT; }
+HANDLER(tc_srlv) { R[op->rd] = T >> (S & 31); return TC_NEXT; }
+HANDLER(tc_srav) { R[op->rd] = (int) T >> (S & 31); return TC_NEXT; }
+HANDLER(tc_mfhi) { R[op->rd] = state->hi; return TC_NEXT; }
+HANDLER(tc_mflo) { R[op->rd] = state->lo; return TC_NEXT; }
+HANDLER(tc_addu) { R[op->rd] = S + T; return TC_NEXT; }
+HANDLER(tc_subu) { R[op->rd] = S - T; return TC_NEXT; }
+HANDLER(tc_and)  { R[op->rd] = S & T; return TC_NEXT; }
+HANDLER(tc_or)   { R[op->rd] = S | T; return TC_NEXT; }
+HANDLER(tc_xor)  { R[op->rd] = S ^ T; return TC_NEXT; }
+HANDLER(tc_nor)  { R[op->rd] = ~(S | T); return TC_NEXT; }
+HANDLER(tc_slt)  { R[op->rd] = (int) S < (int) T; return TC_NEXT; }
+HANDLER(tc_sltu) { R[op->rd] = S < T; return TC_NEXT; }
+
+HANDLER(tc_mthi) { state->hi = S; return TC_NEXT; }
+HANDLER(tc_mtlo) { state->lo = S; return TC_NEXT; }
+
+HANDLER(tc_mult)
+{
+        int64_t i64 = (int64_t) (int) S * (int64_t) (int) T;
+        state->lo = i64;
+        state->hi = i64 >> 32;
+        return TC_NEXT;
+}
+
+HANDLER(tc_multu)
+{
+        u_int64_t u64 = (u_int64_t) S * (u_int64_t) T;
+        state->lo = u64;
+        state->hi = u64 >> 32;
+        return TC_NEXT;
+}
+
+HANDLER(tc_div)
+{
+        uint32_t s = S, t = T;
+
+        if (t) {
+                state->hi = (int)s % (int)t;
+                state->lo = (int)s / (int)t;
+        } else {
+                // Technically undefined
+                state->hi = s;
+                state->lo = 0;
+        }
+        return TC_NEXT;
+}
+
+HANDLER(tc_divu)
+{
+        uint32_t s = S, t = T;
+
+        if (t) {
+                state->hi = s % t;
+                state->lo = s / t;
+        } else {
+                // Technically undefined
+                state->hi = s;
+                state->lo = 0;
+        }
+        return TC_NEXT;
+}
+
+static int tc_exception(MIPS_state_t *state, const tc_op_t *op,
+                        int exc_code, uint32_t vector)
+{
+        state->cp0_cause.exc_code = exc_code;
+        state->cp0_cause.ce = 0;
+        state->cp0_cause.bd = op->bd;
+        state->cp0r[CP0_EPC] = op->pc - 4 * op->bd;
+        state->cp0_status.exl = 1;
+        state->pc = vector;
+
+        return TC_ANNUL;
+}
+
+static int tc_add_common(MIPS_state_t *state, const tc_op_t *op,
+                         uint32_t r, int overflows)
+{
+        if (overflows)
+                return tc_exception(state, op, EXC_OV, 0xBFC00280);
+
+        R[op->rd] = r;
+        R[0] = 0;
+        return TC_NEXT;
+}
+
+HANDLER(tc_add)  { return tc_add_common(state, op, S + T, ADD_OVERFLOWS(S, T, S + T)); }
+HANDLER(tc_sub)  { return tc_add_common(state, op, S - T, SUB_OVERFLOWS(S, T, S - T)); }
+
+HANDLER(tc_break)
+{
+        return tc_exception(state, op, EXC_BP, 0xBFC00380);
+}
+
+/* Ends its block.  Exit leaves the simulation from inside */
+HANDLER(tc_syscall)
+{
+        if (R[2] == HOSTCALL_EXIT)
+                TC_FINISH();
+        else
+                TC_SYNC();
+        hostcall(state);
+        return TC_STORED();
+}
+
+HANDLER(tc_teq)
+{
+        if (S == T) {
+                TC_FINISH();
+                fatal("Trap %d %d", op->i.r.rd, op->i.r.sa);
+        }
+        return TC_NEXT;
+}
+
+/* Control transfers.  state->pc holds the fall-through address on entry */
+HANDLER(tc_jr)   { state->pc = S; return TC_NEXT; }
+
+HANDLER(tc_jalr)
+{
+        uint32_t s = S;
+
+        R[op->rd] = op->pc + 8;
+        R[0] = 0;
+        state->pc = s;
+        if (yari->profile)
+                profile_call(op->pc, s);
+        return TC_NEXT;
+}
+
+HANDLER(tc_j)    { state->pc = op->imm; return TC_NEXT; }
+
+HANDLER(tc_jal)
+{
+        ++yari->n_call;
+        R[31] = op->pc + 8;
+        state->pc = op->imm;
+        if (yari->profile)
+                profile_call(op->pc, op->imm);
+        return TC_NEXT;
+}
+
+HANDLER(tc_beq)  { if (S == T) state->pc = op->imm; return TC_NEXT; }
+HANDLER(tc_bne)  { if (S != T) state->pc = op->imm; return TC_NEXT; }
+HANDLER(tc_blez) { if ((int) S <= 0) state->pc = op->imm; return TC_NEXT; }
+HANDLER(tc_bgtz) { if ((int) S > 0) state->pc = op->imm; return TC_NEXT; }
+HANDLER(tc_bltz) { if ((int) S < 0) state->pc = op->imm; return TC_NEXT; }
+HANDLER(tc_bgez) { if ((int) S >= 0) state->pc = op->imm; return TC_NEXT; }
+
+HANDLER(tc_bltzal)
+{
+        int taken = (int) S < 0;
+
+        R[31] = op->pc + 8;
+        if (taken)
+                state->pc = op->imm;
+        return TC_NEXT;
+}
+
+HANDLER(tc_bgezal)
+{
+        int taken = (int) S >= 0;
+
+        R[31] = op->pc + 8;
+        if (taken)
+                state->pc = op->imm;
+        return TC_NEXT;
+}
+
+/* The special hack from run_simple(): terminate on endless loops */
+HANDLER(tc_beq_halt)
+{
+        state->pc = op->imm;
+        if (icache_fetch(op->pc + 8) == 0) {
+                TC_FINISH();
+                sim_exit(0);
+        }
+        return TC_NEXT;
+}
+
+static void tc_flush(void);
+
+HANDLER(tc_synci)
+{
+        synci(ADDR);
+        if (tc_is_code(ADDR))
+                tc_flush();
+        return TC_STORED();
+}
+
+/* Immediate forms; only used when rt != 0 */
+HANDLER(tc_addiu) { T = S + op->imm; return TC_NEXT; }
+HANDLER(tc_slti)  { T = (int) S < (int) op->imm; return TC_NEXT; }
+HANDLER(tc_sltiu) { T = S < op->imm; return TC_NEXT; }
+HANDLER(tc_andi)  { T = S & op->imm; return TC_NEXT; }
+HANDLER(tc_ori)   { T = S | op->imm; return TC_NEXT; }
+HANDLER(tc_xori)  { T = S ^ op->imm; return TC_NEXT; }
+HANDLER(tc_lui)   { T = op->imm; return TC_NEXT; }
+
+HANDLER(tc_cp0)
+{
+        inst_t i = op->i;
+        uint32_t wbv = 0xDEADBEEF;
+
+        if (i.r.rs & 0x10) {
+                if ((c0_map_t) i.r.funct == C0_ERET) {
+                        if (op->bd)
+                                fprintf(stderr, "ERET in a delay slot is illegal!\n");
+
+                        if (state->cp0_status.erl) {
+                                state->pc = state->cp0r[CP0_ERROREPC];
+                                state->cp0_status.erl = 0;
+                        } else {
+                                state->pc = state->cp0r[CP0_EPC];
+                                state->cp0_status.exl = 0;
+                        }
+                        T = wbv;
+                        R[0] = 0;
+                        return TC_ANNUL;
+                }
+                if ((c0_map_t) i.r.funct == C0_WAIT) {
+                        TC_SYNC();
+                        idle_wait();
+                        return TC_NEXT;
+                }
+                fprintf(stderr,
+                        "Unhandled CP0 command %s\n",
+                        (c0_map_t) i.r.funct == C0_TLBR  ? "tlbr" :
+                        (c0_map_t) i.r.funct == C0_TLBWI ? "tlbwi" :
+                        (c0_map_t) i.r.funct == C0_TLBWR ? "tlbwr" :
+                        (c0_map_t) i.r.funct == C0_TLBP  ? "tlbp" :
+                        (c0_map_t) i.r.funct == C0_DERET ? "deret" :
+                        (c0_map_t) i.r.funct == C0_WAIT  ? "wait" :
+                        "???");
+        } else {
+                assert(i.r.funct == 0);
+                if (i.r.rs & 4) {
+                        mtc0(state, i.r.rd, T);
+                        return TC_NEXT;
+                }
+                wbv = state->cp0r[i.r.rd];
+        }
+
+        T = wbv;
+        R[0] = 0;
+        return TC_NEXT;
+}
+
+HANDLER(tc_cp2)
+{
+        uint32_t wbv = 0xDEADBEEF;
+
+        if (op->i.raw == 0x48000000) { // A hack
+                TC_FINISH();
+                if (state->lo == 0x87654321) {
+                        printf("TEST SUCCESS!\n");
+                        sim_exit(0);
+                } else {
+                        printf("TEST FAILED WITH $2 = 0x%08x\n",
+                               state->lo);
+                        sim_exit(1);
+                }
+        }
+
+        if (~op->i.r.rs & 0x10 && ~op->i.r.rs & 4) {
+                TC_SYNC();
+                wbv = perf_counter(op->i.r.rd);
+        }
+
+        T = wbv;
+        R[0] = 0;
+        return TC_NEXT;
+}
+
+HANDLER(tc_rdhwr)
+{
+        uint32_t wbv;
+
+        TC_SYNC();
+        wbv = rdhwr(op->i.r.rd);
+        /* rdhwr() may have reset TSC */
+        yari->tc->tsc_base = yari->TSC - op->idx - 1;
+
+        T = wbv;
+        R[0] = 0;
+        return TC_NEXT;
+}
+
+/* Loads and stores, the common ones specialized by endian */
+#define TC_LOADS_AND_STORES(E)                                                         \
+HANDLER(tc_lb_##E)  { TC_SYNC(); T = EXT8(ld8_##E(ADDR));   R[0] = 0; return TC_LOADED(); } \
+HANDLER(tc_lh_##E)  { TC_SYNC(); T = EXT16(ld16_##E(ADDR)); R[0] = 0; return TC_LOADED(); } \
+HANDLER(tc_lbu_##E) { TC_SYNC(); T = ld8_##E(ADDR);         R[0] = 0; return TC_LOADED(); } \
+HANDLER(tc_lhu_##E) { TC_SYNC(); T = ld16_##E(ADDR);        R[0] = 0; return TC_LOADED(); } \
+HANDLER(tc_lw_##E)  { TC_SYNC(); T = ld32_##E(ADDR);        R[0] = 0; return TC_LOADED(); } \
+HANDLER(tc_sb_##E)  { st8_##E(ADDR, T);  return TC_STORED(); }                          \
+HANDLER(tc_sh_##E)  { st16_##E(ADDR, T); return TC_STORED(); }                          \
+HANDLER(tc_sw_##E)  { st32_##E(ADDR, T); return TC_STORED(); }
+
+TC_LOADS_AND_STORES(le)
+TC_LOADS_AND_STORES(be)
+
+HANDLER(tc_lwl)
+{
+        unsigned address = ADDR, t = T, w, sh;
+
+        TC_SYNC();
+        w = LD32(address & ~3);
+        sh = (address & 3) * 8;
+        T = (w << sh) | (~(~0 << sh) & t);
+        R[0] = 0;
+        return TC_LOADED();
+}
+
+HANDLER(tc_lwr)
+{
+        unsigned address = ADDR, t = T, w, sh;
+
+        TC_SYNC();
+        w = LD32(address & ~3);
+        sh = 24 - (address & 3) * 8;
+        T = (w >> sh) | (~(~0U >> sh) & t);
+        R[0] = 0;
+        return TC_LOADED();
+}
+
+HANDLER(tc_lwc1)
+{
+        TC_SYNC();
+        state->f[op->rt] = LD32(ADDR);
+        return TC_LOADED();
+}
+
+HANDLER(tc_swl)
+{
+        unsigned address = ADDR, t = T, w, sh;
+
+        TC_SYNC();
+        w = LD32(address & ~3);
+        sh = (address & 3) * 8;
+        ST32(address & ~3, (t >> sh) | (~(~0U >> sh) & w));
+        return TC_STORED();
+}
+
+HANDLER(tc_swr)
+{
+        unsigned address = ADDR, t = T, w, sh;
+
+        TC_SYNC();
+        w = LD32(address & ~3);
+        sh = 24 - (address & 3) * 8;
+        ST32(address & ~3, (t << sh) | (~(~0 << sh) & w));
+        return TC_STORED();
+}
+
+/*
+ * Loads and stores while there are watchpoints, see watch.c.  The
+ * access gets the PC for the log, and a watchpoint stopping the
+ * program leaves the block right after it.  The decoded handler waits
+ * in op->real.
+ */
+HANDLER(tc_watched)
+{
+        int r;
+
+        yari->watch_pc = op->pc;
+        r = op->real(state, op);
+        TC_SYNC();
+        if (r == TC_NEXT && yari->n_issue >= yari->stop_issue)
+                r = TC_EXIT;
+
+        return r;
+}
+
+/* Everything run_simple() gives up on, with the same diagnostics */
+HANDLER(tc_unhandled)
+{
+        inst_t i = op->i;
+        uint32_t pc_prev = op->pc;
+
+        TC_FINISH();
+
+        switch (i.j.opcode) {
+        case SPECIAL:
+                fatal("SPECIAL sub-opcode %d not handled\n", i.r.funct);
+        case REGIMM:
+                fatal("REGIMM rt=0d%d not handled\n", i.r.rt);
+        case CP1:
+                if (i.r.rs == 16 /* S */)
+                        fatal("%08x:%08x, opcode 0x%x.s not handled\n",
+                              pc_prev, i.raw, i.r.funct);
+                if (i.r.rs == 17 /* D */) {
+                        if ((cp1_sdw_map_t) i.r.funct == CP1_ADD)
+                                fatal("%08x:%08x, opcode add.d not handled\n",
+                                      pc_prev, i.raw);
+                        fatal("%08x:%08x, opcode 0x%x.d not handled\n",
+                              pc_prev, i.raw, i.r.funct);
+                }
+                fatal("%08x:%08x, opcode CP1 rs=0x%x not handled\n",
+                      pc_prev, i.raw, i.r.rs);
+        case CP1X: fatal("%08x:%08x, opcode CP1X not handled\n", pc_prev, i.raw);
+        case BEQL: fatal("%08x:%08x, opcode BEQL not handled\n", pc_prev, i.raw);
+        case BNEL: fatal("%08x:%08x, opcode BEQL not handled\n", pc_prev, i.raw);
+        case LDC1: fatal("%08x:%08x, opcode LDCP1 not handled\n", pc_prev, i.raw);
+        case SWC1: fatal("%08x:%08x, opcode SWCP1 not handled\n", pc_prev, i.raw);
+        case SDC1: fatal("%08x:%08x, opcode SDCP1 not handled\n", pc_prev, i.raw);
+        default:   fatal("%08x:%08x, opcode %d not handled\n",
+                         pc_prev, i.raw, i.j.opcode);
+        }
+
+        return TC_EXIT;
+}
+
+/*
+ * Decoding.  tc_decode() fills in op and tells whether the
+ * instruction has a delay slot or must end the block.
+ */
+enum { TC_BRANCH = 1, TC_STOP = 2 };
+
+/* The endian is settled once the ELF files are loaded */
+#define MEM(h) (yari->endian_is_big ? h##_be : h##_le)
+
+static int tc_decode(tc_op_t *op, uint32_t pc, inst_t i)
+{
+        uint32_t npc = pc + 4;
+        int pure = 0;   // Only effect is writing op->rd
+
+        op->pc = pc;
+        op->i = i;
+        op->rs = i.r.rs;
+        op->rt = i.r.rt;
+        op->rd = i.r.rd;
+        op->imm = i.i.imm;
+        op->handler = tc_unhandled;
+
+        switch (i.j.opcode) {
+        case SPECIAL:
+                op->imm = i.r.sa;
+                pure = 1;
+                switch (i.r.funct) {
+                case SLL:  op->handler = tc_sll;  break;
+                case SRL:  op->handler = tc_srl;  break;
+                case SRA:  op->handler = tc_sra;  break;
+                case SLLV: op->handler = tc_sllv; break;
+                case SRLV: op->handler = tc_srlv; break;
+                case SRAV: op->handler = tc_srav; break;
+                case MFHI: op->handler = tc_mfhi; break;
+                case MFLO: op->handler = tc_mflo; break;
+                case ADDU: op->handler = tc_addu; break;
+                case SUBU: op->handler = tc_subu; break;
+                case AND:  op->handler = tc_and;  break;
+                case OR:   op->handler = tc_or;   break;
+                case XOR:  op->handler = tc_xor;  break;
+                case NOR:  op->handler = tc_nor;  break;
+                case SLT:  op->handler = tc_slt;  break;
+                case SLTU: op->handler = tc_sltu; break;
+                default:
+                        pure = 0;
+                        switch (i.r.funct) {
+                        case MTHI:  op->handler = tc_mthi;  break;
+                        case MTLO:  op->handler = tc_mtlo;  break;
+                        case MULT:  op->handler = tc_mult;  break;
+                        case MULTU: op->handler = tc_multu; break;
+                        case DIV:   op->handler = tc_div;   break;
+                        case DIVU:  op->handler = tc_divu;  break;
+                        case ADD:   op->handler = tc_add;   break;
+                        case SUB:   op->handler = tc_sub;   break;
+                        case TEQ:   op->handler = tc_teq;   break;
+                        case JR:    op->handler = tc_jr;    return TC_BRANCH;
+                        case JALR:  op->handler = tc_jalr;  return TC_BRANCH;
+                        case BREAK: op->handler = tc_break; return TC_STOP;
+                        case SYSCALL: op->handler = tc_syscall; return TC_STOP;
+                        default:                            return TC_STOP;
+                        }
+                }
+                if (pure && op->rd == 0)
+                        op->handler = tc_nop;
+                return 0;
+
+        case REGIMM:
+                op->imm = npc + (i.i.imm << 2);
+                switch (i.r.rt) {
+                case BLTZ:   op->handler = tc_bltz;   return TC_BRANCH;
+                case BGEZ:   op->handler = tc_bgez;   return TC_BRANCH;
+                case BLTZAL: op->handler = tc_bltzal; return TC_BRANCH;
+                case BGEZAL: op->handler = tc_bgezal; return TC_BRANCH;
+                case SYNCI:
+                        op->imm = i.i.imm;
+                        op->handler = tc_synci;
+                        return 0;
+                default:
+                        return TC_STOP;
+                }
+
+        case J:
+        case JAL:
+                op->imm = (npc & ~((1<<28)-1)) | (i.j.offset << 2);
+                op->handler = i.j.opcode == J ? tc_j : tc_jal;
+                return TC_BRANCH;
+
+        case BEQ:
+        case BNE:
+        case BLEZ:
+        case BGTZ:
+                op->imm = npc + (i.i.imm << 2);
+                op->handler =
+                        i.raw == 0x1000FFFF   ? tc_beq_halt :
+                        i.j.opcode == BEQ     ? tc_beq :
+                        i.j.opcode == BNE     ? tc_bne :
+                        i.j.opcode == BLEZ    ? tc_blez : tc_bgtz;
+                return TC_BRANCH;
+
+        case ADDI:
+        case ADDIU: op->handler = tc_addiu; pure = 1; break;
+        case SLTI:  op->handler = tc_slti;  pure = 1; break;
+        case SLTIU: op->handler = tc_sltiu; pure = 1; break;
+        case ANDI:  op->handler = tc_andi;  op->imm = i.u.imm; pure = 1; break;
+        case ORI:   op->handler = tc_ori;   op->imm = i.u.imm; pure = 1; break;
+        case XORI:  op->handler = tc_xori;  op->imm = i.u.imm; pure = 1; break;
+        case LUI:   op->handler = tc_lui;   op->imm = i.u.imm << 16; pure = 1; break;
+
+        case CP0:
+                op->handler = tc_cp0;
+                if ((i.r.rs & 0x10) && (c0_map_t) i.r.funct == C0_ERET)
+                        return TC_STOP;
+                return 0;
+
+        case CP2:
+                op->handler = tc_cp2;
+                return 0;
+
+        case RDHWR:
+                if (i.r.funct == 59) {
+                        op->handler = tc_rdhwr;
+                        return 0;
+                }
+                return TC_STOP;
+
+        case LB:   op->handler = MEM(tc_lb);  return 0;
+        case LH:   op->handler = MEM(tc_lh);  return 0;
+        case LBU:  op->handler = MEM(tc_lbu); return 0;
+        case LHU:  op->handler = MEM(tc_lhu); return 0;
+        case LW:   op->handler = MEM(tc_lw);  return 0;
+        case LWL:  op->handler = tc_lwl;  return 0;
+        case LWR:  op->handler = tc_lwr;  return 0;
+        case LWC1: op->handler = tc_lwc1; return 0;
+        case SB:   op->handler = MEM(tc_sb);  return 0;
+        case SH:   op->handler = MEM(tc_sh);  return 0;
+        case SW:   op->handler = MEM(tc_sw);  return 0;
+        case SWL:  op->handler = tc_swl;  return 0;
+        case SWR:  op->handler = tc_swr;  return 0;
+
+        default:
+                return TC_STOP;
+        }
+
+        if (pure && op->rt == 0)
+                op->handler = tc_nop;
+
+        return 0;
+}
+
+/*
+ * Hazard statistics.  These follow the book keeping in run_simple()
+ * but are worked out once per block at translation time; only the
+ * pair straddling two blocks is checked at run time.
+ */
+static tc_summary_t tc_summarize(inst_t i)
+{
+        tc_summary_t s = { .wbr = i.r.rt };
+
+        switch (i.j.opcode) {
+        case SPECIAL:
+                s.wbr = i.r.rd;
+                switch (i.r.funct) {
+                case SLL: case SRL: case SRA:
+                case SLLV: case SRLV: case SRAV:
+                        s.shift_dest = i.r.rd;
+                        break;
+                case BREAK:
+                        s.wbr = 0;
+                        break;
+                default:
+                        break;
+                }
+                break;
+
+        case REGIMM:
+                s.wbr = i.r.rt == BLTZAL || i.r.rt == BGEZAL ? 31 : 0;
+                break;
+
+        case JAL:
+                s.wbr = 31;
+                break;
+
+        case J: case BEQ: case BNE: case BLEZ: case BGTZ:
+        case SB: case SH: case SW: case SWL: case SWR: case LWC1:
+                s.wbr = 0;
+                break;
+
+        case CP0:
+                if (!(i.r.rs & 0x10) && (i.r.rs & 4))
+                        s.wbr = 0;
+                break;
+
+        case LW:
+                s.load32_dest = i.r.rt;
+                /* Fall-through */
+        case LB: case LH: case LBU: case LHU: case LWL: case LWR:
+                s.load_dest = i.r.rt;
+                break;
+
+        default:
+                break;
+        }
+
+        return s;
+}
+
+static unsigned tc_hazards(tc_summary_t p, inst_t i, int bd, uint32_t next_word)
+{
+        unsigned m = 0;
+
+        if (i.raw == 0) {
+                m |= 1 << HZ_NOP;
+                if (bd)
+                        m |= 1 << HZ_NOP_DELAY_SLOTS;
+                if (p.load_dest) {
+                        inst_t next = { .raw = next_word };
+                        if (p.load32_dest != next.r.rs && p.load32_dest != next.r.rt)
+                                m |= 1 << HZ_NOP_USELESS;
+                }
+        }
+
+        if (p.wbr == i.r.rs)
+                switch (i.j.opcode) {
+                case LB: case LH: case LBU: case LHU:
+                case LW: case LWL: case LWR:
+                        m |= 1 << HZ_GEN_LOAD;
+                default:
+                        break;
+                }
+
+        if (p.load_dest && p.load_dest == i.r.rs)
+                m |= 1 << HZ_LOAD_USE_RS;
+
+        if (p.load_dest && p.load_dest == i.r.rt)
+                m |= 1 << HZ_LOAD_USE_RT;
+
+        if (p.shift_dest && (p.shift_dest == i.r.rs || p.shift_dest == i.r.rt))
+                m |= 1 << HZ_SHIFT_USE;
+
+        return m;
+}
+
+static void tc_count_hazards(unsigned m)
+{
+        int k;
+
+        for (k = 0; k < HZ_N; ++k)
+                if (m & (1 << k))
+                        ++TC_STAT(k);
+}
+
+#define DBT_HOT          50      // Runs before a block gets host code
+
+#define TC_BLOCK_SIZE(b) ((sizeof *(b) + (b)->n * sizeof (b)->op[0] + 15) & ~15)
+#define TC_HASH(pc)      (((pc) >> 2) & ((1 << TC_HASH_BITS) - 1))
+
+void tc_fold_stats(void)
+{
+        tc_block_t *b;
+        char *p;
+        int k;
+
+        if (!yari->tc)
+                return;
+
+        for (p = yari->tc->arena; p < yari->tc->free; p += TC_BLOCK_SIZE(b)) {
+                b = (tc_block_t *) p;
+                for (k = 0; k < HZ_N; ++k)
+                        TC_STAT(k) += b->count * b->hz[k];
+                if (yari->profile && b->count)
+                        profile_block(b->pc, b->n, b->count);
+                b->count = 0;
+        }
+}
+
+static uint32_t tc_next_word(uint32_t pc)
+{
+        return addr_mapped(pc + 4) ? load(pc + 4, 4, 1) : 0;
+}
+
+static void tc_flush(void)
+{
+        tc_block_t *b;
+        uint32_t pc;
+        char *p;
+
+        tc_fold_stats();
+
+        for (p = yari->tc->arena; p < yari->tc->free; p += TC_BLOCK_SIZE(b)) {
+                b = (tc_block_t *) p;
+                yari->tc->hash[TC_HASH(b->pc)] = NULL;
+                for (pc = b->pc; pc < b->end_pc; pc += 4)
+                        yari->tc_code_map[pc >> (TC_GRANULE_BITS + 5)] = 0;
+        }
+
+        yari->tc->free = yari->tc->arena;
+        yari->tc->invalidated = 1;
+        ++yari->n_tc_flushes;
+        dbt_flush();
+}
+
+/* The block starting at pc, if translated */
+static tc_block_t *tc_find(uint32_t pc)
+{
+        tc_block_t *b;
+
+        for (b = yari->tc->hash[TC_HASH(pc)]; b; b = b->hnext)
+                if (b->pc == pc)
+                        return b;
+
+        return NULL;
+}
+
+static void tc_drop(tc_block_t *b)
+{
+        tc_block_t **h = &yari->tc->hash[TC_HASH(b->pc)];
+
+        while (*h != b)
+                h = &(*h)->hnext;
+        *h = b->hnext;
+
+        b->dead = 1;
+        dbt_unchain(b);
+        yari->tc->invalidated = 1;
+}
+
+/*
+ * A store to a granule of translated code.  Blocks are at most
+ * TC_MAX_OPS + 1 words long, so those holding the word written start
+ * no further back than that.  The granule stays marked for as long as
+ * any block still covers it.
+ */
+void tc_invalidate(unsigned address)
+{
+        uint32_t a = address & ~3, g = address & ~((1 << TC_GRANULE_BITS) - 1);
+        uint32_t pc, from;
+        tc_block_t *b;
+
+        if (!yari->tc || !tc_is_code(address))
+                return;
+
+        from = a < 4 * TC_MAX_OPS ? 0 : a - 4 * TC_MAX_OPS;
+        for (pc = a;; pc -= 4) {
+                b = tc_find(pc);
+                if (b && a < b->end_pc)
+                        tc_drop(b);
+                if (pc == from)
+                        break;
+        }
+
+        from = g < 4 * TC_MAX_OPS ? 0 : g - 4 * TC_MAX_OPS;
+        for (pc = g + (1 << TC_GRANULE_BITS) - 4;; pc -= 4) {
+                b = tc_find(pc);
+                if (b && g < b->end_pc)
+                        return;
+                if (pc == from)
+                        break;
+        }
+
+        yari->tc_code_map[g >> (TC_GRANULE_BITS + 5)] &= ~(1U << ((g >> TC_GRANULE_BITS) & 31));
+}
+
+/* tc_invalidate() for the words of [address, address + len) */
+void tc_invalidate_range(unsigned address, unsigned len)
+{
+        uint32_t g, a, end = address + len;
+
+        if (!yari->tc)
+                return;
+
+        for (g = address & ~((1 << TC_GRANULE_BITS) - 1); g < end; g += 1 << TC_GRANULE_BITS)
+                if (tc_is_code(g))
+                        for (a = g > address ? g : address & ~3;
+                             a < end && a < g + (1 << TC_GRANULE_BITS); a += 4)
+                                tc_invalidate(a);
+}
+
+/* For changes in how the translations must access memory */
+void tc_invalidate_all(void)
+{
+        if (yari->tc)
+                tc_flush();
+}
+
+static void tc_mark_code(uint32_t pc)
+{
+        yari->tc_code_map[pc >> (TC_GRANULE_BITS + 5)] |= 1U << ((pc >> TC_GRANULE_BITS) & 31);
+}
+
+static tc_block_t *tc_translate(uint32_t pc)
+{
+        tc_summary_t prev = { 0 };
+        tc_block_t *b;
+        unsigned k;
+        int bd = 0;
+
+        if (!addr_mapped(pc)) {
+                load(pc, 4, 1); // For the diagnostic
+                return NULL;
+        }
+
+        if (yari->tc->free + sizeof *b + (TC_MAX_OPS + 1) * sizeof b->op[0] >
+            yari->tc->arena + sizeof yari->tc->arena)
+                tc_flush();
+
+        b = (tc_block_t *) yari->tc->free;
+        memset(b, 0, sizeof *b);
+        b->pc = pc;
+
+        for (k = 0;; pc += 4) {
+                tc_op_t *op = &b->op[k];
+                int stale, flags;
+                inst_t i = { .raw = icache_peek(pc, &stale) };
+
+                /* Words the I$ holds stale go to run_simple() instead */
+                if (stale) {
+                        if (bd)         // With their branch
+                                --yari->coverage[INST_INDEX(b->op[--k].i)];
+                        break;
+                }
+
+                flags = tc_decode(op, pc, i);
+
+                if (yari->watch_map && op->handler != tc_unhandled &&
+                    i.j.opcode >= LB && i.j.opcode <= LWC1) {
+                        op->real = op->handler;
+                        op->handler = tc_watched;
+                }
+
+                if (bd && (flags & TC_BRANCH))
+                        fatal("%08x: branch in a delay slot, try --no-tcache\n", pc);
+
+                op->idx = k;
+                op->bd  = bd;
+
+                ++yari->coverage[INST_INDEX(i)];
+
+                if (k == 0)
+                        b->first_next = tc_next_word(pc);
+                tc_mark_code(pc);
+                ++k;
+
+                if (bd || (flags & TC_STOP))
+                        break;
+
+                bd = flags & TC_BRANCH;
+                if (!bd && (k == TC_MAX_OPS || !addr_mapped(pc + 4) ||
+                            pc + 4 == yari->stop_pc || at_break(pc + 4)))
+                        break;
+        }
+
+        if (!k)
+                return NULL;
+
+        b->n = k;
+        b->end_pc = b->pc + 4 * k;
+
+        for (k = 0; k < b->n; ++k) {
+                if (k) {
+                        unsigned m = tc_hazards(prev, b->op[k].i, b->op[k].bd,
+                                                tc_next_word(b->op[k].pc));
+                        int h;
+
+                        for (h = 0; h < HZ_N; ++h)
+                                if (m & (1 << h))
+                                        ++b->hz[h];
+                }
+                prev = tc_summarize(b->op[k].i);
+        }
+        b->tail = prev;
+
+        yari->tc->free += TC_BLOCK_SIZE(b);
+        ++yari->n_tc_blocks;
+
+        return b;
+}
+
+static tc_block_t *tc_lookup(uint32_t pc)
+{
+        tc_block_t **h = &yari->tc->hash[TC_HASH(pc)];
+        tc_block_t *b = tc_find(pc);
+
+        if (b)
+                return b;
+
+        b = tc_translate(pc);
+        if (b) {
+                b->hnext = *h;
+                *h = b;
+        }
+
+        return b;
+}
+
+/* TSC moved on in the middle of a block, see idle.c */
+void tc_skip_cycles(uint64_t cycles)
+{
+        if (yari->tc)
+                yari->tc->tsc_base += cycles;
+}
+
+void tc_free_all(yarisim_t *y)
+{
+        if (y->tc)
+                dbt_free(y->tc);
+        free(y->tc);
+        y->tc = NULL;
+}
+
+/*
+ * Run the instruction at state->pc, with its delay slot if a branch,
+ * on run_simple(), for what the I$ holds stale
+ */
+static void tc_interpret(MIPS_state_t *state)
+{
+        uint64_t stop_issue = yari->stop_issue;
+
+        yari->stop_issue = yari->n_issue + 1;
+        run_simple(state);
+        if (yari->stop_issue)   // Not cleared by a watchpoint
+                yari->stop_issue = stop_issue;
+}
+
+/*
+ * Run from state->pc until the program stops or, between blocks,
+ * until n_issue reaches yari->stop_issue, the PC yari->stop_pc or a
+ * breakpoint.  Blocks end before those, unless in a delay slot.  Can
+ * be called again to carry on.
+ */
+void run_tcache(MIPS_state_t *state)
+{
+        static const tc_summary_t none;
+        tc_summary_t last = none;
+        tc_block_t *b, *prev = NULL;
+        int whole = 0;          // prev ran to its end
+
+        if (!yari->tc) {
+                yari->tc = malloc(sizeof *yari->tc);
+                if (!yari->tc)
+                        fatal("Out of memory for the translation cache\n");
+                memset(yari->tc->hash, 0, sizeof yari->tc->hash);
+                yari->tc->free = yari->tc->arena;
+                yari->tc->invalidated = 0;
+                yari->tc->dbt = NULL;
+        }
+
+        for (;;) {
+                uint32_t pc = state->pc;
+                const tc_op_t *op, *end;
+                int slot, r = TC_NEXT;
+                unsigned m, n, k;
+
+                if (yari->n_issue >= yari->stop_issue || pc == yari->stop_pc ||
+                    at_break(pc))
+                        break;
+
+                slot = prev && pc != prev->end_pc;
+                if (prev && prev->succ[slot] && prev->succ_pc[slot] == pc &&
+                    !prev->succ[slot]->dead) {
+                        b = prev->succ[slot];
+                } else {
+                        b = tc_lookup(pc);
+                        if (yari->tc->invalidated) {
+                                yari->tc->invalidated = 0;
+                                prev = NULL;
+                        }
+                        if (!b && yari->segfault) {
+                                printf("Access violation, execution aborted\n");
+                                break;
+                        }
+                        if (!b) {
+                                tc_interpret(state);
+                                last = none;
+                                prev = NULL;
+                                whole = 0;
+                                continue;
+                        }
+                        if (prev) {
+                                prev->succ[slot] = b;
+                                prev->succ_pc[slot] = pc;
+                        }
+                }
+
+                if (enable_dbt && !b->native && b->count >= DBT_HOT &&
+                    !dbt_translate(b)) {
+                        /* Out of host code space, start over */
+                        tc_flush();
+                        yari->tc->invalidated = 0;
+                        prev = NULL;
+                        continue;
+                }
+
+                m = tc_hazards(last, b->op[0].i, 0, b->first_next);
+                if (m)
+                        tc_count_hazards(m);
+
+                if (b->native) {
+                        /* Runs on through chained blocks, up to a stop */
+                        if (prev && whole && prev->native)
+                                dbt_chain(prev, slot, b, m);
+                        r = dbt_run(state, b);
+                        b = yari->tc->dbt_block;
+                        op = b->op + yari->tc->dbt_idx;
+                        end = b->op + b->n;
+                        if (r == TC_NEXT) {
+                                last = b->tail;
+                                prev = b;
+                                whole = 1;
+                                continue;
+                        }
+                        goto left_early;
+                }
+
+                yari->tc->tsc_base   = yari->TSC;
+                yari->tc->issue_base = yari->n_issue;
+                state->pc     = b->end_pc;
+
+                for (op = b->op, end = op + b->n; op < end; ++op)
+                        if ((r = op->handler(state, op)) != TC_NEXT)
+                                break;
+
+                if (r == TC_NEXT) {
+                        icache_fetch_block(b->pc, b->n);
+                        yari->TSC     = yari->tc->tsc_base + b->n;
+                        yari->n_issue = yari->tc->issue_base + b->n;
+                        ++b->count;
+                        last = b->tail;
+                        prev = b;
+                        whole = 1;
+                        continue;
+                }
+
+                /*
+                 * Left early.  The block may just have been flushed,
+                 * but its memory stays intact until the next
+                 * translation.
+                 */
+left_early:
+                n = op - b->op + 1;
+                icache_fetch_block(b->pc, n);
+                if (yari->profile)
+                        profile_block(b->pc, n, 1);
+                yari->TSC     = yari->tc->tsc_base + n;
+                yari->n_issue = yari->tc->issue_base + n;
+
+                for (k = 1; k < n; ++k)
+                        tc_count_hazards(tc_hazards(tc_summarize(b->op[k - 1].i),
+                                                    b->op[k].i, b->op[k].bd,
+                                                    tc_next_word(b->op[k].pc)));
+
+                if (r == TC_ANNUL) {
+                        // The next instruction is executed as a nop
+                        ++yari->TSC;
+                        ++yari->n_issue;
+                        ++yari->stat_nop;
+                        ++yari->coverage[64 + SLL];
+                        last = none;
+                } else {
+                        last = tc_summarize(op->i);
+                        if (op + 1 < end)
+                                state->pc = op->pc + 4;
+                }
+
+                whole = 0;
+                if (yari->tc->invalidated) {
+                        yari->tc->invalidated = 0;
+                        prev = NULL;
+                } else
+                        prev = b;
+
+                if (yari->segfault) {
+                        printf("Access violation, execution aborted\n");
+                        break;
+                }
+        }
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
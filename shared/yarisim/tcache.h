@@ -0,0 +1,94 @@
+#ifndef _TCACHE_H_
+#define _TCACHE_H_ 1
+
+/*
+ * The insides of the translation cache, shared by tcache.c and its
+ * x86-64 back end, dbt.c.  Nothing else should need these.
+ */
+
+#define TC_MAX_OPS   64              // Not counting a trailing delay slot
+#define TC_HASH_BITS 16
+#define TC_ARENA_SIZE (32 << 20)
+
+typedef struct tc_op tc_op_t;
+typedef struct tc_block tc_block_t;
+
+/* Handlers return one of these */
+enum {
+        TC_NEXT,        // Carry on with the next operation
+        TC_EXIT,        // Leave the block, continue sequentially
+        TC_ANNUL,       // Leave the block, annul the next instruction
+};
+
+typedef int tc_handler_t(MIPS_state_t *state, const tc_op_t *op);
+
+struct tc_op {
+        tc_handler_t *handler;
+        uint32_t     pc;
+        uint32_t     imm;       // Immediate, shift amount or branch target
+        uint8_t      rs, rt, rd;
+        uint8_t      idx;       // Position in the block
+        uint8_t      bd;        // In a branch delay slot
+        inst_t       i;
+        tc_handler_t *real;     // The decoded handler, under tc_watched()
+};
+
+/* What an instruction leaves behind for the hazard statistics */
+typedef struct tc_summary {
+        uint8_t wbr, load_dest, load32_dest, shift_dest;
+} tc_summary_t;
+
+enum {
+        HZ_NOP, HZ_NOP_DELAY_SLOTS, HZ_NOP_USELESS, HZ_GEN_LOAD,
+        HZ_LOAD_USE_RS, HZ_LOAD_USE_RT, HZ_SHIFT_USE,
+        HZ_N
+};
+
+struct tc_block {
+        uint32_t      pc, end_pc;
+        unsigned      n;
+        tc_block_t   *hnext;
+        tc_block_t   *succ[2];    // Fall-through and last taken successor
+        uint32_t      succ_pc[2];
+        uint64_t      count;
+        uint32_t      hz[HZ_N];   // Hazards within the block
+        uint32_t      first_next; // Word following the first op
+        tc_summary_t  tail;
+        struct dbt_code *native;  // Host code, once hot, see dbt.c
+        int           dead;       // Dropped by tc_invalidate()
+        tc_op_t       op[];
+};
+
+/* The translation cache of one machine, yari->tc */
+struct tcache {
+        char         *free;
+        int           invalidated;
+        uint64_t      tsc_base, issue_base;
+        struct dbt   *dbt;        // Private to dbt.c
+        tc_block_t   *dbt_block;  // Where dbt_run() left
+        unsigned      dbt_idx;
+        tc_block_t   *hash[1 << TC_HASH_BITS];
+        char          arena[TC_ARENA_SIZE] __attribute__((aligned(16)));
+};
+
+/* Where the hazard counts go in yarisim_t */
+extern const size_t tc_stat[HZ_N];
+
+/*
+ * The back end.  dbt_translate() returns 0 if the host code cache is
+ * full, which takes a tc_flush() to empty.
+ */
+int  dbt_translate(tc_block_t *b);
+void dbt_chain(tc_block_t *from, int slot, tc_block_t *to, unsigned hazards);
+void dbt_unchain(tc_block_t *b);
+int  dbt_run(MIPS_state_t *state, tc_block_t *b);
+void dbt_flush(void);
+void dbt_free(struct tcache *tc);
+
+#endif
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
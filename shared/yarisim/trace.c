@@ -0,0 +1,292 @@
+/*
+ * Binary instruction trace (--trace), read back by yaritrace.
+ *
+ * The interpreter writes a record per instruction retired, encoded
+ * against the previous ones so that most instructions take a couple
+ * of bytes:
+ *
+ *   flags    a byte of TRACE_*
+ *   pc       unless TRACE_SEQ, the zigzag varint of the distance in
+ *            words from the fall through pc
+ *   inst     if TRACE_INST, the instruction word, little endian.
+ *            Otherwise it's the one in the direct mapped table of the
+ *            last TRACE_INSTS instructions, which both sides keep
+ *   wbr      if TRACE_WB, the register written, a byte, and
+ *   wbv      the zigzag varint of the value less the one last traced
+ *            for that register
+ *   address  if TRACE_MEM, the zigzag varint of the load or store
+ *            address less the last one traced
+ *
+ * The varints are LEB128.  A header of TRACE_MAGIC and the version
+ * byte comes first.  The records collect in a TRACE_BUF_SIZE buffer.
+ * A file name ending in .zst or .lz4 goes through the zstd or lz4
+ * command, compressing in its own process.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "mips32.h"
+#include "runmips.h"
+
+#define TRACE_MAGIC     "YTRC"
+#define TRACE_VERSION   1
+#define TRACE_BUF_SIZE  (1 << 20)
+#define TRACE_INSTS     4096    // Power of two
+#define TRACE_MAX_REC   21      // Bytes
+
+enum {
+        TRACE_SEQ  = 1,         // pc is the previous one plus 4
+        TRACE_INST = 2,
+        TRACE_WB   = 4,
+        TRACE_MEM  = 8,
+};
+
+struct trace {
+        FILE           *f;
+        int             is_pipe;
+        const char     *filename;
+        uint32_t        pc, address;
+        uint32_t        reg[32];
+        uint32_t        inst[TRACE_INSTS];
+        unsigned        n;
+        unsigned char   buf[TRACE_BUF_SIZE];
+};
+
+#define inst_slot(t, pc) ((t)->inst[((pc) >> 2) & (TRACE_INSTS - 1)])
+
+static uint32_t zigzag(uint32_t v)
+{
+        return (v << 1) ^ -(v >> 31);
+}
+
+static uint32_t unzigzag(uint32_t v)
+{
+        return (v >> 1) ^ -(v & 1);
+}
+
+/* Compressed traces go through a command */
+static FILE *trace_fopen(const char *filename, int writing, int *is_pipe)
+{
+        const char *ext = strrchr(filename, '.');
+        const char *tool = NULL;
+        char command[1100];
+
+        if (ext && strcmp(ext, ".zst") == 0)
+                tool = "zstd";
+        else if (ext && strcmp(ext, ".lz4") == 0)
+                tool = "lz4";
+
+        *is_pipe = tool != NULL;
+        if (!tool)
+                return fopen(filename, writing ? "wb" : "rb");
+
+        if (strchr(filename, '\'') ||
+            snprintf(command, sizeof command,
+                     writing ? "%s -q -c > '%s'" : "%s -q -d -c '%s'",
+                     tool, filename) >= sizeof command)
+                return NULL;
+
+        return popen(command, writing ? "w" : "r");
+}
+
+static struct trace *trace_new(const char *filename, int writing)
+{
+        struct trace *t = calloc(1, sizeof *t);
+
+        if (!t)
+                fatal("Out of memory for the trace\n");
+
+        t->filename = filename;
+        t->pc = -4;
+        t->f = trace_fopen(filename, writing, &t->is_pipe);
+        if (!t->f)
+                fatal("Can't open the trace %s\n", filename);
+
+        return t;
+}
+
+void trace_start(const char *filename)
+{
+        struct trace *t = trace_new(filename, 1);
+
+        memcpy(t->buf, TRACE_MAGIC, 4);
+        t->buf[4] = TRACE_VERSION;
+        t->n = 5;
+        yari->trace = t;
+}
+
+static void trace_flush(struct trace *t)
+{
+        if (t->n && fwrite(t->buf, t->n, 1, t->f) != 1)
+                fatal("Can't write the trace %s\n", t->filename);
+        t->n = 0;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint32_t v)
+{
+        while (v >= 0x80) {
+                *p++ = v | 0x80;
+                v >>= 7;
+        }
+        *p++ = v;
+
+        return p;
+}
+
+/* Only call this if yari->trace */
+void trace_commit(uint32_t pc, uint32_t inst, unsigned wbr, uint32_t wbv,
+                  int is_mem, uint32_t address)
+{
+        struct trace *t = yari->trace;
+        unsigned char *p, *flags;
+
+        if (t->n > TRACE_BUF_SIZE - TRACE_MAX_REC)
+                trace_flush(t);
+
+        p = t->buf + t->n;
+        flags = p++;
+        *flags = 0;
+
+        if (pc == t->pc + 4)
+                *flags |= TRACE_SEQ;
+        else
+                p = put_varint(p, zigzag((int32_t) (pc - (t->pc + 4)) >> 2));
+        t->pc = pc;
+
+        if (inst_slot(t, pc) != inst) {
+                *flags |= TRACE_INST;
+                inst_slot(t, pc) = inst;
+                *p++ = inst;
+                *p++ = inst >> 8;
+                *p++ = inst >> 16;
+                *p++ = inst >> 24;
+        }
+
+        if (wbr) {
+                *flags |= TRACE_WB;
+                *p++ = wbr;
+                p = put_varint(p, zigzag(wbv - t->reg[wbr]));
+                t->reg[wbr] = wbv;
+        }
+
+        if (is_mem) {
+                *flags |= TRACE_MEM;
+                p = put_varint(p, zigzag(address - t->address));
+                t->address = address;
+        }
+
+        t->n = p - t->buf;
+}
+
+static void trace_close_file(struct trace *t, int writing)
+{
+        int r;
+
+        if (writing)
+                trace_flush(t);
+        r = t->is_pipe ? pclose(t->f) : fclose(t->f);
+        if (r && writing)
+                fprintf(stderr, "Writing the trace %s failed\n", t->filename);
+        free(t);
+}
+
+void trace_close(void)
+{
+        if (!yari->trace)
+                return;
+
+        trace_close_file(yari->trace, 1);
+        yari->trace = NULL;
+}
+
+void trace_free(yarisim_t *y)
+{
+        yarisim_t *saved = yari;
+
+        yari = y;
+        trace_close();
+        yari = saved;
+}
+
+/* Reading, for yaritrace */
+
+struct trace *trace_open(const char *filename)
+{
+        struct trace *t = trace_new(filename, 0);
+        unsigned char header[5];
+
+        setvbuf(t->f, NULL, _IOFBF, TRACE_BUF_SIZE);
+        if (fread(header, sizeof header, 1, t->f) != 1 ||
+            memcmp(header, TRACE_MAGIC, 4) || header[4] != TRACE_VERSION)
+                fatal("%s isn't a version %d trace\n", filename, TRACE_VERSION);
+
+        return t;
+}
+
+static uint32_t get_varint(struct trace *t)
+{
+        uint32_t v = 0;
+        int shift, c;
+
+        for (shift = 0; shift < 35; shift += 7) {
+                c = getc_unlocked(t->f);
+                if (c == EOF)
+                        fatal("%s is truncated\n", t->filename);
+                v |= (uint32_t) (c & 0x7F) << shift;
+                if (!(c & 0x80))
+                        return v;
+        }
+
+        fatal("%s is corrupt\n", t->filename);
+}
+
+/* The next record, 0 at the end of the trace */
+int trace_read(struct trace *t, trace_record_t *r)
+{
+        int flags = getc_unlocked(t->f), k, c;
+
+        if (flags == EOF)
+                return 0;
+
+        r->pc = t->pc + 4;
+        if (!(flags & TRACE_SEQ))
+                r->pc += unzigzag(get_varint(t)) << 2;
+        t->pc = r->pc;
+
+        if (flags & TRACE_INST) {
+                r->inst = 0;
+                for (k = 0; k < 32; k += 8) {
+                        c = getc_unlocked(t->f);
+                        if (c == EOF)
+                                fatal("%s is truncated\n", t->filename);
+                        r->inst |= (uint32_t) c << k;
+                }
+                inst_slot(t, r->pc) = r->inst;
+        } else
+                r->inst = inst_slot(t, r->pc);
+
+        r->wbr = 0;
+        if (flags & TRACE_WB) {
+                r->wbr = getc_unlocked(t->f) & 31;
+                r->wbv = t->reg[r->wbr] += unzigzag(get_varint(t));
+        }
+
+        r->is_mem = (flags & TRACE_MEM) != 0;
+        if (r->is_mem)
+                r->address = t->address += unzigzag(get_varint(t));
+
+        return 1;
+}
+
+void trace_close_reader(struct trace *t)
+{
+        trace_close_file(t, 0);
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
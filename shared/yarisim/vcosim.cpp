@@ -0,0 +1,119 @@
+/*
+ * Harness for the verilated YARI core, Icarus/rtl/toplevel.v built
+ * with -DCOMMIT_DPI.  The core reports each commit through the
+ * yari_commit() DPI import instead of a COMMIT line, so the
+ * cosimulation compares in memory with no pipes or parsing.
+ *
+ * Built only when the Makefile's VCOSIM points at the verilated core.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <climits>
+#include <unistd.h>
+#include "verilated.h"
+#include "Vmain.h"
+#include "Vmain__Dpi.h"
+#include "vcosim.h"
+
+#define VCOSIM_WATCHDOG 1000000 // Cycles without a commit before giving up
+
+static VerilatedContext *context;
+static Vmain *top;
+static uint64_t cycle;
+static int rtl_verbose;
+
+static struct {
+        int      valid;
+        unsigned pc, wbr, wbv;
+} commit;
+
+/* At most one commit per cycle, so one slot is enough */
+void yari_commit(int pc, int wbr, int wbv)
+{
+        commit.valid = 1;
+        commit.pc    = pc;
+        commit.wbr   = wbr;
+        commit.wbv   = wbv;
+}
+
+int vcosim_printf(const char *format, ...)
+{
+        va_list ap;
+        int n;
+
+        if (!rtl_verbose)
+                return 0;
+
+        va_start(ap, format);
+        n = vfprintf(stderr, format, ap);
+        va_end(ap);
+
+        return n;
+}
+
+void vcosim_open(const char *dir, int verbose)
+{
+        char cwd[PATH_MAX];
+
+        rtl_verbose = verbose;
+
+        /* The initial blocks open their files relative to dir */
+        if (!getcwd(cwd, sizeof cwd) || chdir(dir))
+                perror(dir), exit(1);
+
+        context = new VerilatedContext;
+        top = new Vmain(context);
+        top->clkin    = 0;
+        top->reset_n  = 1;
+        top->sw       = 0;
+        top->ttyb_rxd = 1;      // Idle line
+        top->eval();
+
+        if (chdir(cwd))
+                perror(cwd), exit(1);
+}
+
+/* Half a period is 50 time units, as in the Icarus testbench */
+static void tick(void)
+{
+        context->timeInc(50);
+        top->clkin = 1;
+        top->eval();
+        ++cycle;
+
+        context->timeInc(50);
+        top->clkin = 0;
+        top->eval();
+}
+
+int vcosim_commit(uint64_t *cycle_, unsigned *pc, unsigned *wbr, unsigned *wbv)
+{
+        unsigned idle;
+
+        for (idle = 0; !commit.valid; ++idle) {
+                if (context->gotFinish())
+                        return 0;
+                if (idle == VCOSIM_WATCHDOG) {
+                        fprintf(stderr, "No commits from the RTL in %u cycles, bailing\n",
+                                idle);
+                        return 0;
+                }
+                tick();
+        }
+
+        commit.valid = 0;
+        *cycle_ = cycle;
+        *pc     = commit.pc;
+        *wbr    = commit.wbr;
+        *wbv    = commit.wbv;
+
+        return 1;
+}
+
+// Local Variables:
+// mode: C++
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
@@ -0,0 +1,39 @@
+#ifndef _VCOSIM_H_
+#define _VCOSIM_H_ 1
+
+/*
+ * The YARI core verilated into a C++ class (make -C Icarus verilate)
+ * and linked into yarisim for --rtl-model, see vcosim.cpp.  The model
+ * is clocked on demand, one commit at a time, in the thread running
+ * the ISA model.
+ *
+ * This header is also force included into the verilated code, which
+ * prints through vcosim_printf().
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The model reads its memory images and input.txt from dir */
+void vcosim_open(const char *dir, int verbose);
+
+/* Clock the model to its next commit, returning 0 if there is none */
+int  vcosim_commit(uint64_t *cycle, unsigned *pc, unsigned *wbr, unsigned *wbv);
+
+/* The RTL's $display output, dropped unless verbose */
+int  vcosim_printf(const char *format, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
+
+#endif
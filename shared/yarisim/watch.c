@@ -0,0 +1,200 @@
+/*
+ * Memory watchpoints, for hunting down whatever scribbles on the heap.
+ *
+ * A page holding a watchpoint has its bit set in yari->watch_map,
+ * which takes accesses to it off the fast paths (ram_ptr(), the flat
+ * memory path of load() and store(), and the host code of dbt.c) and
+ * into load() and store(), which hand them to watch_load() and
+ * watch_store() for the exact range check.  Other pages keep the fast
+ * paths, and with no watchpoints the map is NULL.
+ *
+ * The command line watchpoints (--watch, --rwatch and --awatch) log
+ * the PC, the value and, for stores, the old value, and with
+ * --stop-on-watch also stop the program after the access.  The
+ * debugger's only stop it, see gdbserver.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "mips32.h"
+#include "runmips.h"
+
+#define WATCH_MAX       64
+
+struct watch {
+        unsigned n;
+        struct {
+                uint32_t address, len;
+                int      kind;          // WATCH_*
+                int      stop;          // Rather than log
+        } w[WATCH_MAX];
+
+        int      stopped;               // See watch_stopped()
+        uint32_t stop_address;
+        int      stop_kind;
+};
+
+#define WATCH_MAP_WORDS (1 << (32 - WATCH_PAGE_BITS - 5))
+
+static struct watch *watch(void)
+{
+        if (!yari->watch) {
+                yari->watch = calloc(1, sizeof *yari->watch);
+                if (!yari->watch)
+                        fatal("Out of memory for the watchpoints\n");
+        }
+
+        return yari->watch;
+}
+
+void watch_free(yarisim_t *y)
+{
+        free(y->watch);
+        free(y->watch_map);
+        y->watch = NULL;
+        y->watch_map = NULL;
+}
+
+/*
+ * Rebuild the page map.  The translations only look at it when made,
+ * so they go whenever it comes or goes.
+ */
+static void update_map(void)
+{
+        struct watch *wt = watch();
+        uint32_t *map = yari->watch_map;
+        unsigned k;
+        uint32_t p;
+
+        if (!wt->n) {
+                free(map);
+                yari->watch_map = NULL;
+                tc_invalidate_all();
+                return;
+        }
+
+        if (!map) {
+                map = calloc(WATCH_MAP_WORDS, sizeof *map);
+                if (!map)
+                        fatal("Out of memory for the watchpoints\n");
+                yari->watch_map = map;
+                tc_invalidate_all();
+        } else
+                memset(map, 0, WATCH_MAP_WORDS * sizeof *map);
+
+        for (k = 0; k < wt->n; ++k)
+                for (p = wt->w[k].address >> WATCH_PAGE_BITS;
+                     p <= (wt->w[k].address + wt->w[k].len - 1) >> WATCH_PAGE_BITS; ++p)
+                        map[p >> 5] |= 1U << (p & 31);
+}
+
+/* Returns 0 on success, -1 if there are too many or len is bad */
+int watch_insert(uint32_t address, uint32_t len, int kind, int stop)
+{
+        struct watch *wt = watch();
+
+        if (wt->n == WATCH_MAX || !len || address + len - 1 < address)
+                return -1;
+
+        wt->w[wt->n].address = address;
+        wt->w[wt->n].len     = len;
+        wt->w[wt->n].kind    = kind;
+        wt->w[wt->n].stop    = stop;
+        ++wt->n;
+        update_map();
+
+        return 0;
+}
+
+/* Returns -1 if there was no such watchpoint */
+int watch_remove(uint32_t address, uint32_t len, int kind)
+{
+        struct watch *wt = watch();
+        unsigned k;
+
+        for (k = 0; k < wt->n; ++k)
+                if (wt->w[k].address == address && wt->w[k].len == len &&
+                    wt->w[k].kind == kind) {
+                        wt->w[k] = wt->w[--wt->n];
+                        update_map();
+                        return 0;
+                }
+
+        return -1;
+}
+
+/*
+ * Whether a stopping watchpoint stopped the program, and where.  Clears
+ * the condition.
+ */
+int watch_stopped(uint32_t *address, int *kind)
+{
+        struct watch *wt = watch();
+
+        if (!wt->stopped)
+                return 0;
+
+        wt->stopped = 0;
+        *address = wt->stop_address;
+        *kind = wt->stop_kind;
+
+        return 1;
+}
+
+static void hit(uint32_t a, int c, int kind, uint32_t v, uint32_t old)
+{
+        struct watch *wt = watch();
+        const symbol_t *sym;
+        int logged = 0;
+        unsigned k;
+
+        if (c < 4)
+                v &= (1U << 8 * c) - 1;
+
+        for (k = 0; k < wt->n; ++k) {
+                if (!(wt->w[k].kind & kind) ||
+                    a + c - 1 < wt->w[k].address ||
+                    a > wt->w[k].address + wt->w[k].len - 1)
+                        continue;
+
+                if (wt->w[k].stop || enable_stop_on_watch) {
+                        /* The engines stop as soon as they can */
+                        wt->stopped = 1;
+                        wt->stop_address = a < wt->w[k].address ? wt->w[k].address : a;
+                        wt->stop_kind = wt->w[k].kind;
+                        yari->stop_issue = 0;
+                }
+
+                if (wt->w[k].stop || logged++)
+                        continue;
+
+                printf("Watch %08x", yari->watch_pc);
+                sym = symbol_lookup(yari->watch_pc);
+                if (sym)
+                        printf(" <%s+%u>", sym->name, yari->watch_pc - sym->address);
+                if (kind == WATCH_WRITE)
+                        printf(": %0*x -> [%08x] (was %0*x)\n", 2 * c, v, a, 2 * c, old);
+                else
+                        printf(": %0*x <- [%08x]\n", 2 * c, v, a);
+        }
+}
+
+/* A load on a watched page, v is what it loaded */
+void watch_load(uint32_t a, int c, uint32_t v)
+{
+        hit(a, c, WATCH_READ, v, 0);
+}
+
+/* A store on a watched page, before it overwrites old with v */
+void watch_store(uint32_t a, int c, uint32_t v, uint32_t old)
+{
+        hit(a, c, WATCH_WRITE, v, old);
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
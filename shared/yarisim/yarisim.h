@@ -0,0 +1,78 @@
+#ifndef _YARISIM_H_
+#define _YARISIM_H_ 1
+
+/*
+ * libyarisim, the simulator core as a library.
+ *
+ * Every machine is independent, so any number of them can be run in
+ * one process, each used by one thread at a time.  Programs run on
+ * the translation cache engine.  Nothing here exits the process;
+ * errors are returned and yarisim_error() tells what went wrong.
+ *
+ *      yarisim_t *y = yarisim_create();
+ *
+ *      if (yarisim_load_elf(y, "test.elf") == YARISIM_ERROR)
+ *              ... yarisim_error(y) ...
+ *      while (yarisim_run_for(y, 1000000) == YARISIM_RUNNING)
+ *              ;
+ *      ... yarisim_exit_status(y) ...
+ *      yarisim_destroy(y);
+ *
+ * The enable_* options of the command line simulator apply to all
+ * machines; the defaults are right for the library.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct yarisim yarisim_t;
+
+/* What yarisim_run_for() and friends return */
+enum {
+        YARISIM_RUNNING,        // Still going, or for the others, success
+        YARISIM_EXITED,         // The program finished
+        YARISIM_FAULT,          // Access violation
+        YARISIM_ERROR,          // Anything else, see yarisim_error()
+};
+
+yarisim_t  *yarisim_create(void);
+void        yarisim_destroy(yarisim_t *y);
+
+/* Load a MIPS ELF executable and point the PC at its entry */
+int         yarisim_load_elf(yarisim_t *y, const char *filename);
+
+/*
+ * Save the machine to a checkpoint file, or start an empty machine
+ * (instead of loading an ELF file) from one, see checkpoint.c
+ */
+int         yarisim_checkpoint(yarisim_t *y, const char *filename);
+int         yarisim_restore(yarisim_t *y, const char *filename);
+
+/*
+ * Run at least n more instructions, stopping at the first basic
+ * block boundary after them, unless the program stops first.  Once
+ * the program has stopped, that's what is returned.
+ */
+int         yarisim_run_for(yarisim_t *y, uint64_t n);
+
+/* Copy to and from simulated RAM, failing on unmapped memory */
+int         yarisim_read_mem(yarisim_t *y, uint32_t address, void *buf, size_t len);
+int         yarisim_write_mem(yarisim_t *y, uint32_t address, const void *buf, size_t len);
+
+/* Serial port, -1 for none.  The output isn't echoed on stdout. */
+void        yarisim_set_serial(yarisim_t *y, int in_fd, int out_fd);
+
+const char *yarisim_error(yarisim_t *y);
+int         yarisim_exit_status(yarisim_t *y);
+uint64_t    yarisim_instructions(yarisim_t *y);
+uint64_t    yarisim_cycles(yarisim_t *y);
+uint32_t    yarisim_pc(yarisim_t *y);
+uint32_t    yarisim_reg(yarisim_t *y, unsigned r);
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End:
+
+#endif
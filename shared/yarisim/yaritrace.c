@@ -0,0 +1,234 @@
+/*
+ * yaritrace, look at the binary traces of yarisim --trace offline.
+ *
+ * The trace is either listed, like --verbose --regwrites would have,
+ * or summarized: the instruction mix, the number of distinct
+ * instructions and data pages touched and the hottest instructions.
+ * Both can be limited to a range of PCs and a number of records.
+ */
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include "mips32.h"
+#include "runmips.h"
+
+#define DATA_PAGE_BITS  12
+#define HOT_PCS         20
+
+/* Counts per address, open addressing, with a value seen there */
+typedef struct counts {
+        uint32_t *key, *value;
+        uint64_t *count;
+        unsigned  size, n;      // size is a power of two
+} counts_t;
+
+typedef struct hot {
+        uint64_t count;
+        uint32_t pc, inst;
+} hot_t;
+
+static uint64_t count_limit = ~0ULL;
+static uint32_t pc_from = 0, pc_to = ~0U;
+
+static void counts_grow(counts_t *c);
+
+static void counts_add(counts_t *c, uint32_t key, uint32_t value)
+{
+        unsigned h;
+
+        if (2 * (c->n + 1) > c->size)
+                counts_grow(c);
+
+        for (h = key * 2654435761U & (c->size - 1); c->count[h];
+             h = (h + 1) & (c->size - 1))
+                if (c->key[h] == key) {
+                        ++c->count[h];
+                        c->value[h] = value;
+                        return;
+                }
+
+        c->key[h] = key;
+        c->value[h] = value;
+        c->count[h] = 1;
+        ++c->n;
+}
+
+static void counts_grow(counts_t *c)
+{
+        counts_t old = *c;
+        unsigned k;
+
+        c->size = old.size ? 2 * old.size : 4096;
+        c->n = 0;
+        c->key = calloc(c->size, sizeof *c->key);
+        c->value = calloc(c->size, sizeof *c->value);
+        c->count = calloc(c->size, sizeof *c->count);
+        if (!c->key || !c->value || !c->count)
+                fatal("Out of memory\n");
+
+        for (k = 0; k < old.size; ++k)
+                if (old.count[k]) {
+                        unsigned h = old.key[k] * 2654435761U & (c->size - 1);
+
+                        while (c->count[h])
+                                h = (h + 1) & (c->size - 1);
+                        c->key[h] = old.key[k];
+                        c->value[h] = old.value[k];
+                        c->count[h] = old.count[k];
+                        ++c->n;
+                }
+
+        free(old.key);
+        free(old.value);
+        free(old.count);
+}
+
+static void list(struct trace *t)
+{
+        trace_record_t r;
+        uint64_t n;
+
+        for (n = 0; n < count_limit && trace_read(t, &r); ++n) {
+                if (r.pc < pc_from || r.pc >= pc_to)
+                        continue;
+
+                printf("%08x %08x ", r.pc, r.inst);
+                disass(r.pc, (inst_t) { .raw = r.inst });
+                if (r.wbr)
+                        printf("$%d <- %08x", r.wbr, r.wbv);
+                if (r.is_mem)
+                        printf(" [%08x]", r.address);
+                putchar('\n');
+        }
+}
+
+static int by_count(const void *a, const void *b)
+{
+        const hot_t *x = a, *y = b;
+
+        return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static void statistics(struct trace *t)
+{
+        counts_t pcs = { 0 }, pages = { 0 };
+        uint64_t n, insts = 0, loads = 0, stores = 0, writes = 0, jumps = 0;
+        hot_t *hot;
+        uint32_t next_pc = 0;
+        trace_record_t r;
+        unsigned k, m;
+
+        for (n = 0; n < count_limit && trace_read(t, &r); ++n) {
+                if (r.pc < pc_from || r.pc >= pc_to)
+                        continue;
+
+                ++insts;
+                if (insts > 1 && r.pc != next_pc)
+                        ++jumps;
+                next_pc = r.pc + 4;
+
+                counts_add(&pcs, r.pc, r.inst);
+                if (r.wbr)
+                        ++writes;
+                if (r.is_mem) {
+                        if ((r.inst >> 29) == 4)
+                                ++loads;
+                        else
+                                ++stores;
+                        counts_add(&pages, r.address >> DATA_PAGE_BITS, 0);
+                }
+        }
+
+        if (!insts) {
+                printf("No instructions in the range\n");
+                return;
+        }
+
+        printf("Instructions:         %12"PRIu64"\n", insts);
+        printf("Loads:                %12"PRIu64" (%5.2f%%)\n", loads, loads * 100.0 / insts);
+        printf("Stores:               %12"PRIu64" (%5.2f%%)\n", stores, stores * 100.0 / insts);
+        printf("Register writes:      %12"PRIu64" (%5.2f%%)\n", writes, writes * 100.0 / insts);
+        printf("Control transfers:    %12"PRIu64" (%5.2f%%)\n", jumps, jumps * 100.0 / insts);
+        printf("Distinct instructions:%12u\n", pcs.n);
+        printf("Data pages touched:   %12u (%u KiB)\n", pages.n,
+               pages.n << (DATA_PAGE_BITS - 10));
+
+        hot = malloc(pcs.n * sizeof *hot);
+        if (!hot)
+                fatal("Out of memory\n");
+        for (k = m = 0; k < pcs.size; ++k)
+                if (pcs.count[k]) {
+                        hot[m].count = pcs.count[k];
+                        hot[m].pc    = pcs.key[k];
+                        hot[m].inst  = pcs.value[k];
+                        ++m;
+                }
+        qsort(hot, m, sizeof *hot, by_count);
+
+        printf("\nHottest instructions:\n");
+        for (k = 0; k < m && k < HOT_PCS; ++k) {
+                printf("%12"PRIu64" %5.2f%%  %08x %08x ", hot[k].count,
+                       hot[k].count * 100.0 / insts, hot[k].pc, hot[k].inst);
+                disass(hot[k].pc, (inst_t) { .raw = hot[k].inst });
+                putchar('\n');
+        }
+
+        free(hot);
+}
+
+static void usage(char *program)
+{
+        fprintf(stderr,
+                "Usage: %s [options] <trace>\n"
+                "\n"
+                "  -s               statistics rather than a listing\n"
+                "  -r from:to       only instructions with from <= pc < to\n"
+                "  -n records       only the first this many records\n"
+                "\n"
+                "Traces ending in .zst or .lz4 are decompressed with zstd or lz4.\n",
+                program);
+        exit(1);
+}
+
+int main(int argc, char **argv)
+{
+        int stats = 0, c;
+        struct trace *t;
+        char *end;
+
+        while ((c = getopt(argc, argv, "sr:n:")) != -1)
+                switch (c) {
+                case 's': stats = 1; break;
+                case 'n': count_limit = strtoull(optarg, NULL, 0); break;
+                case 'r':
+                        pc_from = strtoul(optarg, &end, 0);
+                        if (*end != ':')
+                                usage(argv[0]);
+                        pc_to = strtoul(end + 1, NULL, 0);
+                        break;
+                default:  usage(argv[0]);
+                }
+
+        if (optind + 1 != argc)
+                usage(argv[0]);
+
+        t = trace_open(argv[optind]);
+        if (stats)
+                statistics(t);
+        else
+                list(t);
+        trace_close_reader(t);
+
+        return 0;
+}
+
+// Local Variables:
+// mode: C
+// c-style-variables-are-local-p: t
+// c-file-style: "linux"
+// End: